@@ -0,0 +1,121 @@
+/*
+ * Copyright (C) 2016 Raphael S. Carvalho
+ *
+ * This program can be distributed under the terms of the GNU GPL.
+ * See the file COPYING.
+ */
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <utility>
+#include <vector>
+#include <algorithm>
+#include "blockv_utils.hh"
+
+// Backs up an export of a blockv server into a file. The first backup copies
+// the whole device; the following ones only copy the extents changed since the
+// checkpoint that the previous one printed, if the server tracks changed
+// blocks of the export.
+
+#define BLOCKV_BACKUP_READ_SIZE (1024 * 1024)
+
+static void usage(const char *program_name) {
+    printf("Usage:\n" \
+           "%s <host>:<port>[/<export>] <backup file> [<checkpoint>]\n" \
+           "Copies the export into <backup file>, or only the extents changed since <checkpoint> if given,\n" \
+           "and prints the checkpoint to be given to the next backup.\n",
+           program_name);
+}
+
+int main(int argc, char **argv) {
+    if (argc != 3 && argc != 4) {
+        usage(argv[0]);
+        return -1;
+    }
+    const char* target = argv[1];
+    const char* backup_path = argv[2];
+    blockv_client client(target);
+    if (client.connect() == -1) {
+        printf("Failed to connect to %s: %s\n", target, strerror(errno));
+        return 1;
+    }
+
+    // Changes made while the backup is copied are left to the next one, so
+    // the checkpoint is taken before anything is read.
+    uint64_t checkpoint = 0;
+    bool tracked = client.checkpoint(checkpoint) == 0;
+    if (!tracked && argc == 4) {
+        printf("Failed to take a checkpoint of %s: %s\n", target, strerror(errno));
+        return 1;
+    }
+
+    std::vector<std::pair<uint64_t, uint64_t>> extents;
+    if (argc == 4) {
+        uint64_t since = strtoull(argv[3], nullptr, 10);
+        int ret = client.changed_extents(since, [&extents] (uint64_t offset, uint64_t length) {
+            extents.emplace_back(offset, length);
+        });
+        if (ret == -1) {
+            printf("Failed to list extents changed since checkpoint %lu: %s\n", since, strerror(errno));
+            if (errno == ENOENT) {
+                printf("The checkpoint was dropped, e.g. after a crash of the server, so a full backup is needed\n");
+            }
+            return 1;
+        }
+    } else {
+        extents.emplace_back(0, client.size());
+    }
+
+    int fd = open(backup_path, O_RDWR | O_CREAT, 0644);
+    struct stat st;
+    if (fd == -1 || fstat(fd, &st) == -1) {
+        printf("Unable to open backup %s: %s\n", backup_path, strerror(errno));
+        return 1;
+    }
+    if (argc == 4 && uint64_t(st.st_size) != client.size()) {
+        printf("Backup %s doesn't match the size of %s!\n", backup_path, target);
+        return 1;
+    }
+    if (ftruncate(fd, client.size()) == -1) {
+        printf("Unable to resize backup %s: %s\n", backup_path, strerror(errno));
+        return 1;
+    }
+
+    std::vector<char> buf(BLOCKV_BACKUP_READ_SIZE);
+    uint64_t copied = 0;
+    for (auto& extent : extents) {
+        for (uint64_t pos = 0; pos < extent.second; ) {
+            uint32_t size = std::min(extent.second - pos, uint64_t(buf.size()));
+            uint64_t offset = extent.first + pos;
+            if (client.read(buf.data(), size, offset) == -1) {
+                printf("Failed to read %u bytes at offset %lu from %s: %s\n", size, offset, target, strerror(errno));
+                return 1;
+            }
+            if (pwrite(fd, buf.data(), size, offset) != ssize_t(size)) {
+                printf("Failed to write backup %s: %s\n", backup_path, strerror(errno));
+                return 1;
+            }
+            pos += size;
+            copied += size;
+        }
+    }
+    if (fdatasync(fd) == -1) {
+        printf("Failed to sync backup %s: %s\n", backup_path, strerror(errno));
+        return 1;
+    }
+    close(fd);
+
+    printf("Copied %lu of %lu bytes in %lu extents\n", copied, client.size(), extents.size());
+    if (tracked) {
+        printf("Checkpoint: %lu\n", checkpoint);
+    } else {
+        printf("Changed blocks of %s aren't tracked, so the next backup must be a full one\n", target);
+    }
+    return 0;
+}
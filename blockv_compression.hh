@@ -0,0 +1,189 @@
+/*
+ * Copyright (C) 2016 Raphael S. Carvalho
+ *
+ * This program can be distributed under the terms of the GNU GPL.
+ * See the file COPYING.
+ */
+
+#ifndef COMPRESSION_H
+#define COMPRESSION_H
+
+#include <stdint.h>
+#include <string.h>
+#include <algorithm>
+
+// Compressor and decompressor for the LZ4 block format, so that blockv
+// doesn't depend on an external library. The compressor is a greedy one with
+// a single-entry hash table, which favors speed over ratio like LZ4's default
+// mode, and its output can be decompressed by any LZ4 implementation.
+
+#define BLOCKV_LZ4_HASH_BITS 12
+#define BLOCKV_LZ4_MIN_MATCH 4
+// The last match must start this many bytes before the end of the input,
+// and the last bytes are always literals.
+#define BLOCKV_LZ4_MATCH_FIND_LIMIT 12
+#define BLOCKV_LZ4_LAST_LITERALS 5
+#define BLOCKV_LZ4_MAX_OFFSET 65535
+
+static inline uint32_t lz4_read32(const uint8_t* p) {
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+// Writes a length that doesn't fit in a token nibble as a run of 255s.
+static inline uint8_t* lz4_write_length(uint8_t* op, const uint8_t* op_end, size_t length) {
+    for (; length >= 255; length -= 255) {
+        if (op == op_end) {
+            return nullptr;
+        }
+        *op++ = 255;
+    }
+    if (op == op_end) {
+        return nullptr;
+    }
+    *op++ = uint8_t(length);
+    return op;
+}
+
+// Emits a sequence: literals [anchor, anchor + literals) followed by a match
+// of match_length bytes at offset, or no match if match_length is 0.
+static inline uint8_t* lz4_write_sequence(uint8_t* op, const uint8_t* op_end, const uint8_t* anchor,
+        size_t literals, uint16_t offset, size_t match_length) {
+    if (op == op_end) {
+        return nullptr;
+    }
+    uint8_t* token = op++;
+    *token = uint8_t(std::min(literals, size_t(15)) << 4);
+    if (literals >= 15 && !(op = lz4_write_length(op, op_end, literals - 15))) {
+        return nullptr;
+    }
+    if (size_t(op_end - op) < literals) {
+        return nullptr;
+    }
+    memcpy(op, anchor, literals);
+    op += literals;
+    if (!match_length) {
+        return op;
+    }
+    if (op_end - op < 2) {
+        return nullptr;
+    }
+    *op++ = uint8_t(offset);
+    *op++ = uint8_t(offset >> 8);
+    match_length -= BLOCKV_LZ4_MIN_MATCH;
+    *token |= uint8_t(std::min(match_length, size_t(15)));
+    if (match_length >= 15 && !(op = lz4_write_length(op, op_end, match_length - 15))) {
+        return nullptr;
+    }
+    return op;
+}
+
+// Compresses src into dst. Returns the compressed size, or 0 if it doesn't
+// fit in dst_capacity bytes, e.g. because the data isn't compressible.
+static inline size_t lz4_compress(const char* src, size_t src_size, char* dst, size_t dst_capacity) {
+    const uint8_t* base = (const uint8_t*) src;
+    const uint8_t* ip = base;
+    const uint8_t* anchor = base;
+    const uint8_t* end = base + src_size;
+    uint8_t* op = (uint8_t*) dst;
+    uint8_t* op_end = op + dst_capacity;
+    uint32_t table[1 << BLOCKV_LZ4_HASH_BITS] = {};
+
+    if (src_size > BLOCKV_LZ4_MATCH_FIND_LIMIT) {
+        const uint8_t* match_find_limit = end - BLOCKV_LZ4_MATCH_FIND_LIMIT;
+        const uint8_t* match_limit = end - BLOCKV_LZ4_LAST_LITERALS;
+        // Searching speeds up over data where matches aren't found.
+        unsigned misses = 0;
+        while (ip < match_find_limit) {
+            uint32_t sequence = lz4_read32(ip);
+            uint32_t hash = (sequence * 2654435761U) >> (32 - BLOCKV_LZ4_HASH_BITS);
+            const uint8_t* ref = base + table[hash];
+            table[hash] = uint32_t(ip - base);
+            if (ref >= ip || ip - ref > BLOCKV_LZ4_MAX_OFFSET || lz4_read32(ref) != sequence) {
+                ip += 1 + (misses++ >> 6);
+                continue;
+            }
+            misses = 0;
+            const uint8_t* match_end = ip + BLOCKV_LZ4_MIN_MATCH;
+            ref += BLOCKV_LZ4_MIN_MATCH;
+            while (match_end < match_limit && *match_end == *ref) {
+                match_end++;
+                ref++;
+            }
+            op = lz4_write_sequence(op, op_end, anchor, ip - anchor, uint16_t(match_end - ref), match_end - ip);
+            if (!op) {
+                return 0;
+            }
+            ip = anchor = match_end;
+        }
+    }
+    op = lz4_write_sequence(op, op_end, anchor, end - anchor, 0, 0);
+    return (op) ? op - (uint8_t*) dst : 0;
+}
+
+// Decompresses src into dst, which must be exactly dst_size bytes once
+// decompressed. Returns 0 on success, or -1 if src is malformed, without ever
+// accessing memory out of the bounds of either buffer.
+static inline int lz4_decompress(const char* src, size_t src_size, char* dst, size_t dst_size) {
+    const uint8_t* ip = (const uint8_t*) src;
+    const uint8_t* ip_end = ip + src_size;
+    uint8_t* op = (uint8_t*) dst;
+    uint8_t* op_end = op + dst_size;
+
+    auto read_length = [&ip, ip_end] (size_t& length) {
+        uint8_t byte;
+        do {
+            if (ip == ip_end) {
+                return false;
+            }
+            byte = *ip++;
+            length += byte;
+        } while (byte == 255);
+        return true;
+    };
+
+    while (ip < ip_end) {
+        uint8_t token = *ip++;
+        size_t literals = token >> 4;
+        if (literals == 15 && !read_length(literals)) {
+            return -1;
+        }
+        if (size_t(ip_end - ip) < literals || size_t(op_end - op) < literals) {
+            return -1;
+        }
+        memcpy(op, ip, literals);
+        ip += literals;
+        op += literals;
+        if (ip == ip_end) {
+            break;
+        }
+
+        if (ip_end - ip < 2) {
+            return -1;
+        }
+        size_t offset = ip[0] | (ip[1] << 8);
+        ip += 2;
+        size_t match_length = token & 15;
+        if (match_length == 15 && !read_length(match_length)) {
+            return -1;
+        }
+        match_length += BLOCKV_LZ4_MIN_MATCH;
+        if (!offset || size_t(op - (uint8_t*) dst) < offset || size_t(op_end - op) < match_length) {
+            return -1;
+        }
+        // Matches may overlap the bytes they produce, and those are copied bytewise.
+        const uint8_t* ref = op - offset;
+        if (offset >= match_length) {
+            memcpy(op, ref, match_length);
+        } else {
+            for (size_t i = 0; i < match_length; i++) {
+                op[i] = ref[i];
+            }
+        }
+        op += match_length;
+    }
+    return (op == op_end) ? 0 : -1;
+}
+
+#endif
@@ -15,11 +15,15 @@
 #include <stdarg.h>
 #include <unistd.h>
 #include <assert.h>
+#include <sys/uio.h>
 #include <unordered_map>
 #include <functional>
 #include <mutex>
+#include <condition_variable>
+#include <thread>
 #include <memory>
 #include "blockv_protocol.hh"
+#include "blockv_utils.hh"
 
 static int log(const char *format, ...);
 
@@ -29,7 +33,10 @@ struct virtual_block_device {
     virtual bool read_only() = 0;
     virtual uint64_t size() = 0;
     virtual ssize_t read(char *buf, size_t size, off_t offset) = 0;
-    virtual ssize_t write(const char *buf, size_t size, off_t offset) = 0;
+    // A fua write is durable by the time it returns.
+    virtual ssize_t write(const char *buf, size_t size, off_t offset, bool fua) = 0;
+    // Makes every completed write durable. Returns 0 on success, or a negative errno.
+    virtual int flush() = 0;
 };
 
 struct memory_based_block_device : public virtual_block_device {
@@ -61,16 +68,25 @@ public:
         memcpy(buf, (const char *)_block_device_content + offset, size);
         return size;
     }
-    virtual ssize_t write(const char *buf, size_t size, off_t offset) {
+    virtual ssize_t write(const char *buf, size_t size, off_t offset, bool fua) {
         memcpy((char *)_block_device_content + offset, buf, size);
         return size;
     }
+
+    virtual int flush() {
+        return 0;
+    }
 };
 
 // Contains information about connection to a blockv server.
 struct blockv_server_connection {
     blockv_server_info* server_info = nullptr;
     int sockfd = -1;
+    // Requests are tagged, and pipelined, once the server accepted our hello.
+    bool tagged = false;
+    // Granted by the server in its hello response.
+    uint32_t credit_requests = 1;
+    uint32_t credit_bytes = 0;
 
     static void cleanup_server_connection(blockv_server_connection& server_connection) {
         if (server_connection.server_info) {
@@ -82,21 +98,216 @@ struct blockv_server_connection {
     }
 };
 
+// Requests to servers that speak version 6 or later are tagged and pipelined:
+// every thread sends its request as soon as the credits granted by the
+// server allow, and a receiver thread hands responses, which may come in any
+// order, to the threads waiting for them.
 struct network_block_device : public virtual_block_device {
 private:
+    // A tagged request waiting for its response, which the receiver reads
+    // into response.
+    struct pending_request {
+        char* response;
+        size_t response_size;
+        // Read responses start with the size of the data that follows.
+        bool sized;
+        uint64_t bytes; // credits taken for its size.
+        bool done = false;
+        uint32_t error = 0;
+    };
+
     blockv_server_connection _server_connection;
     std::string _target;
+    uint8_t _priority = blockv_priorities::FOREGROUND;
+    uint32_t _deadline = 0;
     std::mutex _mutex;
+    // Tagged requests are sent one at a time, but wait for their responses together.
+    std::mutex _send_mutex;
+    // Bumped, with both mutexes held, whenever the connection is reopened, so
+    // that a request of an older connection isn't sent on a socket that took
+    // over its file descriptor.
+    uint64_t _generation = 0;
+    std::condition_variable _cv;
+    std::unordered_map<uint64_t, pending_request*> _pending;
+    uint64_t _next_handle = 0;
+    uint64_t _bytes_in_flight = 0;
+    std::thread _receiver;
+    bool _broken = false;
+
+    // Reads the data of a response whose tag was received.
+    static bool receive_response(int sockfd, pending_request& p) {
+        if (!p.sized) {
+            return read_from_server(sockfd, p.response, p.response_size) == p.response_size;
+        }
+        uint32_t size;
+        if (read_from_server(sockfd, (char*)&size, sizeof(size)) != sizeof(size)) {
+            return false;
+        }
+        size = ntohl(size);
+        // The response must be consumed even if it's short, so that the next one can be read.
+        if (size > p.response_size || read_from_server(sockfd, p.response, size) != size) {
+            return false;
+        }
+        if (size != p.response_size) {
+            log("Read response size: expected: %u, actual: %u\n", p.response_size, size);
+            p.error = EIO;
+        }
+        return true;
+    }
+
+    void receive_responses(int sockfd) {
+        std::unique_lock<std::mutex> lock(_mutex);
+        for (;;) {
+            lock.unlock();
+            blockv_response_tag tag;
+            bool received = read_from_server(sockfd, (char*)&tag, blockv_response_tag::serialized_size()) == blockv_response_tag::serialized_size();
+            blockv_response_tag::to_host(tag);
+            lock.lock();
+            auto it = _pending.find(tag.handle);
+            if (!received || it == _pending.end()) {
+                break;
+            }
+            // Only the receiver touches a request until it's done.
+            pending_request& p = *it->second;
+            lock.unlock();
+            received = tag.error || receive_response(sockfd, p);
+            lock.lock();
+            if (!received) {
+                break;
+            }
+            if (tag.error) {
+                log("Server dropped request %lu: %s\n", tag.handle, strerror(tag.error));
+                p.error = tag.error;
+            }
+            p.done = true;
+            _bytes_in_flight -= p.bytes;
+            _pending.erase(it);
+            _cv.notify_all();
+        }
+        // Requests in flight fail, and the next one reconnects.
+        for (auto& it : _pending) {
+            it.second->error = EIO;
+            it.second->done = true;
+        }
+        _pending.clear();
+        _bytes_in_flight = 0;
+        _broken = true;
+        _cv.notify_all();
+    }
+
+    void start_receiver() {
+        _receiver = std::thread([this, sockfd = _server_connection.sockfd] { receive_responses(sockfd); });
+    }
+
+    // Sends a tagged request and waits for its response. bytes is the size of
+    // the read or write, which is taken from the credits. Returns 0, or the
+    // error the request failed with.
+    uint32_t tagged_request(const void* request, size_t size, uint64_t bytes, char* response, size_t response_size, bool sized) {
+        pending_request p;
+        p.response = response;
+        p.response_size = response_size;
+        p.sized = sized;
+        p.bytes = bytes;
+
+        std::unique_lock<std::mutex> lock(_mutex);
+        _cv.wait(lock, [this, bytes] {
+            return _broken || (_pending.size() < _server_connection.credit_requests &&
+                _bytes_in_flight + bytes <= _server_connection.credit_bytes);
+        });
+        if (_broken) {
+            // Nothing is in flight once the receiver gave up on the connection.
+            // It was already joined if reconnecting failed before.
+            if (_receiver.joinable()) {
+                _receiver.join();
+            }
+            std::unique_lock<std::mutex> send_lock(_send_mutex);
+            _generation++;
+            if (reconnect_to_blockv_server() || !_server_connection.tagged) {
+                return EIO;
+            }
+            send_lock.unlock();
+            _broken = false;
+            start_receiver();
+            _cv.notify_all();
+            _cv.wait(lock, [this, bytes] {
+                return _broken || (_pending.size() < _server_connection.credit_requests &&
+                    _bytes_in_flight + bytes <= _server_connection.credit_bytes);
+            });
+            if (_broken) {
+                return EIO;
+            }
+        }
+        uint64_t handle = _next_handle++;
+        int sockfd = _server_connection.sockfd;
+        uint64_t generation = _generation;
+        _pending.emplace(handle, &p);
+        _bytes_in_flight += bytes;
+        lock.unlock();
+
+        {
+            std::lock_guard<std::mutex> send_lock(_send_mutex);
+            // A request of a connection that was reopened since failed with it.
+            if (generation == _generation) {
+                blockv_request_tag tag = blockv_request_tag::to_network(_priority, handle, _deadline);
+                struct iovec iov[2] = { { &tag, blockv_request_tag::serialized_size() }, { (void*) request, size } };
+                if (::writev(sockfd, iov, 2) != ssize_t(iov[0].iov_len + iov[1].iov_len)) {
+                    log("Failed to send full request to server\n");
+                    // The receiver fails every request in flight, including this one.
+                    ::shutdown(sockfd, SHUT_RDWR);
+                }
+            }
+        }
+
+        lock.lock();
+        _cv.wait(lock, [&p] { return p.done; });
+        return p.error;
+    }
+
+    // Returns the value of an option given at the end of the target, e.g.
+    // "background" for priority in <target>?priority=background&deadline=100.
+    static std::string target_option(const char* target, const char* name) {
+        const char* options = strchr(target, '?');
+        std::string key = std::string(name) + "=";
+        for (const char* option = options; option; option = strchr(option, '&')) {
+            option++;
+            if (!strncmp(option, key.data(), key.size())) {
+                option += key.size();
+                return std::string(option, strcspn(option, "&"));
+            }
+        }
+        return std::string();
+    }
 public:
+    // Options of requests can be given at the end of the target: their
+    // priority (?priority=background or scrub) and the time in ms after which
+    // the server drops them if they're still queued (?deadline=<ms>).
     network_block_device(blockv_server_connection server_connection, const char *target)
         : _server_connection(server_connection)
-        , _target(std::string(target)) {}
+        , _target(std::string(target)) {
+        std::string priority = target_option(target, "priority");
+        if (priority == "background") {
+            _priority = blockv_priorities::BACKGROUND;
+        } else if (priority == "scrub") {
+            _priority = blockv_priorities::SCRUB;
+        }
+        _deadline = strtoul(target_option(target, "deadline").c_str(), nullptr, 10);
+        if (_server_connection.tagged) {
+            start_receiver();
+        }
+    }
 
     ~network_block_device() {
+        if (_receiver.joinable()) {
+            ::shutdown(_server_connection.sockfd, SHUT_RDWR);
+            _receiver.join();
+        }
         blockv_server_connection::cleanup_server_connection(_server_connection);
     }
 
-    static bool is_target_valid(const char *path) { return true; }
+    static bool is_target_valid(const char *path) {
+        std::string host, port, export_name;
+        return blockv_parse_target(path, host, port, export_name);
+    }
 
     static int read_from_server(int sockfd, char *buf, size_t size, size_t buf_offset = 0) {
         int64_t remaining_bytes = size;
@@ -119,50 +330,35 @@ public:
     }
 
     static int connect_to_blockv_server(blockv_server_connection& server_connection, const char *target) {
-        int sockfd, ret;
-        struct sockaddr_in servaddr;
-
-        sockfd = socket(AF_INET,SOCK_STREAM,0);
-        if (sockfd == -1) {
-            log("socket: %s", strerror(errno));
-            return -1;
-        }
-        memset(&servaddr, 0, sizeof servaddr);
-        servaddr.sin_family=AF_INET;
-        // FIXME: use target later to determine ip and port; ip and port are hardcoded by the time being.
-        servaddr.sin_port=htons(22000);
-        inet_pton(AF_INET, "127.0.0.1", &(servaddr.sin_addr));
-
-        ret = connect(sockfd,(struct sockaddr *)&servaddr,sizeof(servaddr));
-        if (ret == -1) {
-            log("connect: %s", strerror(errno));
-            close(sockfd);
+        blockv_server_info* server_info = new (std::nothrow) blockv_server_info;
+        if (!server_info) {
             return -1;
         }
-
-        size_t blockv_server_info_size = blockv_server_info::serialized_size();
-        char *buf = new (std::nothrow) char[blockv_server_info_size];
-        if (!buf) {
-            close(sockfd);
-            return -1;
-        }
-        ret = read_from_server(sockfd, buf, blockv_server_info_size);
-        if (ret != blockv_server_info_size) {
-            close(sockfd);
-            delete buf;
-            return -1;
-        }
-
-        blockv_server_info* server_info = (blockv_server_info*) buf;
-        blockv_server_info::to_host(*server_info);
-        if (!server_info->is_valid()) {
-            close(sockfd);
-            delete buf;
+        int sockfd = blockv_connect(target, *server_info);
+        if (sockfd == -1) {
+            log("Failed to connect to %s: %s\n", target, strerror(errno));
+            delete server_info;
             return -1;
         }
         server_connection.server_info = server_info;
         server_connection.sockfd = sockfd;
 
+        // Requests are tagged from version 6 on; older servers don't know HELLO
+        // or tag requests differently, and are spoken to untagged.
+        if (server_info->version >= 6) {
+            blockv_hello_request hello_request;
+            blockv_hello_response hello_response;
+            if (::write(sockfd, (const void*)&hello_request, blockv_hello_request::serialized_size()) != blockv_hello_request::serialized_size() ||
+                    read_from_server(sockfd, (char*)&hello_response, blockv_hello_response::serialized_size()) != blockv_hello_response::serialized_size()) {
+                blockv_server_connection::cleanup_server_connection(server_connection);
+                return -1;
+            }
+            blockv_hello_response::to_host(hello_response);
+            server_connection.tagged = (hello_response.error == 0);
+            server_connection.credit_requests = hello_response.credit_requests;
+            server_connection.credit_bytes = hello_response.credit_bytes;
+        }
+
         return 0;
     }
 
@@ -192,6 +388,10 @@ public:
     }
 
     virtual ssize_t read(char *buf, size_t size, off_t offset) {
+        if (_server_connection.tagged) {
+            blockv_read_request read_request = blockv_read_request::to_network(size, offset);
+            return (tagged_request(&read_request, read_request.serialized_size(), size, buf, size, true)) ? 0 : size;
+        }
         // TODO: avoid this lock somehow. that's needed for response to correspond the request issued to the server.
         std::lock_guard<std::mutex> lock(_mutex);
         int ret;
@@ -238,11 +438,41 @@ public:
         return ret;
     }
 
-    virtual ssize_t write(const char *buf, size_t size, off_t offset) {
+    ssize_t tagged_write(const char *buf, size_t size, off_t offset, bool fua) {
+        blockv_write_request* write_request = blockv_write_request::to_network(buf, size, offset, fua);
+        if (write_request == nullptr) {
+            return 0;
+        }
+        blockv_write_response write_response;
+        uint32_t error = tagged_request(write_request, write_request->serialized_size(), size, (char*)&write_response,
+            blockv_write_response::serialized_size(), false);
+        delete (char *) write_request;
+        if (error) {
+            return 0;
+        }
+        blockv_write_response::to_host(write_response);
+        // Less than asked for is written when the write failed, or when the
+        // device became read-only because it was migrated.
+        if (write_response.size != size) {
+            log("Server failed to %s: expected: %ld, actual %u\n", (fua) ? "make write durable" : "write", size, write_response.size);
+            return 0;
+        }
+        return size;
+    }
+
+    // FLUSH and WRITE_FUA were introduced in version 2 of the protocol.
+    bool server_supports_flush() {
+        return _server_connection.server_info->version >= 2;
+    }
+
+    virtual ssize_t write(const char *buf, size_t size, off_t offset, bool fua) {
+        if (_server_connection.tagged) {
+            return tagged_write(buf, size, offset, fua);
+        }
         std::lock_guard<std::mutex> lock(_mutex);
         int ret;
 
-        blockv_write_request* write_request = blockv_write_request::to_network(buf, size, offset);
+        blockv_write_request* write_request = blockv_write_request::to_network(buf, size, offset, fua && server_supports_flush());
         if (write_request == nullptr) {
             return 0;
         }
@@ -263,10 +493,54 @@ public:
             reconnect_to_blockv_server();
             return 0;
         }
-        // FIXME: ignoring write response by the time being.
+        blockv_write_response::to_host(write_response);
+        // Less than asked for is written when the write failed, or when the
+        // device became read-only because it was migrated.
+        if (write_response.size != size) {
+            log("Server failed to %s: expected: %ld, actual %u\n", (fua) ? "make write durable" : "write", size, write_response.size);
+            return 0;
+        }
 
         return size;
     }
+
+    virtual int flush() {
+        if (_server_connection.tagged) {
+            blockv_flush_request flush_request;
+            blockv_flush_response flush_response;
+            uint32_t error = tagged_request(&flush_request, blockv_flush_request::serialized_size(), 0, (char*)&flush_response,
+                blockv_flush_response::serialized_size(), false);
+            if (error) {
+                return -EIO;
+            }
+            blockv_flush_response::to_host(flush_response);
+            return -int(flush_response.error);
+        }
+        std::lock_guard<std::mutex> lock(_mutex);
+        int ret;
+
+        if (!server_supports_flush()) {
+            return 0;
+        }
+
+        blockv_flush_request flush_request;
+        ret = ::write(_server_connection.sockfd, (const void*)&flush_request, blockv_flush_request::serialized_size());
+        if (ret != blockv_flush_request::serialized_size()) {
+            log("Failed to send flush request to server\n");
+            reconnect_to_blockv_server();
+            return -EIO;
+        }
+
+        blockv_flush_response flush_response;
+        ret = read_from_server(_server_connection.sockfd, (char*)&flush_response, blockv_flush_response::serialized_size());
+        if (ret != blockv_flush_response::serialized_size()) {
+            log("Failed to get full response from server: expected: %ld, actual %d\n", blockv_flush_response::serialized_size(), ret);
+            reconnect_to_blockv_server();
+            return -EIO;
+        }
+        blockv_flush_response::to_host(flush_response);
+        return -int(flush_response.error);
+    }
 };
 
 struct blockv_fuse {
@@ -525,11 +799,23 @@ static int fs_read(const char *path, char *buf, size_t size, off_t offset, struc
 }
 
 static int fs_write(const char *path, const char *buf, size_t size, off_t offset, struct fuse_file_info *fi) {
-    return rw(path, buf, size, offset, false, [] (auto block_device, const void *buf, size_t size, off_t offset) {
-        return block_device->write((const char *)buf, size, offset);
+    bool fua = fi->flags & O_DSYNC;
+    return rw(path, buf, size, offset, false, [fua] (auto block_device, const void *buf, size_t size, off_t offset) {
+        return block_device->write((const char *)buf, size, offset, fua);
     });
 }
 
+static int fs_fsync(const char *path, int datasync, struct fuse_file_info *fi) {
+    struct blockv_fuse* fs = get_filesystem_context();
+    auto block_device = fs->get_block_device(path);
+
+    if (!block_device) {
+        return -ENOENT;
+    }
+
+    return block_device->flush();
+}
+
 static struct fuse_operations fs_oper;
 static struct blockv_fuse fs;
 
@@ -544,6 +830,7 @@ int main(int argc, char *argv[])
     fs_oper.truncate = fs_truncate;
     fs_oper.read = fs_read;
     fs_oper.write = fs_write;
+    fs_oper.fsync = fs_fsync;
 
     log("Initializing fuse...");
     return fuse_main(argc, argv, &fs_oper, (void*) &fs);
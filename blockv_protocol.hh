@@ -10,9 +10,21 @@
 
 #include <arpa/inet.h>
 #include <endian.h>
+#include <string.h>
+#include <new>
+#include <limits>
 
 #define BLOCKV_MAGIC_VALUE 0xB0B0B0B0
-#define BLOCKV_PROTOCOL_VERSION 1
+// Version 2 adds WRITE_FUA and FLUSH requests.
+// Version 3 adds SNAPSHOT request.
+// Version 4 adds HELLO request, after which requests are tagged with a priority.
+// Version 5 adds CANCEL request; tags carry a handle and a deadline, and
+// responses to tagged requests are tagged with the handle and a status.
+// Version 6 adds credits for flow control to the HELLO response.
+// Version 7 adds EXPORT request, which selects one of the devices of the server.
+// Version 8 adds MIGRATE request, which hands a device over to another server.
+// Version 9 adds CHECKPOINT and CHANGED_EXTENTS requests, for incremental backups.
+#define BLOCKV_PROTOCOL_VERSION 9
 
 struct blockv_server_info {
     uint32_t magic_value;
@@ -51,7 +63,25 @@ enum blockv_requests : uint8_t {
     READ = 0xB1,
     WRITE = 0xB2,
     FINISH = 0xB3,
-    LAST = FINISH + 1,
+    WRITE_FUA = 0xB4, // write that is durable by the time it's acknowledged.
+    FLUSH = 0xB5, // makes every acknowledged write durable.
+    SNAPSHOT = 0xB6, // creates a point-in-time copy of the device on the server.
+    HELLO = 0xB7, // tells the server which version of the protocol the client speaks.
+    CANCEL = 0xB8, // drops a request that is still queued in the server.
+    EXPORT = 0xB9, // selects the device served to the connection by name.
+    MIGRATE = 0xBA, // stops writes to the device, which another server is migrating.
+    CHECKPOINT = 0xBB, // starts tracking the blocks of the device changed from now on.
+    CHANGED_EXTENTS = 0xBC, // lists the extents of the device changed since a checkpoint.
+    LAST = CHANGED_EXTENTS + 1,
+};
+
+// Classes of requests, from the most to the least urgent. Lower classes are
+// served after higher ones, but they're guaranteed a minimum share of the device.
+enum blockv_priorities : uint8_t {
+    FOREGROUND = 0, // e.g. a database serving users.
+    BACKGROUND = 1, // e.g. backups.
+    SCRUB = 2, // e.g. checking that data is still readable.
+    PRIORITIES,
 };
 
 struct blockv_read_request {
@@ -144,14 +174,14 @@ struct blockv_write_request {
         return serialized_size(ntohl(size));
     }
 
-    static blockv_write_request* to_network(const char *buf, uint32_t buf_size, uint64_t off) {
+    static blockv_write_request* to_network(const char *buf, uint32_t buf_size, uint64_t off, bool fua = false) {
         size_t bytes_to_allocate = serialized_size(buf_size);
         blockv_write_request* to = (blockv_write_request*) new (std::nothrow) char[bytes_to_allocate];
         if (!to) {
             return nullptr;
         }
 
-        to->request = blockv_requests::WRITE;
+        to->request = (fua) ? blockv_requests::WRITE_FUA : blockv_requests::WRITE;
         to->size = htonl(buf_size);
         to->offset = htobe64(off);
         memcpy(to->buf, buf, buf_size);
@@ -183,6 +213,374 @@ struct blockv_write_response {
     }
 } __attribute__((packed));
 
+struct blockv_flush_request {
+    uint8_t request = blockv_requests::FLUSH;
+
+    static size_t serialized_size() {
+        return sizeof(request);
+    }
+} __attribute__((packed));
+
+struct blockv_flush_response {
+    uint32_t error; // 0 on success, errno value of the failed sync otherwise.
+
+    static size_t serialized_size() {
+        return sizeof(uint32_t);
+    }
+
+    static blockv_flush_response to_network(uint32_t error) {
+        blockv_flush_response flush_response;
+        flush_response.error = htonl(error);
+        return flush_response;
+    }
+
+    static void to_host(blockv_flush_response& flush_response) {
+        flush_response.error = ntohl(flush_response.error);
+    }
+} __attribute__((packed));
+
+struct blockv_snapshot_request {
+    uint8_t request;
+    uint8_t name_size;
+    char name[]; // not null terminated.
+
+    blockv_snapshot_request() = delete;
+
+    static size_t serialized_size(uint8_t name_size) {
+        return sizeof(request) + sizeof(name_size) + name_size;
+    }
+
+    size_t serialized_size() {
+        return serialized_size(name_size);
+    }
+
+    static blockv_snapshot_request* to_network(const char *name) {
+        size_t name_size = strlen(name);
+        if (name_size > std::numeric_limits<uint8_t>::max()) {
+            return nullptr;
+        }
+        blockv_snapshot_request* to = (blockv_snapshot_request*) new (std::nothrow) char[serialized_size(name_size)];
+        if (!to) {
+            return nullptr;
+        }
+
+        to->request = blockv_requests::SNAPSHOT;
+        to->name_size = name_size;
+        memcpy(to->name, name, name_size);
+        return to;
+    }
+} __attribute__((packed));
+
+struct blockv_snapshot_response {
+    uint32_t error; // 0 on success, errno value otherwise.
+
+    static size_t serialized_size() {
+        return sizeof(uint32_t);
+    }
+
+    static blockv_snapshot_response to_network(uint32_t error) {
+        blockv_snapshot_response snapshot_response;
+        snapshot_response.error = htonl(error);
+        return snapshot_response;
+    }
+
+    static void to_host(blockv_snapshot_response& snapshot_response) {
+        snapshot_response.error = ntohl(snapshot_response.error);
+    }
+} __attribute__((packed));
+
+// Sent by clients that speak version 4 or later, right after receiving the
+// server info. Clients that don't send it are served as version 3 ones, and
+// the ones that do must wait for the response before sending tagged requests.
+struct blockv_hello_request {
+    uint8_t request = blockv_requests::HELLO;
+    uint8_t version = BLOCKV_PROTOCOL_VERSION;
+
+    static size_t serialized_size() {
+        return sizeof(request) + sizeof(version);
+    }
+} __attribute__((packed));
+
+// Grants the client credits: it may have up to credit_requests tagged
+// requests in flight, whose reads and writes add up to credit_bytes at most.
+// The credits of a request are given back by its response.
+struct blockv_hello_response {
+    uint32_t error; // 0 if the server speaks the client's version, EPROTONOSUPPORT otherwise.
+    uint32_t credit_requests;
+    uint32_t credit_bytes;
+
+    static size_t serialized_size() {
+        return sizeof(error) + sizeof(credit_requests) + sizeof(credit_bytes);
+    }
+
+    static blockv_hello_response to_network(uint32_t error, uint32_t credit_requests, uint32_t credit_bytes) {
+        blockv_hello_response hello_response;
+        hello_response.error = htonl(error);
+        hello_response.credit_requests = htonl(credit_requests);
+        hello_response.credit_bytes = htonl(credit_bytes);
+        return hello_response;
+    }
+
+    static void to_host(blockv_hello_response& hello_response) {
+        hello_response.error = ntohl(hello_response.error);
+        hello_response.credit_requests = ntohl(hello_response.credit_requests);
+        hello_response.credit_bytes = ntohl(hello_response.credit_bytes);
+    }
+} __attribute__((packed));
+
+// Once HELLO succeeds, it precedes every request sent in the connection.
+// Requests are then pipelined: the client may send more before responses
+// arrive, and responses come in order of completion, tagged with the handle.
+struct blockv_request_tag {
+    uint8_t priority = blockv_priorities::FOREGROUND;
+    uint64_t handle = 0; // chosen by the client to match responses and to cancel.
+    uint32_t deadline = 0; // ms from arrival after which the request is dropped, 0 for none.
+
+    static size_t serialized_size() {
+        return sizeof(priority) + sizeof(handle) + sizeof(deadline);
+    }
+
+    bool is_valid() const {
+        return priority < blockv_priorities::PRIORITIES;
+    }
+
+    static blockv_request_tag to_network(uint8_t priority, uint64_t handle, uint32_t deadline) {
+        blockv_request_tag to;
+        to.priority = priority;
+        to.handle = htobe64(handle);
+        to.deadline = htonl(deadline);
+        return to;
+    }
+
+    static void to_host(blockv_request_tag& tag) {
+        tag.handle = be64toh(tag.handle);
+        tag.deadline = ntohl(tag.deadline);
+    }
+} __attribute__((packed));
+
+// Precedes the response to a tagged request. The response itself follows only
+// if error is 0; the request was dropped without doing any I/O if it's
+// ETIMEDOUT (deadline passed) or ECANCELED (cancelled by the client).
+struct blockv_response_tag {
+    uint64_t handle;
+    uint32_t error;
+
+    static size_t serialized_size() {
+        return sizeof(handle) + sizeof(error);
+    }
+
+    static blockv_response_tag to_network(uint64_t handle, uint32_t error) {
+        blockv_response_tag to;
+        to.handle = htobe64(handle);
+        to.error = htonl(error);
+        return to;
+    }
+
+    static void to_host(blockv_response_tag& tag) {
+        tag.handle = be64toh(tag.handle);
+        tag.error = ntohl(tag.error);
+    }
+} __attribute__((packed));
+
+// Responded to with a response tag only, whose error is 0 if the request was
+// cancelled, or ENOENT if it's no longer queued (it may be running already).
+struct blockv_cancel_request {
+    uint8_t request = blockv_requests::CANCEL;
+    uint64_t handle; // of the request to be cancelled.
+
+    static size_t serialized_size() {
+        return sizeof(request) + sizeof(handle);
+    }
+
+    static blockv_cancel_request to_network(uint64_t handle) {
+        blockv_cancel_request to;
+        to.handle = htobe64(handle);
+        return to;
+    }
+
+    static void to_host(blockv_cancel_request& cancel_request) {
+        cancel_request.handle = be64toh(cancel_request.handle);
+    }
+} __attribute__((packed));
+
+// Sent by clients that speak version 7 or later, as the first request of the
+// connection, to be served another device than the default one, whose info
+// was sent when the connection was accepted.
+struct blockv_export_request {
+    uint8_t request;
+    uint8_t name_size;
+    char name[]; // not null terminated.
+
+    blockv_export_request() = delete;
+
+    static size_t serialized_size(uint8_t name_size) {
+        return sizeof(request) + sizeof(name_size) + name_size;
+    }
+
+    size_t serialized_size() {
+        return serialized_size(name_size);
+    }
+
+    static blockv_export_request* to_network(const char *name) {
+        size_t name_size = strlen(name);
+        if (name_size > std::numeric_limits<uint8_t>::max()) {
+            return nullptr;
+        }
+        blockv_export_request* to = (blockv_export_request*) new (std::nothrow) char[serialized_size(name_size)];
+        if (!to) {
+            return nullptr;
+        }
+
+        to->request = blockv_requests::EXPORT;
+        to->name_size = name_size;
+        memcpy(to->name, name, name_size);
+        return to;
+    }
+} __attribute__((packed));
+
+// Replaces the server info: requests that follow are served by the export.
+struct blockv_export_response {
+    uint32_t error; // 0 on success, ENOENT if there's no such export, EINVAL if it isn't the first request.
+    uint64_t device_size;
+    uint8_t read_only;
+
+    static size_t serialized_size() {
+        return sizeof(error) + sizeof(device_size) + sizeof(read_only);
+    }
+
+    static blockv_export_response to_network(uint32_t error, uint64_t device_size, bool read_only) {
+        blockv_export_response export_response;
+        export_response.error = htonl(error);
+        export_response.device_size = htobe64(device_size);
+        export_response.read_only = uint8_t(read_only);
+        return export_response;
+    }
+
+    static void to_host(blockv_export_response& export_response) {
+        export_response.error = ntohl(export_response.error);
+        export_response.device_size = be64toh(export_response.device_size);
+    }
+} __attribute__((packed));
+
+// Sent by the server a device is migrated to, before it serves the device:
+// from then on, the device only takes writes on the destination.
+struct blockv_migrate_request {
+    uint8_t request = blockv_requests::MIGRATE;
+
+    static size_t serialized_size() {
+        return sizeof(request);
+    }
+} __attribute__((packed));
+
+struct blockv_migrate_response {
+    uint32_t error; // 0 once every acknowledged write is durable, errno value of the failed sync otherwise.
+
+    static size_t serialized_size() {
+        return sizeof(uint32_t);
+    }
+
+    static blockv_migrate_response to_network(uint32_t error) {
+        blockv_migrate_response migrate_response;
+        migrate_response.error = htonl(error);
+        return migrate_response;
+    }
+
+    static void to_host(blockv_migrate_response& migrate_response) {
+        migrate_response.error = ntohl(migrate_response.error);
+    }
+} __attribute__((packed));
+
+struct blockv_checkpoint_request {
+    uint8_t request = blockv_requests::CHECKPOINT;
+
+    static size_t serialized_size() {
+        return sizeof(request);
+    }
+} __attribute__((packed));
+
+struct blockv_checkpoint_response {
+    uint32_t error; // 0 on success, EOPNOTSUPP if the device doesn't track changed blocks.
+    uint64_t checkpoint; // id to be given to CHANGED_EXTENTS.
+
+    static size_t serialized_size() {
+        return sizeof(error) + sizeof(checkpoint);
+    }
+
+    static blockv_checkpoint_response to_network(uint32_t error, uint64_t checkpoint) {
+        blockv_checkpoint_response checkpoint_response;
+        checkpoint_response.error = htonl(error);
+        checkpoint_response.checkpoint = htobe64(checkpoint);
+        return checkpoint_response;
+    }
+
+    static void to_host(blockv_checkpoint_response& checkpoint_response) {
+        checkpoint_response.error = ntohl(checkpoint_response.error);
+        checkpoint_response.checkpoint = be64toh(checkpoint_response.checkpoint);
+    }
+} __attribute__((packed));
+
+// The list of changed extents has no bound, so it's only streamed to
+// untagged connections. Tagged ones are answered with EOPNOTSUPP in the tag.
+struct blockv_changed_extents_request {
+    uint8_t request = blockv_requests::CHANGED_EXTENTS;
+    uint64_t checkpoint;
+
+    static size_t serialized_size() {
+        return sizeof(request) + sizeof(checkpoint);
+    }
+
+    static blockv_changed_extents_request to_network(uint64_t checkpoint) {
+        blockv_changed_extents_request to;
+        to.checkpoint = htobe64(checkpoint);
+        return to;
+    }
+
+    static void to_host(blockv_changed_extents_request& changed_extents_request) {
+        changed_extents_request.checkpoint = be64toh(changed_extents_request.checkpoint);
+    }
+} __attribute__((packed));
+
+// Followed, if error is 0, by the extents changed since the checkpoint in
+// offset order, and by an extent of length 0 that ends the list.
+struct blockv_changed_extents_response {
+    uint32_t error; // 0 on success, ENOENT if the checkpoint is unknown, e.g. because it was dropped.
+
+    static size_t serialized_size() {
+        return sizeof(error);
+    }
+
+    static blockv_changed_extents_response to_network(uint32_t error) {
+        blockv_changed_extents_response changed_extents_response;
+        changed_extents_response.error = htonl(error);
+        return changed_extents_response;
+    }
+
+    static void to_host(blockv_changed_extents_response& changed_extents_response) {
+        changed_extents_response.error = ntohl(changed_extents_response.error);
+    }
+} __attribute__((packed));
+
+struct blockv_extent {
+    uint64_t offset;
+    uint64_t length;
+
+    static size_t serialized_size() {
+        return sizeof(offset) + sizeof(length);
+    }
+
+    static blockv_extent to_network(uint64_t offset, uint64_t length) {
+        blockv_extent extent;
+        extent.offset = htobe64(offset);
+        extent.length = htobe64(length);
+        return extent;
+    }
+
+    static void to_host(blockv_extent& extent) {
+        extent.offset = be64toh(extent.offset);
+        extent.length = be64toh(extent.length);
+    }
+} __attribute__((packed));
+
 struct blockv_request {
     uint8_t request;
 
@@ -9,149 +9,5988 @@
 #include <sys/stat.h>
 #include <sys/socket.h>
 #include <sys/ioctl.h>
+#include <sys/uio.h>
+#include <sys/file.h>
+#include <signal.h>
 #include <fcntl.h>
+#include <getopt.h>
 #include <netdb.h>
+#include <netinet/tcp.h>
 #include <stdio.h>
 #include <string.h>
 #include <unistd.h>
 #include <errno.h>
 #include <assert.h>
 #include <stdlib.h>
+#include <limits.h>
 #include <utility>
 #include <memory>
 #include <limits>
 #include <shared_mutex>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <chrono>
+#include <map>
+#include <vector>
+#include <string>
+#include <array>
+#include <set>
+#include <atomic>
+#include <functional>
+#include <deque>
+#include <list>
+#include <unordered_map>
+#include <algorithm>
 #include <linux/fs.h>
+#ifdef __SSE2__
+#include <immintrin.h>
+#endif
 #include "blockv_protocol.hh"
+#include "blockv_compression.hh"
+#include "blockv_utils.hh"
 
 #define BLOCKV_SERVER_PORT 22000
 
-struct block_device {
+// Default bound on how long a write may sit in the write combiner before it
+// reaches the disk, and on how much data it may hold.
+#define BLOCKV_DEFAULT_COALESCE_DELAY_US 1000
+#define BLOCKV_DEFAULT_COALESCE_MAX_BYTES (4 * 1024 * 1024)
+
+// Default upper bound on how long a group commit waits for more durable
+// requests to join a batch before it issues fdatasync().
+#define BLOCKV_DEFAULT_GROUP_COMMIT_WINDOW_US 500
+
+// Histogram with power-of-two buckets, cheap enough to be updated on every request.
+struct log2_histogram {
+private:
+    std::array<uint64_t, 64> _buckets = {};
+    uint64_t _count = 0;
+    uint64_t _sum = 0;
+public:
+    void add(uint64_t value) {
+        unsigned bucket = (value) ? 64 - __builtin_clzll(value) : 0;
+        _buckets[std::min(bucket, unsigned(_buckets.size() - 1))]++;
+        _count++;
+        _sum += value;
+    }
+
+    void print(const char* name, const char* unit) const {
+        printf("%s: %lu samples, average %.1f %s\n", name, _count, (_count) ? double(_sum) / _count : 0.0, unit);
+        for (unsigned i = 0; i < _buckets.size(); i++) {
+            if (_buckets[i]) {
+                uint64_t low = (i) ? uint64_t(1) << (i - 1) : 0;
+                printf("  [%lu, %lu) %s: %lu\n", low, uint64_t(1) << i, unit, _buckets[i]);
+            }
+        }
+    }
+};
+
+// Bitmap with one bit per fixed-size block of a device.
+struct block_bitmap {
+protected:
+    uint64_t _block_size;
+    uint64_t _blocks;
+    std::vector<uint64_t> _words;
+public:
+    block_bitmap(uint64_t device_size, uint64_t block_size)
+        : _block_size(block_size)
+        , _blocks((device_size + block_size - 1) / block_size)
+        , _words((_blocks + 63) / 64) {}
+
+    uint64_t block_size() const {
+        return _block_size;
+    }
+
+    uint64_t blocks() const {
+        return _blocks;
+    }
+
+    bool test(uint64_t block) const {
+        return _words[block / 64] & (uint64_t(1) << (block % 64));
+    }
+
+    void set(uint64_t block) {
+        _words[block / 64] |= uint64_t(1) << (block % 64);
+    }
+
+    void clear(uint64_t block) {
+        _words[block / 64] &= ~(uint64_t(1) << (block % 64));
+    }
+
+    uint64_t count() const {
+        uint64_t n = 0;
+        for (uint64_t word : _words) {
+            n += __builtin_popcountll(word);
+        }
+        return n;
+    }
+
+    // Sets the bits that are set in other, which must cover as many blocks.
+    void merge(const block_bitmap& other) {
+        for (size_t i = 0; i < _words.size(); i++) {
+            _words[i] |= other._words[i];
+        }
+    }
+};
+
+// Tells whether a buffer contains only zeroes. Data that isn't zero usually
+// differs early on, so a short prefix is checked first; the rest is scanned
+// with vector instructions when they're available.
+static bool is_zero_buffer(const char* buf, size_t size) {
+    size_t i = 0;
+    size_t prefix = std::min(size, size_t(16));
+    for (; i < prefix; i++) {
+        if (buf[i]) {
+            return false;
+        }
+    }
+#if defined(__AVX2__)
+    for (; i + 128 <= size; i += 128) {
+        __m256i acc = _mm256_loadu_si256((const __m256i*)(buf + i));
+        acc = _mm256_or_si256(acc, _mm256_loadu_si256((const __m256i*)(buf + i + 32)));
+        acc = _mm256_or_si256(acc, _mm256_loadu_si256((const __m256i*)(buf + i + 64)));
+        acc = _mm256_or_si256(acc, _mm256_loadu_si256((const __m256i*)(buf + i + 96)));
+        if (!_mm256_testz_si256(acc, acc)) {
+            return false;
+        }
+    }
+#elif defined(__SSE2__)
+    const __m128i zero = _mm_setzero_si128();
+    for (; i + 64 <= size; i += 64) {
+        __m128i acc = _mm_loadu_si128((const __m128i*)(buf + i));
+        acc = _mm_or_si128(acc, _mm_loadu_si128((const __m128i*)(buf + i + 16)));
+        acc = _mm_or_si128(acc, _mm_loadu_si128((const __m128i*)(buf + i + 32)));
+        acc = _mm_or_si128(acc, _mm_loadu_si128((const __m128i*)(buf + i + 48)));
+        if (_mm_movemask_epi8(_mm_cmpeq_epi8(acc, zero)) != 0xFFFF) {
+            return false;
+        }
+    }
+#endif
+    for (; i < size; i++) {
+        if (buf[i]) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static const char zero_page[4096] = {};
+
+// Writes zeroes over [offset, offset + size) of fd.
+static int write_zeroes_to(int fd, uint64_t offset, uint64_t size) {
+    while (size) {
+        size_t chunk = std::min(size, uint64_t(sizeof(zero_page)));
+        ssize_t ret = pwrite(fd, zero_page, chunk, offset);
+        if (ret == -1) {
+            return -1;
+        }
+        offset += ret;
+        size -= ret;
+    }
+    return 0;
+}
+
+// Deallocates [offset, offset + size) of fd, so it reads back as zeroes
+// without taking space. Falls back to writing zeroes where the file system
+// or device can't do it.
+static int punch_hole(int fd, uint64_t offset, uint64_t size) {
+    if (!size || fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, offset, size) == 0) {
+        return 0;
+    }
+    if (errno != EOPNOTSUPP && errno != ENODEV) {
+        return -1;
+    }
+    return write_zeroes_to(fd, offset, size);
+}
+
+// Storage behind an exported block device. Functions follow the conventions
+// of the system calls they're modeled after: -1 is returned and errno is set
+// on failure.
+struct storage_backend {
+    virtual ~storage_backend() {}
+
+    virtual ssize_t read(char* buf, uint32_t size, uint64_t offset) = 0;
+    virtual ssize_t writev(const struct iovec* iov, int iovcnt, uint64_t offset) = 0;
+    // Makes every completed write durable.
+    virtual int sync() = 0;
+
+    // Same as read(), but fails with EAGAIN instead of waiting for the disk,
+    // e.g. because the data isn't in the page cache.
+    virtual ssize_t read_nowait(char* buf, uint32_t size, uint64_t offset) {
+        errno = EAGAIN;
+        return -1;
+    }
+
+    // Starts reading [offset, offset + size) into a cache in the background,
+    // as it's about to be read. It's only a hint, which backends may ignore.
+    virtual void readahead(uint64_t offset, uint64_t size) {}
+
+    // Drops [offset, offset + size) from caches, as it won't be read again
+    // soon. It's only a hint, which backends may ignore.
+    virtual void drop_cache(uint64_t offset, uint64_t size) {}
+
+    // Same as lseek() with SEEK_DATA or SEEK_HOLE, for backends that can
+    // tell which ranges are unallocated and read back as zeroes.
+    virtual int64_t seek(uint64_t offset, int whence) {
+        errno = EOPNOTSUPP;
+        return -1;
+    }
+
+    // Creates a point-in-time copy of the device at path. Data may still be
+    // copied in the background after it returns, but the copy reflects the
+    // device at the time of the call.
+    virtual int snapshot(const char* path, uint64_t size, uint64_t copy_bandwidth) {
+        errno = EOPNOTSUPP;
+        return -1;
+    }
+
+    // Zeroes [offset, offset + size). Backends that can keep the range
+    // unallocated should do so.
+    virtual int write_zeroes(uint64_t offset, uint64_t size) {
+        while (size) {
+            size_t chunk = std::min(size, uint64_t(sizeof(zero_page)));
+            if (write(zero_page, chunk, offset) == -1) {
+                return -1;
+            }
+            offset += chunk;
+            size -= chunk;
+        }
+        return 0;
+    }
+
+    ssize_t write(const char* buf, uint32_t size, uint64_t offset) {
+        struct iovec iov = { const_cast<char*>(buf), size };
+        return writev(&iov, 1, offset);
+    }
+};
+
+#define BLOCKV_SNAPSHOT_COPY_CHUNK_SIZE (1024 * 1024)
+#define BLOCKV_DEFAULT_SNAPSHOT_COPY_BANDWIDTH (64 * 1024 * 1024)
+
+// Backend that reads and writes a disk image or block device in place.
+struct file_backend : public storage_backend {
 private:
+    // Snapshot being copied in the background because the file system
+    // can't share extents between files. Chunks that are about to be
+    // overwritten are copied first, so the snapshot keeps its old data.
+    struct background_copy {
+        int fd;
+        std::string partial_path;
+        std::string path;
+        uint64_t size;
+        uint64_t bandwidth;
+        block_bitmap copied;
+        std::thread thread;
+        bool done = false;
+        bool stopping = false;
+
+        background_copy(int fd, const std::string& path, uint64_t size, uint64_t bandwidth)
+            : fd(fd)
+            , partial_path(path + ".partial")
+            , path(path)
+            , size(size)
+            , bandwidth(bandwidth)
+            , copied(size, BLOCKV_SNAPSHOT_COPY_CHUNK_SIZE) {}
+    };
+
     int _fd;
-    uint64_t _block_device_size;
-    bool _read_only;
+    std::mutex _snapshot_mutex;
+    std::unique_ptr<background_copy> _copy;
+    std::atomic<bool> _copy_in_progress{false};
+    // Cleared if the kernel or the file system doesn't support RWF_NOWAIT.
+    std::atomic<bool> _nowait_supported{true};
+
+    // Must be called with _snapshot_mutex held.
+    int copy_chunk(uint64_t chunk, std::vector<char>& buf) {
+        uint64_t offset = chunk * _copy->copied.block_size();
+        size_t length = std::min(uint64_t(buf.size()), _copy->size - offset);
+        ssize_t ret = pread(_fd, buf.data(), length, offset);
+        if (ret == -1 || pwrite(_copy->fd, buf.data(), ret, offset) != ret) {
+            return -1;
+        }
+        _copy->copied.set(chunk);
+        return 0;
+    }
+
+    void copy_loop() {
+        using clock = std::chrono::steady_clock;
+        std::vector<char> buf(BLOCKV_SNAPSHOT_COPY_CHUNK_SIZE);
+        auto start = clock::now();
+        uint64_t copied_bytes = 0;
+
+        for (uint64_t chunk = 0; chunk < _copy->copied.blocks(); chunk++) {
+            {
+                std::lock_guard<std::mutex> lock(_snapshot_mutex);
+                if (_copy->stopping) {
+                    printf("Snapshot %s was interrupted, leaving %s behind\n", _copy->path.c_str(), _copy->partial_path.c_str());
+                    break;
+                }
+                if (_copy->copied.test(chunk)) {
+                    continue;
+                }
+                if (copy_chunk(chunk, buf) == -1) {
+                    perror("Failed to copy snapshot");
+                    break;
+                }
+            }
+            // Stay within the bandwidth budget, so client I/O isn't starved.
+            copied_bytes += buf.size();
+            if (_copy->bandwidth) {
+                std::this_thread::sleep_until(start + std::chrono::microseconds(copied_bytes * 1000000 / _copy->bandwidth));
+            }
+        }
+
+        std::lock_guard<std::mutex> lock(_snapshot_mutex);
+        if (_copy->copied.count() == _copy->copied.blocks()) {
+            if (fdatasync(_copy->fd) == 0 && rename(_copy->partial_path.c_str(), _copy->path.c_str()) == 0) {
+                printf("Snapshot %s was copied\n", _copy->path.c_str());
+            } else {
+                perror("Failed to complete snapshot");
+            }
+        }
+        close(_copy->fd);
+        _copy->done = true;
+        _copy_in_progress = false;
+    }
+
+    // Preserves the old data of chunks of the snapshot that are about to be
+    // overwritten.
+    int copy_before_write(uint64_t offset, uint64_t size) {
+        std::lock_guard<std::mutex> lock(_snapshot_mutex);
+        // Nothing is left to copy of an empty range, or of an empty device.
+        if (!_copy || _copy->done || !size || !_copy->copied.blocks()) {
+            return 0;
+        }
+        std::vector<char> buf(BLOCKV_SNAPSHOT_COPY_CHUNK_SIZE);
+        uint64_t last = std::min((offset + size - 1) / buf.size(), _copy->copied.blocks() - 1);
+        for (uint64_t chunk = offset / buf.size(); chunk <= last; chunk++) {
+            if (!_copy->copied.test(chunk) && copy_chunk(chunk, buf) == -1) {
+                return -1;
+            }
+        }
+        return 0;
+    }
+
+    void stop_background_copy() {
+        if (!_copy) {
+            return;
+        }
+        {
+            std::lock_guard<std::mutex> lock(_snapshot_mutex);
+            _copy->stopping = true;
+        }
+        _copy->thread.join();
+        _copy.reset();
+    }
+public:
+    explicit file_backend(int fd) : _fd(fd) {}
+    ~file_backend() {
+        stop_background_copy();
+        close(_fd);
+    }
+
+    virtual ssize_t read(char* buf, uint32_t size, uint64_t offset) {
+        return pread(_fd, buf, size, offset);
+    }
+
+    // Only data that is entirely in the page cache is read, as a short read
+    // would still have to wait for the disk to be completed.
+    virtual ssize_t read_nowait(char* buf, uint32_t size, uint64_t offset) {
+#ifdef RWF_NOWAIT
+        if (_nowait_supported) {
+            struct iovec iov = { buf, size };
+            ssize_t ret = preadv2(_fd, &iov, 1, offset, RWF_NOWAIT);
+            if (ret == -1 && (errno == ENOSYS || errno == EOPNOTSUPP)) {
+                _nowait_supported = false;
+            }
+            if (ret == size || (ret == -1 && errno != EAGAIN && _nowait_supported)) {
+                return ret;
+            }
+        }
+#endif
+        errno = EAGAIN;
+        return -1;
+    }
+
+    virtual void readahead(uint64_t offset, uint64_t size) {
+        posix_fadvise(_fd, offset, size, POSIX_FADV_WILLNEED);
+    }
+
+    // Dirty pages are left alone, so only pages that were read are dropped.
+    virtual void drop_cache(uint64_t offset, uint64_t size) {
+        posix_fadvise(_fd, offset, size, POSIX_FADV_DONTNEED);
+    }
+
+    virtual int64_t seek(uint64_t offset, int whence) {
+        return lseek(_fd, offset, whence);
+    }
+
+    virtual ssize_t writev(const struct iovec* iov, int iovcnt, uint64_t offset) {
+        if (_copy_in_progress) {
+            uint64_t size = 0;
+            for (int i = 0; i < iovcnt; i++) {
+                size += iov[i].iov_len;
+            }
+            if (copy_before_write(offset, size) == -1) {
+                return -1;
+            }
+        }
+        return pwritev(_fd, iov, iovcnt, offset);
+    }
+
+    virtual int write_zeroes(uint64_t offset, uint64_t size) {
+        if (_copy_in_progress && copy_before_write(offset, size) == -1) {
+            return -1;
+        }
+        return punch_hole(_fd, offset, size);
+    }
+
+    virtual int sync() {
+        return fdatasync(_fd);
+    }
+
+    // Shares extents with the snapshot through FICLONE when the file system
+    // supports it (e.g. XFS or btrfs), which makes the snapshot instant.
+    // Otherwise falls back to a background copy limited to copy_bandwidth
+    // bytes per second. Must be called with writes quiesced.
+    virtual int snapshot(const char* path, uint64_t size, uint64_t copy_bandwidth) {
+        if (_copy && _copy->done) {
+            stop_background_copy();
+        }
+        if (_copy) {
+            errno = EBUSY;
+            return -1;
+        }
+        if (access(path, F_OK) == 0) {
+            errno = EEXIST;
+            return -1;
+        }
+        std::string partial_path = std::string(path) + ".partial";
+        int fd = open(partial_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_LARGEFILE, 0644);
+        if (fd == -1) {
+            return -1;
+        }
+
+        if (::ioctl(fd, FICLONE, _fd) == 0) {
+            if (rename(partial_path.c_str(), path) == -1) {
+                close(fd);
+                return -1;
+            }
+            close(fd);
+            printf("Snapshot %s was created with reflink\n", path);
+            return 0;
+        }
+        if (errno != EOPNOTSUPP && errno != EXDEV && errno != EINVAL && errno != ENOTTY) {
+            int saved_errno = errno;
+            close(fd);
+            unlink(partial_path.c_str());
+            errno = saved_errno;
+            return -1;
+        }
+        if (ftruncate(fd, size) == -1) {
+            close(fd);
+            return -1;
+        }
+
+        printf("Reflink isn't supported, copying snapshot %s in the background\n", path);
+        std::lock_guard<std::mutex> lock(_snapshot_mutex);
+        _copy.reset(new background_copy(fd, path, size, copy_bandwidth));
+        _copy_in_progress = true;
+        _copy->thread = std::thread([this] { copy_loop(); });
+        return 0;
+    }
+};
+
+// Writes every iovec in full, possibly in several calls. Returns 0 on success
+// and -1 on failure, with errno set.
+static int pwritev_all(int fd, std::vector<struct iovec> iov, uint64_t offset) {
+    size_t first = 0;
+    while (first < iov.size()) {
+        int count = std::min(iov.size() - first, size_t(IOV_MAX));
+        ssize_t ret = pwritev(fd, iov.data() + first, count, offset);
+        if (ret == -1) {
+            return -1;
+        }
+        offset += ret;
+        while (first < iov.size() && size_t(ret) >= iov[first].iov_len) {
+            ret -= iov[first].iov_len;
+            first++;
+        }
+        if (ret) {
+            iov[first].iov_base = (char*)iov[first].iov_base + ret;
+            iov[first].iov_len -= ret;
+        }
+    }
+    return 0;
+}
+
+// 64-bit FNV-1a, used to detect torn or stale journal records.
+static uint64_t fnv1a_64(const void* data, size_t size, uint64_t hash = 0xcbf29ce484222325ULL) {
+    const unsigned char* p = (const unsigned char*) data;
+    for (size_t i = 0; i < size; i++) {
+        hash = (hash ^ p[i]) * 0x100000001b3ULL;
+    }
+    return hash;
+}
+
+#define BLOCKV_JOURNAL_MAGIC 0x4A524E4C
+#define BLOCKV_JOURNAL_RECORD_MAGIC 0x4A524543
+// Records start after the superblock, which is padded to this size.
+#define BLOCKV_JOURNAL_DATA_START 4096
+#define BLOCKV_DEFAULT_JOURNAL_FOLD_THRESHOLD (256 * 1024 * 1024)
+// Time the cleaner waits before retrying a fold that failed.
+#define BLOCKV_JOURNAL_RETRY_INTERVAL_S 1
+
+// Stored in host byte order since the journal never leaves the server.
+struct journal_superblock {
+    uint32_t magic;
+    uint32_t unused;
+    uint64_t head; // offset of the first record that wasn't folded into the base image.
+    uint64_t head_sequence; // sequence number of the record at head.
+} __attribute__((packed));
+
+struct journal_record_header {
+    uint32_t magic;
+    uint32_t size; // bytes of data following the header.
+    uint64_t offset; // offset of data in the exported device.
+    uint64_t sequence;
+    uint64_t checksum; // covers offset, size, sequence and data.
+
+    uint64_t compute_checksum_of_metadata() const {
+        uint64_t hash = fnv1a_64(&offset, sizeof(offset));
+        hash = fnv1a_64(&size, sizeof(size), hash);
+        return fnv1a_64(&sequence, sizeof(sequence), hash);
+    }
+} __attribute__((packed));
+
+// Backend for random-write-heavy exports. Writes are appended sequentially to
+// a journal file, and an in-memory extent index maps device offsets to their
+// latest data in the journal. Reads check the index first and fall back to
+// the base image. A cleaner thread folds the journal back into the base image
+// once it grows past a threshold, then releases the folded part of the
+// journal. The index is rebuilt by replaying the journal at startup, so
+// acknowledged writes survive a crash as long as they were synced.
+struct journal_backend : public storage_backend {
+private:
+    struct extent {
+        uint64_t length;
+        uint64_t journal_offset;
+    };
+
+    int _base_fd;
+    int _journal_fd = -1;
+    uint64_t _fold_threshold;
+
+    // Protects index and journal positions. Readers hold it shared for as long
+    // as they access the journal, so that folded data isn't released under them.
     std::shared_timed_mutex _mutex;
+    // Entries are keyed by device offset and never overlap each other.
+    std::map<uint64_t, extent> _index;
+    uint64_t _head = BLOCKV_JOURNAL_DATA_START;
+    uint64_t _tail = BLOCKV_JOURNAL_DATA_START;
+    uint64_t _next_sequence = 0;
 
-    uint32_t get_actual_size(uint32_t size, uint64_t offset) const {
-        uint32_t actual_size = 0;
-        if (offset < _block_device_size) {
-            // Do nothing if offset + size causes integer overflow.
-            if (offset + size < offset) {
-                return 0;
+    std::mutex _cleaner_mutex;
+    std::condition_variable _cleaner_cv;
+    bool _stopping = false;
+    std::thread _cleaner;
+
+    uint64_t _folds = 0;
+    uint64_t _folded_bytes = 0;
+    uint64_t _fold_failures = 0;
+
+    // Must be called with _mutex held exclusively.
+    void map_extent(uint64_t offset, uint64_t length, uint64_t journal_offset) {
+        uint64_t end = offset + length;
+        auto it = _index.upper_bound(offset);
+        if (it != _index.begin()) {
+            --it;
+        }
+        while (it != _index.end() && it->first < end) {
+            uint64_t entry_offset = it->first;
+            extent e = it->second;
+            uint64_t entry_end = entry_offset + e.length;
+            if (entry_end <= offset) {
+                ++it;
+                continue;
+            }
+            it = _index.erase(it);
+            if (entry_offset < offset) {
+                _index.emplace(entry_offset, extent{ offset - entry_offset, e.journal_offset });
+            }
+            if (entry_end > end) {
+                it = _index.emplace(end, extent{ entry_end - end, e.journal_offset + (end - entry_offset) }).first;
+            }
+        }
+        _index.emplace(offset, extent{ length, journal_offset });
+    }
+
+    int write_superblock(uint64_t head, uint64_t head_sequence) {
+        journal_superblock sb = { BLOCKV_JOURNAL_MAGIC, 0, head, head_sequence };
+        if (pwrite(_journal_fd, &sb, sizeof(sb), 0) != sizeof(sb)) {
+            return -1;
+        }
+        return 0;
+    }
+
+    // Reads a record at pos, checking that it's complete and that it's the
+    // record expected next. Returns its header, or false on the end of the log.
+    bool read_record(uint64_t pos, uint64_t expected_sequence, uint64_t journal_size, journal_record_header& hdr) {
+        if (pos + sizeof(hdr) > journal_size || pread(_journal_fd, &hdr, sizeof(hdr), pos) != sizeof(hdr)) {
+            return false;
+        }
+        if (hdr.magic != BLOCKV_JOURNAL_RECORD_MAGIC || hdr.sequence != expected_sequence ||
+                pos + sizeof(hdr) + hdr.size > journal_size) {
+            return false;
+        }
+        uint64_t hash = hdr.compute_checksum_of_metadata();
+        std::vector<char> buf(std::min(uint32_t(1024 * 1024), hdr.size));
+        for (uint64_t done = 0; done < hdr.size; ) {
+            size_t to_read = std::min(uint64_t(buf.size()), hdr.size - done);
+            if (pread(_journal_fd, buf.data(), to_read, pos + sizeof(hdr) + done) != ssize_t(to_read)) {
+                return false;
+            }
+            hash = fnv1a_64(buf.data(), to_read, hash);
+            done += to_read;
+        }
+        return hash == hdr.checksum;
+    }
+
+    void replay() {
+        journal_superblock sb;
+        struct stat st;
+        if (fstat(_journal_fd, &st) == -1) {
+            perror("fstat");
+            exit(1);
+        }
+        if (pread(_journal_fd, &sb, sizeof(sb), 0) != sizeof(sb) || sb.magic != BLOCKV_JOURNAL_MAGIC) {
+            if (st.st_size > 0) {
+                printf("Journal has an invalid superblock!\n");
+                exit(1);
+            }
+            sb = { BLOCKV_JOURNAL_MAGIC, 0, BLOCKV_JOURNAL_DATA_START, 0 };
+            if (write_superblock(sb.head, sb.head_sequence) == -1 || fdatasync(_journal_fd) == -1) {
+                perror("Unable to initialize journal");
+                exit(1);
+            }
+        }
+
+        uint64_t pos = sb.head;
+        uint64_t sequence = sb.head_sequence;
+        uint64_t records = 0;
+        journal_record_header hdr;
+        while (read_record(pos, sequence, st.st_size, hdr)) {
+            map_extent(hdr.offset, hdr.size, pos + sizeof(hdr));
+            pos += sizeof(hdr) + hdr.size;
+            sequence++;
+            records++;
+        }
+        // Drop whatever follows the last valid record, e.g. a torn write.
+        if (uint64_t(st.st_size) > pos && ftruncate(_journal_fd, pos) == -1) {
+            perror("ftruncate");
+            exit(1);
+        }
+
+        _head = sb.head;
+        _tail = pos;
+        _next_sequence = sequence;
+        printf("Journal: replayed %lu records (%lu bytes) into %lu extents\n", records, _tail - _head, _index.size());
+    }
+
+    int copy_to_base(uint64_t journal_offset, uint64_t length, uint64_t offset, std::vector<char>& buf) {
+        for (uint64_t done = 0; done < length; ) {
+            size_t chunk = std::min(uint64_t(buf.size()), length - done);
+            if (pread(_journal_fd, buf.data(), chunk, journal_offset + done) != ssize_t(chunk)) {
+                return -1;
+            }
+            if (pwrite(_base_fd, buf.data(), chunk, offset + done) != ssize_t(chunk)) {
+                return -1;
+            }
+            done += chunk;
+        }
+        return 0;
+    }
+
+    // Folds every record written so far into the base image. Writes proceed
+    // concurrently; they land after the folded part of the journal. Returns -1
+    // with errno set if the records couldn't be made durable in the base
+    // image, in which case the journal is left as it was.
+    int fold() {
+        std::vector<std::pair<uint64_t, extent>> extents;
+        uint64_t fold_end, fold_sequence;
+        {
+            std::shared_lock<std::shared_timed_mutex> lock(_mutex);
+            fold_end = _tail;
+            fold_sequence = _next_sequence;
+            extents.assign(_index.begin(), _index.end());
+        }
+
+        std::vector<char> buf(1024 * 1024);
+        uint64_t bytes = 0;
+        for (auto& it : extents) {
+            if (copy_to_base(it.second.journal_offset, it.second.length, it.first, buf) == -1) {
+                perror("Failed to fold journal into base image");
+                return -1;
+            }
+            bytes += it.second.length;
+        }
+        // The journal can only be released once folded data is durable.
+        if (fdatasync(_base_fd) == -1 || write_superblock(fold_end, fold_sequence) == -1 || fdatasync(_journal_fd) == -1) {
+            perror("Failed to fold journal into base image");
+            return -1;
+        }
+
+        std::lock_guard<std::shared_timed_mutex> lock(_mutex);
+        for (auto it = _index.begin(); it != _index.end(); ) {
+            it = (it->second.journal_offset < fold_end) ? _index.erase(it) : std::next(it);
+        }
+        _head = fold_end;
+        if (_head == _tail) {
+            // Journal is empty, so start over from the beginning of the file.
+            if (write_superblock(BLOCKV_JOURNAL_DATA_START, _next_sequence) == 0 &&
+                    ftruncate(_journal_fd, BLOCKV_JOURNAL_DATA_START) == 0) {
+                _head = _tail = BLOCKV_JOURNAL_DATA_START;
+            }
+        } else if (fallocate(_journal_fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+                BLOCKV_JOURNAL_DATA_START, fold_end - BLOCKV_JOURNAL_DATA_START) == -1 && errno != EOPNOTSUPP) {
+            perror("fallocate");
+        }
+        _folds++;
+        _folded_bytes += bytes;
+        return 0;
+    }
+
+    bool needs_fold() {
+        std::shared_lock<std::shared_timed_mutex> lock(_mutex);
+        return _tail - _head >= _fold_threshold;
+    }
+
+    void cleaner_loop() {
+        std::unique_lock<std::mutex> lock(_cleaner_mutex);
+        while (!_stopping) {
+            if (!needs_fold()) {
+                _cleaner_cv.wait(lock);
+                continue;
+            }
+            lock.unlock();
+            int ret = fold();
+            lock.lock();
+            // Retrying right away would most likely fail the same way.
+            if (ret == -1) {
+                _fold_failures++;
+                _cleaner_cv.wait_for(lock, std::chrono::seconds(BLOCKV_JOURNAL_RETRY_INTERVAL_S), [this] { return _stopping; });
+            }
+        }
+    }
+public:
+    journal_backend(int base_fd, const char* journal_path, uint64_t fold_threshold)
+        : _base_fd(base_fd)
+        , _fold_threshold(fold_threshold) {
+        _journal_fd = open(journal_path, O_RDWR | O_CREAT | O_LARGEFILE, 0644);
+        if (_journal_fd == -1) {
+            printf("Unable to open journal %s: %s\n", journal_path, strerror(errno));
+            exit(1);
+        }
+        replay();
+        _cleaner = std::thread([this] { cleaner_loop(); });
+    }
+
+    ~journal_backend() {
+        {
+            std::lock_guard<std::mutex> lock(_cleaner_mutex);
+            _stopping = true;
+        }
+        _cleaner_cv.notify_one();
+        _cleaner.join();
+        printf("Journal: %lu folds (%lu failed), %lu bytes folded into base image, %lu bytes pending\n", _folds, _fold_failures,
+            _folded_bytes, _tail - _head);
+        close(_journal_fd);
+        close(_base_fd);
+    }
+
+    virtual ssize_t read(char* buf, uint32_t size, uint64_t offset) {
+        std::shared_lock<std::shared_timed_mutex> lock(_mutex);
+        uint64_t pos = offset;
+        uint64_t end = offset + size;
+
+        auto it = _index.upper_bound(offset);
+        if (it != _index.begin() && std::prev(it)->first + std::prev(it)->second.length > offset) {
+            --it;
+        }
+        while (pos < end) {
+            uint64_t piece_end;
+            ssize_t ret;
+            if (it != _index.end() && it->first <= pos) {
+                piece_end = std::min(end, it->first + it->second.length);
+                ret = pread(_journal_fd, buf + (pos - offset), piece_end - pos, it->second.journal_offset + (pos - it->first));
+                ++it;
+            } else {
+                piece_end = (it != _index.end()) ? std::min(end, it->first) : end;
+                ret = pread(_base_fd, buf + (pos - offset), piece_end - pos, pos);
+            }
+            if (ret == -1) {
+                return -1;
+            }
+            if (uint64_t(ret) != piece_end - pos) {
+                return pos - offset + ret;
+            }
+            pos = piece_end;
+        }
+        return size;
+    }
+
+    virtual ssize_t writev(const struct iovec* iov, int iovcnt, uint64_t offset) {
+        journal_record_header hdr;
+        hdr.magic = BLOCKV_JOURNAL_RECORD_MAGIC;
+        hdr.offset = offset;
+        hdr.size = 0;
+        for (int i = 0; i < iovcnt; i++) {
+            hdr.size += iov[i].iov_len;
+        }
+
+        std::vector<struct iovec> record;
+        record.reserve(iovcnt + 1);
+        record.push_back({ &hdr, sizeof(hdr) });
+        record.insert(record.end(), iov, iov + iovcnt);
+
+        bool wake_cleaner;
+        {
+            std::lock_guard<std::shared_timed_mutex> lock(_mutex);
+            hdr.sequence = _next_sequence;
+            hdr.checksum = hdr.compute_checksum_of_metadata();
+            for (int i = 0; i < iovcnt; i++) {
+                hdr.checksum = fnv1a_64(iov[i].iov_base, iov[i].iov_len, hdr.checksum);
+            }
+            if (pwritev_all(_journal_fd, record, _tail) == -1) {
+                return -1;
+            }
+            map_extent(offset, hdr.size, _tail + sizeof(hdr));
+            _tail += sizeof(hdr) + hdr.size;
+            _next_sequence++;
+            wake_cleaner = _tail - _head >= _fold_threshold;
+        }
+        if (wake_cleaner) {
+            std::lock_guard<std::mutex> lock(_cleaner_mutex);
+            _cleaner_cv.notify_one();
+        }
+        return hdr.size;
+    }
+
+    virtual int sync() {
+        return fdatasync(_journal_fd);
+    }
+};
+
+#define BLOCKV_BITMAP_MAGIC 0x424D4150
+#define BLOCKV_BITMAP_PAGE_SIZE 4096
+
+// Block bitmap stored in a file, so that it survives restarts. Changes are
+// only guaranteed to be in the file after sync().
+struct persistent_bitmap : public block_bitmap {
+private:
+    struct header {
+        uint32_t magic;
+        uint32_t unused;
+        uint64_t block_size;
+        uint64_t blocks;
+    } __attribute__((packed));
+
+    int _fd;
+    // Serializes syncs, so that an older copy of a page never overwrites a newer one.
+    std::mutex _sync_mutex;
+    std::mutex _mutex;
+    std::vector<bool> _dirty_pages;
+    bool _dirty = false;
+
+    static size_t words_per_page() {
+        return BLOCKV_BITMAP_PAGE_SIZE / sizeof(uint64_t);
+    }
+
+    void mark_dirty(uint64_t block) {
+        _dirty_pages[block / 64 / words_per_page()] = true;
+        _dirty = true;
+    }
+public:
+    persistent_bitmap(const char* path, uint64_t device_size, uint64_t block_size)
+        : block_bitmap(device_size, block_size)
+        , _dirty_pages((_words.size() + words_per_page() - 1) / words_per_page()) {
+        _fd = open(path, O_RDWR | O_CREAT, 0644);
+        if (_fd == -1) {
+            printf("Unable to open bitmap %s: %s\n", path, strerror(errno));
+            exit(1);
+        }
+        header hdr;
+        ssize_t ret = pread(_fd, &hdr, sizeof(hdr), 0);
+        if (ret == 0) {
+            hdr = { BLOCKV_BITMAP_MAGIC, 0, block_size, _blocks };
+            if (pwrite(_fd, &hdr, sizeof(hdr), 0) != sizeof(hdr) || ftruncate(_fd, sizeof(hdr) + _words.size() * sizeof(uint64_t)) == -1) {
+                perror("Unable to initialize bitmap");
+                exit(1);
+            }
+            return;
+        }
+        if (ret != sizeof(hdr) || hdr.magic != BLOCKV_BITMAP_MAGIC || hdr.block_size != block_size || hdr.blocks != _blocks) {
+            printf("Bitmap %s doesn't match the device it's used with!\n", path);
+            exit(1);
+        }
+        size_t bytes = _words.size() * sizeof(uint64_t);
+        if (pread(_fd, _words.data(), bytes, sizeof(hdr)) != ssize_t(bytes)) {
+            printf("Bitmap %s is truncated!\n", path);
+            exit(1);
+        }
+    }
+
+    ~persistent_bitmap() {
+        sync();
+        close(_fd);
+    }
+
+    // Unlike block_bitmap, these are safe to be called concurrently.
+    bool test(uint64_t block) {
+        std::lock_guard<std::mutex> lock(_mutex);
+        return block_bitmap::test(block);
+    }
+
+    void set(uint64_t block) {
+        std::lock_guard<std::mutex> lock(_mutex);
+        if (!block_bitmap::test(block)) {
+            block_bitmap::set(block);
+            mark_dirty(block);
+        }
+    }
+
+    void clear(uint64_t block) {
+        std::lock_guard<std::mutex> lock(_mutex);
+        if (block_bitmap::test(block)) {
+            block_bitmap::clear(block);
+            mark_dirty(block);
+        }
+    }
+
+    uint64_t count() {
+        std::lock_guard<std::mutex> lock(_mutex);
+        return block_bitmap::count();
+    }
+
+    void merge_into(block_bitmap& to) {
+        std::lock_guard<std::mutex> lock(_mutex);
+        to.merge(*this);
+    }
+
+    int sync() {
+        return sync([] { return 0; });
+    }
+
+    // Same as sync(), but calls sync_data() between capturing the dirty pages
+    // and writing them, for bits that tell where data lives. A bit is set once
+    // its data is written, so sync_data() makes the data of every captured
+    // bit durable, while bits set later wait for the next sync.
+    int sync(const std::function<int()>& sync_data) {
+        std::lock_guard<std::mutex> sync_lock(_sync_mutex);
+        std::map<size_t, std::vector<uint64_t>> pages;
+        {
+            std::lock_guard<std::mutex> lock(_mutex);
+            if (!_dirty) {
+                return sync_data();
+            }
+            for (size_t page = 0; page < _dirty_pages.size(); page++) {
+                if (!_dirty_pages[page]) {
+                    continue;
+                }
+                size_t first_word = page * words_per_page();
+                size_t last_word = std::min(first_word + words_per_page(), _words.size());
+                pages[page].assign(_words.begin() + first_word, _words.begin() + last_word);
+                _dirty_pages[page] = false;
+            }
+            _dirty = false;
+        }
+        int ret = sync_data();
+        for (auto it = pages.begin(); ret != -1 && it != pages.end(); ++it) {
+            size_t first_word = it->first * words_per_page();
+            size_t bytes = it->second.size() * sizeof(uint64_t);
+            if (pwrite(_fd, it->second.data(), bytes, sizeof(header) + first_word * sizeof(uint64_t)) != ssize_t(bytes)) {
+                ret = -1;
+            }
+        }
+        if (ret != -1) {
+            ret = fdatasync(_fd);
+        }
+        if (ret == -1) {
+            // Left for the next sync to retry.
+            int error = errno;
+            std::lock_guard<std::mutex> lock(_mutex);
+            for (auto& page : pages) {
+                _dirty_pages[page.first] = true;
+            }
+            _dirty = true;
+            errno = error;
+        }
+        return ret;
+    }
+};
+
+#define BLOCKV_DEFAULT_OVERLAY_BLOCK_SIZE (64 * 1024)
+
+// Writable copy-on-write overlay on top of a shared, read-only base image.
+// Modified blocks live in a sparse delta file at the same offsets they have
+// in the device, and an allocation bitmap tells which blocks of the delta are
+// valid. Reads of unmodified blocks fall through to the base image.
+struct overlay_backend : public storage_backend {
+private:
+    int _base_fd;
+    int _delta_fd;
+    uint64_t _size;
+    persistent_bitmap _allocated;
+    uint64_t _copied_up_blocks = 0;
+
+    // Reads [offset, offset + size) from a single source, which is either
+    // the delta or the base.
+    ssize_t read_from(int fd, char* buf, uint64_t size, uint64_t offset) {
+        ssize_t ret = pread(fd, buf, size, offset);
+        if (ret >= 0 && uint64_t(ret) < size) {
+            // Sparse delta or base shorter than the device reads as zeroes.
+            memset(buf + ret, 0, size - ret);
+            ret = size;
+        }
+        return ret;
+    }
+
+    // Copies a block from the base into the delta before it's partially written.
+    int copy_up(uint64_t block) {
+        uint64_t offset = block * _allocated.block_size();
+        uint64_t length = std::min(_allocated.block_size(), _size - offset);
+        std::vector<char> buf(length);
+        if (read_from(_base_fd, buf.data(), length, offset) == -1 ||
+                pwrite(_delta_fd, buf.data(), length, offset) != ssize_t(length)) {
+            return -1;
+        }
+        _copied_up_blocks++;
+        return 0;
+    }
+public:
+    overlay_backend(int base_fd, int delta_fd, uint64_t size, const char* bitmap_path, uint64_t block_size)
+        : _base_fd(base_fd)
+        , _delta_fd(delta_fd)
+        , _size(size)
+        , _allocated(bitmap_path, size, block_size) {
+        printf("Overlay: %lu of %lu blocks allocated in delta\n", _allocated.count(), _allocated.blocks());
+    }
+
+    ~overlay_backend() {
+        printf("Overlay: %lu blocks copied up from base image\n", _copied_up_blocks);
+        close(_delta_fd);
+        close(_base_fd);
+    }
+
+    virtual ssize_t read(char* buf, uint32_t size, uint64_t offset) {
+        uint64_t block_size = _allocated.block_size();
+        uint64_t pos = offset;
+        uint64_t end = offset + size;
+
+        // Issue one read per run of blocks that come from the same file.
+        while (pos < end) {
+            bool allocated = _allocated.test(pos / block_size);
+            uint64_t run_end = std::min(end, (pos / block_size + 1) * block_size);
+            while (run_end < end && _allocated.test(run_end / block_size) == allocated) {
+                run_end = std::min(end, run_end + block_size);
+            }
+            if (read_from((allocated) ? _delta_fd : _base_fd, buf + (pos - offset), run_end - pos, pos) == -1) {
+                return -1;
+            }
+            pos = run_end;
+        }
+        return size;
+    }
+
+    virtual ssize_t writev(const struct iovec* iov, int iovcnt, uint64_t offset) {
+        uint64_t block_size = _allocated.block_size();
+        uint64_t size = 0;
+        for (int i = 0; i < iovcnt; i++) {
+            size += iov[i].iov_len;
+        }
+        if (!size) {
+            return 0;
+        }
+
+        // Only the first and last blocks may be partially written.
+        uint64_t first = offset / block_size;
+        uint64_t last = (offset + size - 1) / block_size;
+        for (uint64_t block : { first, last }) {
+            uint64_t block_start = block * block_size;
+            uint64_t block_end = std::min(block_start + block_size, _size);
+            bool fully_written = offset <= block_start && offset + size >= block_end;
+            if (!fully_written && !_allocated.test(block) && copy_up(block) == -1) {
+                return -1;
+            }
+        }
+
+        std::vector<struct iovec> data(iov, iov + iovcnt);
+        if (pwritev_all(_delta_fd, data, offset) == -1) {
+            return -1;
+        }
+        for (uint64_t block = first; block <= last; block++) {
+            _allocated.set(block);
+        }
+        return size;
+    }
+
+    // Blocks that are zeroed entirely are punched out of the delta, but
+    // remain allocated so they don't fall through to the base image.
+    virtual int write_zeroes(uint64_t offset, uint64_t size) {
+        uint64_t block_size = _allocated.block_size();
+        uint64_t end = offset + size;
+        uint64_t full_start = (offset + block_size - 1) / block_size * block_size;
+        uint64_t full_end = (end == _size) ? end : end / block_size * block_size;
+        if (full_start >= full_end) {
+            return storage_backend::write_zeroes(offset, size);
+        }
+        if (storage_backend::write_zeroes(offset, full_start - offset) == -1 ||
+                storage_backend::write_zeroes(full_end, end - full_end) == -1 ||
+                punch_hole(_delta_fd, full_start, full_end - full_start) == -1) {
+            return -1;
+        }
+        for (uint64_t block = full_start / block_size; block * block_size < full_end; block++) {
+            _allocated.set(block);
+        }
+        return 0;
+    }
+
+    virtual int sync() {
+        return _allocated.sync([this] { return fdatasync(_delta_fd); });
+    }
+};
+
+#define BLOCKV_DEFAULT_PROXY_BLOCK_SIZE (64 * 1024)
+// Absent blocks in a row that are fetched from the upstream in one request.
+#define BLOCKV_PROXY_MAX_FETCH (1024 * 1024)
+// Time hydration waits for the upstream after failing to fetch from it.
+#define BLOCKV_PROXY_RETRY_INTERVAL_S 1
+#define BLOCKV_DEFAULT_MIGRATE_BANDWIDTH (64 * 1024 * 1024)
+#define BLOCKV_MIGRATE_PROGRESS_INTERVAL_S 10
+
+// Caching proxy of a device exported by another blockv server (upstream).
+// Blocks are fetched from the upstream the first time they're read, and
+// kept in a sparse local cache file at the same offsets they have in the
+// device, whose presence bitmap tells which blocks are valid. Optionally,
+// the whole device is hydrated into the cache in the background. Writes are
+// kept in the cache, and never reach the upstream.
+// A migration is a proxy that hydrates the whole device, and whose upstream
+// (the source) stopped taking writes, so that once every block is present,
+// the cache holds the device and the source can be shut down.
+struct proxy_backend : public storage_backend {
+private:
+    std::string _upstream;
+    int _cache_fd;
+    uint64_t _size;
+    persistent_bitmap _present;
+    // Serializes filling the cache with writes, so that data fetched from
+    // the upstream never overwrites newer data of a block written meanwhile.
+    std::mutex _fill_mutex;
+    std::mutex _clients_mutex;
+    std::vector<std::unique_ptr<blockv_client>> _idle_clients;
+    uint64_t _hydrate_bandwidth;
+    bool _migrating;
+    std::thread _hydrator;
+    std::atomic<bool> _stopping{false};
+    std::atomic<uint64_t> _fetched_blocks{0};
+    std::atomic<uint64_t> _fetched_bytes{0};
+
+    // Reads from the upstream through an idle connection, so that reads of
+    // several clients are fetched concurrently.
+    int fetch(char* buf, uint32_t size, uint64_t offset) {
+        std::unique_ptr<blockv_client> client;
+        {
+            std::lock_guard<std::mutex> lock(_clients_mutex);
+            if (!_idle_clients.empty()) {
+                client = std::move(_idle_clients.back());
+                _idle_clients.pop_back();
+            }
+        }
+        if (!client) {
+            client.reset(new blockv_client(_upstream));
+            // Blocks read from a source that took writes again, e.g. after
+            // it restarted, could miss some of them.
+            if (_migrating && client->migrate() == -1) {
+                printf("Unable to stop writes to migration source %s: %s\n", _upstream.c_str(), strerror(errno));
+                errno = EIO;
+                return -1;
+            }
+        }
+        int ret = client->read(buf, size, offset);
+        if (ret == -1) {
+            printf("Failed to read %u bytes at offset %lu from upstream %s: %s\n", size, offset, _upstream.c_str(), strerror(errno));
+            errno = EIO;
+            return -1;
+        }
+        std::lock_guard<std::mutex> lock(_clients_mutex);
+        _idle_clients.push_back(std::move(client));
+        return 0;
+    }
+
+    // Fetches blocks [first, last] from the upstream into buf, and fills the
+    // ones that are still absent into the cache. Blocks that were written
+    // meanwhile are read back from the cache instead.
+    int fill(char* buf, uint64_t first, uint64_t last) {
+        uint64_t block_size = _present.block_size();
+        uint64_t offset = first * block_size;
+        uint64_t length = std::min((last + 1) * block_size, _size) - offset;
+        if (fetch(buf, length, offset) == -1) {
+            return -1;
+        }
+        std::lock_guard<std::mutex> lock(_fill_mutex);
+        for (uint64_t block = first; block <= last; block++) {
+            uint64_t block_offset = block * block_size;
+            uint64_t block_length = std::min(block_size, _size - block_offset);
+            char* block_buf = buf + (block_offset - offset);
+            if (_present.test(block)) {
+                if (pread(_cache_fd, block_buf, block_length, block_offset) != ssize_t(block_length)) {
+                    return -1;
+                }
+                continue;
+            }
+            if (pwrite(_cache_fd, block_buf, block_length, block_offset) != ssize_t(block_length)) {
+                return -1;
+            }
+            _present.set(block);
+            _fetched_blocks++;
+            _fetched_bytes += block_length;
+        }
+        return 0;
+    }
+
+    void hydrate_loop() {
+        using clock = std::chrono::steady_clock;
+        uint64_t block_size = _present.block_size();
+        uint64_t max_blocks = std::max(uint64_t(BLOCKV_PROXY_MAX_FETCH) / block_size, uint64_t(1));
+        std::vector<char> buf(max_blocks * block_size);
+        auto start = clock::now();
+        auto reported_at = start;
+        uint64_t hydrated_bytes = 0;
+
+        uint64_t block = 0;
+        while (block < _present.blocks() && !_stopping) {
+            if (_present.test(block)) {
+                block++;
+                continue;
+            }
+            uint64_t last = block;
+            while (last + 1 < _present.blocks() && last + 1 - block < max_blocks && !_present.test(last + 1)) {
+                last++;
+            }
+            // The upstream may be restarting, and a migration can't be
+            // completed without it.
+            if (fill(buf.data(), block, last) == -1) {
+                perror("Failed to hydrate cache");
+                std::this_thread::sleep_for(std::chrono::seconds(BLOCKV_PROXY_RETRY_INTERVAL_S));
+                continue;
+            }
+            // Stay within the bandwidth budget, so that neither the upstream
+            // nor client I/O is starved.
+            hydrated_bytes += (last + 1 - block) * block_size;
+            std::this_thread::sleep_until(start + std::chrono::microseconds(hydrated_bytes * 1000000 / _hydrate_bandwidth));
+            block = last + 1;
+
+            if (_migrating && clock::now() - reported_at >= std::chrono::seconds(BLOCKV_MIGRATE_PROGRESS_INTERVAL_S)) {
+                reported_at = clock::now();
+                uint64_t present = _present.count();
+                printf("Migration: %lu of %lu blocks copied (%.1f%%)\n", present, _present.blocks(), 100.0 * present / _present.blocks());
+            }
+        }
+        if (_stopping || _present.count() != _present.blocks()) {
+            return;
+        }
+        if (_migrating) {
+            // Nothing is left to be read from the source once it's known on disk.
+            int ret = sync();
+            printf("Migration from %s is %s\n", _upstream.c_str(), (ret == 0) ? "complete, the source can be shut down" : "complete, but failed to sync");
+        } else {
+            printf("Proxy: cache is fully hydrated, upstream %s is no longer read\n", _upstream.c_str());
+        }
+    }
+public:
+    // Hydrates the cache in the background at hydrate_bandwidth bytes per
+    // second, unless it's 0. migrating tells that the upstream is the source
+    // of a migration, whose progress is reported.
+    proxy_backend(const std::string& upstream, int cache_fd, uint64_t size, const char* bitmap_path, uint64_t block_size,
+            uint64_t hydrate_bandwidth, bool migrating)
+        : _upstream(upstream)
+        , _cache_fd(cache_fd)
+        , _size(size)
+        , _present(bitmap_path, size, block_size)
+        , _hydrate_bandwidth(hydrate_bandwidth)
+        , _migrating(migrating) {
+        printf("Proxy: %lu of %lu blocks present in cache\n", _present.count(), _present.blocks());
+        if (_hydrate_bandwidth) {
+            _hydrator = std::thread([this] { hydrate_loop(); });
+        }
+    }
+
+    ~proxy_backend() {
+        _stopping = true;
+        if (_hydrator.joinable()) {
+            _hydrator.join();
+        }
+        printf("Proxy: %lu blocks (%lu bytes) fetched from upstream\n", uint64_t(_fetched_blocks), uint64_t(_fetched_bytes));
+        sync();
+        close(_cache_fd);
+    }
+
+    virtual ssize_t read(char* buf, uint32_t size, uint64_t offset) {
+        uint64_t block_size = _present.block_size();
+        uint64_t max_blocks = std::max(uint64_t(BLOCKV_PROXY_MAX_FETCH) / block_size, uint64_t(1));
+        uint64_t end = offset + size;
+        std::vector<char> fetched;
+
+        // Present blocks are read from the cache, and runs of absent ones
+        // are fetched with one request each.
+        uint64_t pos = offset;
+        while (pos < end) {
+            uint64_t block = pos / block_size;
+            bool present = _present.test(block);
+            uint64_t last = block;
+            while ((last + 1) * block_size < end && _present.test(last + 1) == present && (present || last + 1 - block < max_blocks)) {
+                last++;
+            }
+            uint64_t run_end = std::min(end, (last + 1) * block_size);
+            if (present) {
+                if (pread(_cache_fd, buf + (pos - offset), run_end - pos, pos) != ssize_t(run_end - pos)) {
+                    return -1;
+                }
+            } else {
+                fetched.resize((last + 1 - block) * block_size);
+                if (fill(fetched.data(), block, last) == -1) {
+                    return -1;
+                }
+                memcpy(buf + (pos - offset), fetched.data() + (pos - block * block_size), run_end - pos);
+            }
+            pos = run_end;
+        }
+        return size;
+    }
+
+    virtual ssize_t writev(const struct iovec* iov, int iovcnt, uint64_t offset) {
+        uint64_t block_size = _present.block_size();
+        uint64_t size = 0;
+        for (int i = 0; i < iovcnt; i++) {
+            size += iov[i].iov_len;
+        }
+        if (!size) {
+            return 0;
+        }
+
+        // Partially written blocks must be fetched first, like a copy-up.
+        uint64_t first = offset / block_size;
+        uint64_t last = (offset + size - 1) / block_size;
+        std::vector<char> fetched(block_size);
+        for (uint64_t block : { first, last }) {
+            uint64_t block_start = block * block_size;
+            uint64_t block_end = std::min(block_start + block_size, _size);
+            bool fully_written = offset <= block_start && offset + size >= block_end;
+            if (!fully_written && !_present.test(block) && fill(fetched.data(), block, block) == -1) {
+                return -1;
+            }
+        }
+
+        std::lock_guard<std::mutex> lock(_fill_mutex);
+        std::vector<struct iovec> data(iov, iov + iovcnt);
+        if (pwritev_all(_cache_fd, data, offset) == -1) {
+            return -1;
+        }
+        for (uint64_t block = first; block <= last; block++) {
+            _present.set(block);
+        }
+        return size;
+    }
+
+    virtual int sync() {
+        return _present.sync([this] { return fdatasync(_cache_fd); });
+    }
+};
+
+// Reads into every iovec in full, possibly in several calls. Returns 0 on
+// success and -1 on failure, with errno set.
+static int preadv_all(int fd, std::vector<struct iovec> iov, uint64_t offset) {
+    size_t first = 0;
+    while (first < iov.size()) {
+        int count = std::min(iov.size() - first, size_t(IOV_MAX));
+        ssize_t ret = preadv(fd, iov.data() + first, count, offset);
+        if (ret == -1) {
+            return -1;
+        }
+        if (ret == 0) {
+            errno = EIO;
+            return -1;
+        }
+        offset += ret;
+        while (first < iov.size() && size_t(ret) >= iov[first].iov_len) {
+            ret -= iov[first].iov_len;
+            first++;
+        }
+        if (ret) {
+            iov[first].iov_base = (char*)iov[first].iov_base + ret;
+            iov[first].iov_len -= ret;
+        }
+    }
+    return 0;
+}
+
+// Appends to out the iovecs that cover bytes [from, from + size) of the
+// buffer described by iov.
+static void slice_iovec(const struct iovec* iov, int iovcnt, uint64_t from, uint64_t size, std::vector<struct iovec>& out) {
+    for (int i = 0; i < iovcnt && size; i++) {
+        if (from >= iov[i].iov_len) {
+            from -= iov[i].iov_len;
+            continue;
+        }
+        size_t len = std::min(uint64_t(iov[i].iov_len - from), size);
+        out.push_back({ (char*)iov[i].iov_base + from, len });
+        size -= len;
+        from = 0;
+    }
+}
+
+// Runs the I/O of a single member device on its own thread, so that requests
+// spanning several members proceed in parallel.
+struct io_queue {
+private:
+    std::mutex _mutex;
+    std::condition_variable _cv;
+    std::deque<std::function<void()>> _tasks;
+    std::atomic<size_t> _depth{0};
+    bool _stopping = false;
+    std::thread _worker;
+
+    void worker_loop() {
+        std::unique_lock<std::mutex> lock(_mutex);
+        for (;;) {
+            _cv.wait(lock, [this] { return !_tasks.empty() || _stopping; });
+            if (_tasks.empty()) {
+                break;
+            }
+            std::function<void()> task = std::move(_tasks.front());
+            _tasks.pop_front();
+            lock.unlock();
+            task();
+            _depth--;
+            lock.lock();
+        }
+    }
+public:
+    io_queue() {
+        _worker = std::thread([this] { worker_loop(); });
+    }
+
+    ~io_queue() {
+        {
+            std::lock_guard<std::mutex> lock(_mutex);
+            _stopping = true;
+        }
+        _cv.notify_one();
+        _worker.join();
+    }
+
+    void submit(std::function<void()> task) {
+        _depth++;
+        std::lock_guard<std::mutex> lock(_mutex);
+        _tasks.push_back(std::move(task));
+        _cv.notify_one();
+    }
+
+    // Number of tasks queued or running.
+    size_t depth() const {
+        return _depth;
+    }
+};
+
+// Lets a request wait for the tasks it submitted to io_queues.
+struct io_completion {
+private:
+    std::mutex _mutex;
+    std::condition_variable _cv;
+    unsigned _pending = 0;
+    int _error = 0;
+public:
+    void add() {
+        std::lock_guard<std::mutex> lock(_mutex);
+        _pending++;
+    }
+
+    // error is 0 or an errno value.
+    void done(int error) {
+        std::lock_guard<std::mutex> lock(_mutex);
+        if (error) {
+            _error = error;
+        }
+        if (--_pending == 0) {
+            _cv.notify_all();
+        }
+    }
+
+    // Returns 0 if every task succeeded, or the errno value of a failed one.
+    int wait() {
+        std::unique_lock<std::mutex> lock(_mutex);
+        _cv.wait(lock, [this] { return _pending == 0; });
+        return _error;
+    }
+};
+
+#define BLOCKV_DEFAULT_STRIPE_SIZE (128 * 1024)
+
+// Presents several member files or devices as one device striped in fixed-size
+// chunks (RAID-0 style). Chunk c lives in member c % N at offset
+// (c / N) * stripe size. Each member has its own I/O queue, so large requests
+// fan out to all members in parallel.
+struct striped_backend : public storage_backend {
+private:
+    struct member {
+        int fd;
+        std::unique_ptr<io_queue> queue;
+    };
+
+    std::vector<member> _members;
+    uint64_t _stripe_size;
+
+    // Splits [offset, offset + size) into one contiguous range per member.
+    // Consecutive chunks of a member are adjacent in the member, so a
+    // request never needs more than one I/O per member.
+    template <typename Func>
+    int for_each_member_range(uint64_t offset, uint64_t size, Func&& func) {
+        struct range {
+            uint64_t member_offset = 0;
+            std::vector<std::pair<uint64_t, uint64_t>> pieces; // (request offset, length)
+        };
+        std::vector<range> ranges(_members.size());
+        uint64_t n = _members.size();
+
+        for (uint64_t pos = offset; pos < offset + size; ) {
+            uint64_t chunk = pos / _stripe_size;
+            uint64_t in_chunk = pos % _stripe_size;
+            uint64_t len = std::min(_stripe_size - in_chunk, offset + size - pos);
+            range& r = ranges[chunk % n];
+            if (r.pieces.empty()) {
+                r.member_offset = (chunk / n) * _stripe_size + in_chunk;
+            }
+            r.pieces.emplace_back(pos - offset, len);
+            pos += len;
+        }
+
+        // Small requests touch a single member, so they skip the queue hop.
+        unsigned used = 0;
+        for (auto& r : ranges) {
+            used += !r.pieces.empty();
+        }
+        io_completion completion;
+        for (uint64_t m = 0; m < n; m++) {
+            if (ranges[m].pieces.empty()) {
+                continue;
+            }
+            int fd = _members[m].fd;
+            auto task = [fd, &func, r = std::move(ranges[m])] {
+                return func(fd, r.member_offset, r.pieces);
+            };
+            if (used == 1) {
+                return (task() == -1) ? -1 : 0;
+            }
+            completion.add();
+            _members[m].queue->submit([&completion, task = std::move(task)] {
+                completion.done((task() == -1) ? errno : 0);
+            });
+        }
+        int error = completion.wait();
+        if (error) {
+            errno = error;
+            return -1;
+        }
+        return 0;
+    }
+public:
+    striped_backend(const std::vector<int>& fds, uint64_t stripe_size)
+        : _stripe_size(stripe_size) {
+        for (int fd : fds) {
+            _members.push_back(member{ fd, std::unique_ptr<io_queue>(new io_queue()) });
+        }
+    }
+
+    ~striped_backend() {
+        for (auto& m : _members) {
+            m.queue.reset();
+            close(m.fd);
+        }
+    }
+
+    // Usable size of the striped device, given the size of its smallest member.
+    static uint64_t striped_size(uint64_t smallest_member_size, size_t members, uint64_t stripe_size) {
+        return smallest_member_size / stripe_size * stripe_size * members;
+    }
+
+    virtual ssize_t read(char* buf, uint32_t size, uint64_t offset) {
+        int ret = for_each_member_range(offset, size, [buf] (int fd, uint64_t member_offset, const std::vector<std::pair<uint64_t, uint64_t>>& pieces) {
+            std::vector<struct iovec> iov;
+            for (auto& p : pieces) {
+                iov.push_back({ buf + p.first, p.second });
+            }
+            return preadv_all(fd, std::move(iov), member_offset);
+        });
+        return (ret == -1) ? -1 : size;
+    }
+
+    virtual ssize_t writev(const struct iovec* iov, int iovcnt, uint64_t offset) {
+        uint64_t size = 0;
+        for (int i = 0; i < iovcnt; i++) {
+            size += iov[i].iov_len;
+        }
+        int ret = for_each_member_range(offset, size, [iov, iovcnt] (int fd, uint64_t member_offset, const std::vector<std::pair<uint64_t, uint64_t>>& pieces) {
+            std::vector<struct iovec> member_iov;
+            for (auto& p : pieces) {
+                slice_iovec(iov, iovcnt, p.first, p.second, member_iov);
+            }
+            return pwritev_all(fd, std::move(member_iov), member_offset);
+        });
+        return (ret == -1) ? -1 : size;
+    }
+
+    virtual int write_zeroes(uint64_t offset, uint64_t size) {
+        return for_each_member_range(offset, size, [] (int fd, uint64_t member_offset, const std::vector<std::pair<uint64_t, uint64_t>>& pieces) {
+            uint64_t length = 0;
+            for (auto& p : pieces) {
+                length += p.second;
+            }
+            return punch_hole(fd, member_offset, length);
+        });
+    }
+
+    virtual int sync() {
+        io_completion completion;
+        for (auto& m : _members) {
+            int fd = m.fd;
+            completion.add();
+            m.queue->submit([&completion, fd] {
+                completion.done((fdatasync(fd) == -1) ? errno : 0);
+            });
+        }
+        int error = completion.wait();
+        if (error) {
+            errno = error;
+            return -1;
+        }
+        return 0;
+    }
+};
+
+#define BLOCKV_MIRROR_RESYNC_BLOCK_SIZE (1024 * 1024)
+
+// Keeps two or more member files or devices identical. Writes go to every
+// member in parallel, while each read goes to a single member, picked by its
+// queue depth and measured latency, so reads are spread across members and
+// steered away from a slow one.
+//
+// A member whose write fails, or that is marked for resync at startup (e.g.
+// after it was replaced), stops serving reads and is brought up to date by a
+// background resync that copies the blocks it missed from a healthy member.
+// The blocks a member missed are also kept in a bitmap file per member, so
+// that a resync that didn't complete is resumed after a restart or a crash.
+struct mirrored_backend : public storage_backend {
+private:
+    struct member {
+        unsigned index;
+        int fd;
+        std::unique_ptr<io_queue> queue;
+        std::atomic<unsigned> reads_in_flight{0};
+        std::atomic<uint64_t> latency_us{0}; // moving average of read latency.
+        std::atomic<bool> in_sync{true};
+        // Blocks to be resynced, and where resync looks for the next one.
+        // Protected by _resync_mutex.
+        block_bitmap stale;
+        uint64_t resync_cursor = 0;
+        uint64_t reads = 0;
+        // A block is set in the file as soon as it's stale, but only cleared
+        // once the member is in sync again and its resynced data is durable.
+        persistent_bitmap persisted_stale;
+
+        member(unsigned index, int fd, uint64_t size, const std::string& stale_path)
+            : index(index)
+            , fd(fd)
+            , queue(new io_queue())
+            , stale(size, BLOCKV_MIRROR_RESYNC_BLOCK_SIZE)
+            , persisted_stale(stale_path.c_str(), size, BLOCKV_MIRROR_RESYNC_BLOCK_SIZE) {}
+    };
+
+    std::vector<std::unique_ptr<member>> _members;
+    uint64_t _size;
+    std::atomic<uint64_t> _read_count{0};
+
+    // Writes hold it shared. Resync holds it exclusively while copying a
+    // block, so a concurrent write can't be overwritten by older data.
+    std::shared_timed_mutex _resync_mutex;
+    std::mutex _resync_thread_mutex;
+    std::condition_variable _resync_cv;
+    bool _stopping = false;
+    std::thread _resync_thread;
+    uint64_t _resynced_bytes = 0;
+
+    // Must be called with _resync_mutex held exclusively.
+    void mark_stale(member& m, uint64_t offset, uint64_t size) {
+        uint64_t first = offset / BLOCKV_MIRROR_RESYNC_BLOCK_SIZE;
+        uint64_t last = (offset + std::max(size, uint64_t(1)) - 1) / BLOCKV_MIRROR_RESYNC_BLOCK_SIZE;
+        for (uint64_t block = first; block <= last && block < m.stale.blocks(); block++) {
+            m.stale.set(block);
+            m.persisted_stale.set(block);
+        }
+        // Done before the write that failed is acknowledged, so that the
+        // member isn't taken for in sync after a crash.
+        if (m.persisted_stale.sync() == -1) {
+            printf("Unable to persist stale blocks of mirror member %u: %s\n", m.index, strerror(errno));
+        }
+        m.resync_cursor = std::min(m.resync_cursor, first);
+        if (m.in_sync) {
+            printf("Mirror member %u fell behind, it will be resynced\n", m.index);
+            m.in_sync = false;
+        }
+    }
+
+    void report_failure(member& m, uint64_t offset, uint64_t size) {
+        {
+            std::lock_guard<std::shared_timed_mutex> lock(_resync_mutex);
+            mark_stale(m, offset, size);
+        }
+        std::lock_guard<std::mutex> lock(_resync_thread_mutex);
+        _resync_cv.notify_one();
+    }
+
+    // Picks the in-sync member expected to answer first. Once in a while a
+    // random member is picked, so that the latency of a member that was
+    // slow is measured again.
+    member* pick_reader(member* exclude) {
+        uint64_t n = _read_count++;
+        std::vector<member*> candidates;
+        for (auto& m : _members) {
+            if (m->in_sync && m.get() != exclude) {
+                candidates.push_back(m.get());
+            }
+        }
+        if (candidates.empty()) {
+            return nullptr;
+        }
+        if (n % 64 == 0) {
+            return candidates[(n / 64) % candidates.size()];
+        }
+        member* best = nullptr;
+        uint64_t best_cost = std::numeric_limits<uint64_t>::max();
+        for (member* m : candidates) {
+            uint64_t cost = (m->reads_in_flight + m->queue->depth() + 1) * (m->latency_us + 1);
+            if (cost < best_cost) {
+                best = m;
+                best_cost = cost;
+            }
+        }
+        return best;
+    }
+
+    // Copies one stale block of m from an in-sync member. Returns false if
+    // nothing was left to copy.
+    bool resync_one_block(member& m, std::vector<char>& buf) {
+        std::lock_guard<std::shared_timed_mutex> lock(_resync_mutex);
+        uint64_t block = m.resync_cursor;
+        while (block < m.stale.blocks() && !m.stale.test(block)) {
+            block++;
+        }
+        m.resync_cursor = block;
+        if (block == m.stale.blocks()) {
+            // Blocks resynced so far must be durable before they're cleared
+            // in the file. Writes wait for it, but it's only done once per resync.
+            if (fdatasync(m.fd) == -1) {
+                perror("Failed to resync mirror member");
+                return false;
+            }
+            for (block = 0; block < m.stale.blocks(); block++) {
+                m.persisted_stale.clear(block);
+            }
+            if (m.persisted_stale.sync() == -1) {
+                printf("Unable to persist stale blocks of mirror member %u: %s\n", m.index, strerror(errno));
+            }
+            m.in_sync = true;
+            m.resync_cursor = m.stale.blocks();
+            printf("Mirror member %u is in sync again\n", m.index);
+            return false;
+        }
+
+        member* source = pick_reader(&m);
+        if (!source) {
+            printf("No mirror member is in sync, unable to resync!\n");
+            return false;
+        }
+        uint64_t offset = block * BLOCKV_MIRROR_RESYNC_BLOCK_SIZE;
+        size_t length = std::min(uint64_t(BLOCKV_MIRROR_RESYNC_BLOCK_SIZE), _size - offset);
+        if (pread(source->fd, buf.data(), length, offset) != ssize_t(length) ||
+                pwrite(m.fd, buf.data(), length, offset) != ssize_t(length)) {
+            perror("Failed to resync mirror member");
+            return false;
+        }
+        m.stale.clear(block);
+        _resynced_bytes += length;
+        return true;
+    }
+
+    void resync_loop() {
+        std::vector<char> buf(BLOCKV_MIRROR_RESYNC_BLOCK_SIZE);
+        std::unique_lock<std::mutex> lock(_resync_thread_mutex);
+        while (!_stopping) {
+            member* target = nullptr;
+            for (auto& m : _members) {
+                if (!m->in_sync) {
+                    target = m.get();
+                }
+            }
+            if (!target) {
+                _resync_cv.wait(lock);
+                continue;
+            }
+            lock.unlock();
+            bool progress = resync_one_block(*target, buf);
+            lock.lock();
+            if (!progress && !target->in_sync) {
+                // Try again later, e.g. once the failed member is back.
+                _resync_cv.wait_for(lock, std::chrono::seconds(1));
+            }
+        }
+    }
+
+    // Runs func(member) on the queue of every member that receives writes,
+    // and reports members it failed on. _resync_mutex is held shared while
+    // func runs so that no block is resynced under a write, and is released
+    // before the failures are reported, as marking a member stale takes it
+    // exclusively.
+    template <typename Func>
+    int for_each_member(uint64_t offset, uint64_t size, Func&& func) {
+        std::vector<int> errors(_members.size());
+        io_completion completion;
+        std::shared_lock<std::shared_timed_mutex> lock(_resync_mutex);
+        for (size_t i = 0; i < _members.size(); i++) {
+            member* m = _members[i].get();
+            completion.add();
+            m->queue->submit([&completion, &errors, &func, m, i] {
+                errors[i] = (func(*m) == -1) ? errno : 0;
+                completion.done(0);
+            });
+        }
+        completion.wait();
+        lock.unlock();
+
+        int succeeded = 0;
+        int error = 0;
+        for (size_t i = 0; i < _members.size(); i++) {
+            if (errors[i]) {
+                error = errors[i];
+                report_failure(*_members[i], offset, size);
+            } else if (_members[i]->in_sync) {
+                succeeded++;
+            }
+        }
+        if (!succeeded) {
+            errno = (error) ? error : EIO;
+            return -1;
+        }
+        return 0;
+    }
+public:
+    // The stale blocks of member i are kept in <stale_path_prefix><i>.
+    mirrored_backend(const std::vector<int>& fds, uint64_t size, const std::vector<unsigned>& members_to_resync,
+            const std::string& stale_path_prefix)
+        : _size(size) {
+        for (int fd : fds) {
+            std::string stale_path = stale_path_prefix + std::to_string(_members.size());
+            _members.emplace_back(new member(_members.size(), fd, size, stale_path));
+            member& m = *_members.back();
+            m.resync_cursor = m.stale.blocks();
+            m.persisted_stale.merge_into(m.stale);
+            if (m.stale.count()) {
+                printf("Mirror member %u has %lu blocks left to resync\n", m.index, m.stale.count());
+                m.resync_cursor = 0;
+                m.in_sync = false;
+            }
+        }
+        for (unsigned i : members_to_resync) {
+            if (i < _members.size()) {
+                mark_stale(*_members[i], 0, size);
+            }
+        }
+        _resync_thread = std::thread([this] { resync_loop(); });
+    }
+
+    ~mirrored_backend() {
+        {
+            std::lock_guard<std::mutex> lock(_resync_thread_mutex);
+            _stopping = true;
+        }
+        _resync_cv.notify_one();
+        _resync_thread.join();
+        for (size_t i = 0; i < _members.size(); i++) {
+            printf("Mirror member %lu: %lu reads, average latency %lu us%s\n", i, _members[i]->reads,
+                uint64_t(_members[i]->latency_us), (_members[i]->in_sync) ? "" : ", out of sync");
+        }
+        printf("Mirror: %lu bytes resynced\n", _resynced_bytes);
+        for (auto& m : _members) {
+            m->queue.reset();
+            close(m->fd);
+        }
+    }
+
+    virtual ssize_t read(char* buf, uint32_t size, uint64_t offset) {
+        member* exclude = nullptr;
+        for (;;) {
+            member* m = pick_reader(exclude);
+            if (!m) {
+                errno = EIO;
+                return -1;
+            }
+            m->reads_in_flight++;
+            auto start = std::chrono::steady_clock::now();
+            ssize_t ret = pread(m->fd, buf, size, offset);
+            uint64_t latency = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start).count();
+            m->reads_in_flight--;
+            m->latency_us = (m->latency_us * 7 + latency) / 8;
+            m->reads++;
+            if (ret != -1) {
+                return ret;
+            }
+            perror("Mirror member failed to read");
+            report_failure(*m, offset, size);
+            exclude = m;
+        }
+    }
+
+    virtual ssize_t writev(const struct iovec* iov, int iovcnt, uint64_t offset) {
+        uint64_t size = 0;
+        for (int i = 0; i < iovcnt; i++) {
+            size += iov[i].iov_len;
+        }
+        std::vector<struct iovec> data(iov, iov + iovcnt);
+        int ret = for_each_member(offset, size, [&data, offset] (member& m) {
+            return pwritev_all(m.fd, data, offset);
+        });
+        return (ret == -1) ? -1 : size;
+    }
+
+    virtual int write_zeroes(uint64_t offset, uint64_t size) {
+        return for_each_member(offset, size, [offset, size] (member& m) {
+            return punch_hole(m.fd, offset, size);
+        });
+    }
+
+    // A member that fails to sync may have lost any write, so it's resynced in full.
+    virtual int sync() {
+        return for_each_member(0, _size, [] (member& m) {
+            return fdatasync(m.fd);
+        });
+    }
+};
+
+// XXH64, a non-cryptographic hash that runs at several GB/s: its four
+// independent lanes keep the multipliers of a superscalar CPU busy. Used to
+// find candidate duplicate chunks, which are then compared byte by byte.
+static uint64_t xxh64(const void* data, size_t size, uint64_t seed = 0) {
+    static const uint64_t prime1 = 11400714785074694791ULL;
+    static const uint64_t prime2 = 14029467366897019727ULL;
+    static const uint64_t prime3 = 1609587929392839161ULL;
+    static const uint64_t prime4 = 9650029242287828579ULL;
+    static const uint64_t prime5 = 2870177450012600261ULL;
+    auto rotl = [] (uint64_t x, int r) { return (x << r) | (x >> (64 - r)); };
+    auto round = [&rotl] (uint64_t acc, uint64_t input) { return rotl(acc + input * prime2, 31) * prime1; };
+    auto merge = [&round] (uint64_t acc, uint64_t val) { return (acc ^ round(0, val)) * prime1 + prime4; };
+    auto read64 = [] (const unsigned char* p) { uint64_t v; memcpy(&v, p, sizeof(v)); return v; };
+    auto read32 = [] (const unsigned char* p) { uint32_t v; memcpy(&v, p, sizeof(v)); return uint64_t(v); };
+
+    const unsigned char* p = (const unsigned char*) data;
+    const unsigned char* end = p + size;
+    uint64_t hash;
+    if (size >= 32) {
+        uint64_t v1 = seed + prime1 + prime2;
+        uint64_t v2 = seed + prime2;
+        uint64_t v3 = seed;
+        uint64_t v4 = seed - prime1;
+        for (; p + 32 <= end; p += 32) {
+            v1 = round(v1, read64(p));
+            v2 = round(v2, read64(p + 8));
+            v3 = round(v3, read64(p + 16));
+            v4 = round(v4, read64(p + 24));
+        }
+        hash = rotl(v1, 1) + rotl(v2, 7) + rotl(v3, 12) + rotl(v4, 18);
+        hash = merge(hash, v1);
+        hash = merge(hash, v2);
+        hash = merge(hash, v3);
+        hash = merge(hash, v4);
+    } else {
+        hash = seed + prime5;
+    }
+    hash += size;
+    for (; p + 8 <= end; p += 8) {
+        hash = rotl(hash ^ round(0, read64(p)), 27) * prime1 + prime4;
+    }
+    if (p + 4 <= end) {
+        hash = rotl(hash ^ (read32(p) * prime1), 23) * prime2 + prime3;
+        p += 4;
+    }
+    for (; p < end; p++) {
+        hash = rotl(hash ^ (*p * prime5), 11) * prime1;
+    }
+    hash ^= hash >> 33;
+    hash *= prime2;
+    hash ^= hash >> 29;
+    hash *= prime3;
+    hash ^= hash >> 32;
+    return hash;
+}
+
+#define BLOCKV_DEDUP_INDEX_MAGIC 0x44494458
+#define BLOCKV_DEDUP_MAP_MAGIC 0x444D4150
+#define BLOCKV_DEFAULT_DEDUP_CHUNK_SIZE 4096
+
+// Content-addressed store of fixed-size chunks, meant to be shared by exports
+// of near-identical images so that their common chunks are stored once.
+// Chunks live in slots of a data file; an index file next to it holds the
+// hash and reference count of every slot, and the hash table used to look
+// chunks up is rebuilt from it at startup. Chunk ids are slot numbers plus
+// one, so that id 0 can stand for a chunk of zeroes, which is never stored.
+//
+// References are dropped with release() only once the chunk maps that stopped
+// using them are durable; until then a crash may leak a chunk, but never
+// reuse one that's still referenced.
+struct chunk_store {
+private:
+    using clock = std::chrono::steady_clock;
+
+    struct index_header {
+        uint32_t magic;
+        uint32_t unused;
+        uint64_t chunk_size;
+    } __attribute__((packed));
+
+    struct index_entry {
+        uint64_t hash;
+        uint32_t refcount;
+        uint32_t unused;
+    } __attribute__((packed));
+
+    int _data_fd;
+    int _index_fd;
+    uint64_t _chunk_size;
+
+    std::mutex _mutex;
+    std::vector<index_entry> _slots;
+    std::multimap<uint64_t, uint64_t> _slots_by_hash;
+    std::vector<uint64_t> _free_slots;
+    std::set<uint64_t> _dirty_slots;
+    std::vector<char> _compare_buf;
+
+    uint64_t _stored_chunks = 0;
+    uint64_t _references = 0;
+    uint64_t _duplicates_found = 0;
+    uint64_t _hash_collisions = 0;
+    std::atomic<uint64_t> _hashed_bytes{0};
+    std::atomic<uint64_t> _hashing_ns{0};
+
+    void load_index() {
+        index_header hdr;
+        ssize_t ret = pread(_index_fd, &hdr, sizeof(hdr), 0);
+        if (ret == 0) {
+            hdr = { BLOCKV_DEDUP_INDEX_MAGIC, 0, _chunk_size };
+            if (pwrite(_index_fd, &hdr, sizeof(hdr), 0) != sizeof(hdr) || fdatasync(_index_fd) == -1) {
+                perror("Unable to initialize chunk store index");
+                exit(1);
+            }
+            return;
+        }
+        if (ret != sizeof(hdr) || hdr.magic != BLOCKV_DEDUP_INDEX_MAGIC || hdr.chunk_size != _chunk_size) {
+            printf("Chunk store index doesn't match chunk size %lu!\n", _chunk_size);
+            exit(1);
+        }
+        struct stat st;
+        if (fstat(_index_fd, &st) == -1) {
+            perror("fstat");
+            exit(1);
+        }
+        _slots.resize((st.st_size - sizeof(hdr)) / sizeof(index_entry));
+        size_t bytes = _slots.size() * sizeof(index_entry);
+        if (pread(_index_fd, _slots.data(), bytes, sizeof(hdr)) != ssize_t(bytes)) {
+            perror("Unable to read chunk store index");
+            exit(1);
+        }
+        for (uint64_t slot = 0; slot < _slots.size(); slot++) {
+            if (_slots[slot].refcount) {
+                _slots_by_hash.emplace(uint64_t(_slots[slot].hash), slot);
+                _stored_chunks++;
+                _references += _slots[slot].refcount;
+            } else {
+                _free_slots.push_back(slot);
+            }
+        }
+    }
+
+    uint64_t slot_offset(uint64_t slot) const {
+        return slot * _chunk_size;
+    }
+
+    // Must be called with _mutex held.
+    uint64_t allocate_slot(const char* chunk, uint64_t hash) {
+        uint64_t slot;
+        if (!_free_slots.empty()) {
+            slot = _free_slots.back();
+            _free_slots.pop_back();
+        } else {
+            slot = _slots.size();
+            _slots.push_back(index_entry{ 0, 0, 0 });
+        }
+        if (pwrite(_data_fd, chunk, _chunk_size, slot_offset(slot)) != ssize_t(_chunk_size)) {
+            _free_slots.push_back(slot);
+            return std::numeric_limits<uint64_t>::max();
+        }
+        _slots[slot] = index_entry{ hash, 1, 0 };
+        _slots_by_hash.emplace(hash, slot);
+        _dirty_slots.insert(slot);
+        _stored_chunks++;
+        return slot;
+    }
+
+    // Must be called with _mutex held.
+    int write_dirty_slots() {
+        for (uint64_t slot : _dirty_slots) {
+            if (pwrite(_index_fd, &_slots[slot], sizeof(index_entry), sizeof(index_header) + slot * sizeof(index_entry)) != sizeof(index_entry)) {
+                return -1;
+            }
+        }
+        _dirty_slots.clear();
+        return fdatasync(_index_fd);
+    }
+public:
+    chunk_store(const char* path, uint64_t chunk_size)
+        : _chunk_size(chunk_size)
+        , _compare_buf(chunk_size) {
+        _data_fd = open(path, O_RDWR | O_CREAT | O_LARGEFILE, 0644);
+        std::string index_path = std::string(path) + ".index";
+        _index_fd = open(index_path.c_str(), O_RDWR | O_CREAT, 0644);
+        if (_data_fd == -1 || _index_fd == -1) {
+            printf("Unable to open chunk store %s: %s\n", path, strerror(errno));
+            exit(1);
+        }
+        // The index is cached in memory, so the store can't be shared between processes.
+        if (flock(_data_fd, LOCK_EX | LOCK_NB) == -1) {
+            printf("Chunk store %s is in use by another process!\n", path);
+            exit(1);
+        }
+        load_index();
+        printf("Chunk store: %lu chunks of %lu bytes, %lu references\n", _stored_chunks, _chunk_size, _references);
+    }
+
+    ~chunk_store() {
+        double ratio = (_stored_chunks) ? double(_references) / _stored_chunks : 1.0;
+        double seconds = _hashing_ns / 1e9;
+        printf("Chunk store: %lu chunks stored for %lu references (dedup ratio %.2f), %lu duplicates found, %lu hash collisions\n",
+            _stored_chunks, _references, ratio, _duplicates_found, _hash_collisions);
+        printf("Chunk store: hashed %lu bytes at %.1f MB/s\n", uint64_t(_hashed_bytes),
+            (seconds > 0) ? _hashed_bytes / seconds / (1024 * 1024) : 0.0);
+        close(_index_fd);
+        close(_data_fd);
+    }
+
+    uint64_t chunk_size() const {
+        return _chunk_size;
+    }
+
+    // Returns the id of a chunk with the given contents, adding a reference
+    // to it, or storing it if there's none yet. Returns -1 on failure.
+    int64_t insert(const char* chunk) {
+        if (is_zero_buffer(chunk, _chunk_size)) {
+            return 0;
+        }
+        auto start = clock::now();
+        uint64_t hash = xxh64(chunk, _chunk_size);
+        _hashing_ns += std::chrono::duration_cast<std::chrono::nanoseconds>(clock::now() - start).count();
+        _hashed_bytes += _chunk_size;
+
+        std::lock_guard<std::mutex> lock(_mutex);
+        auto range = _slots_by_hash.equal_range(hash);
+        for (auto it = range.first; it != range.second; ++it) {
+            uint64_t slot = it->second;
+            if (pread(_data_fd, _compare_buf.data(), _chunk_size, slot_offset(slot)) != ssize_t(_chunk_size)) {
+                return -1;
+            }
+            if (memcmp(_compare_buf.data(), chunk, _chunk_size) == 0) {
+                _slots[slot].refcount++;
+                _dirty_slots.insert(slot);
+                _references++;
+                _duplicates_found++;
+                return slot + 1;
+            }
+            _hash_collisions++;
+        }
+        uint64_t slot = allocate_slot(chunk, hash);
+        if (slot == std::numeric_limits<uint64_t>::max()) {
+            return -1;
+        }
+        _references++;
+        return slot + 1;
+    }
+
+    // Reads [offset, offset + size) of a chunk.
+    ssize_t read(uint64_t id, char* buf, uint64_t size, uint64_t offset) {
+        if (!id) {
+            memset(buf, 0, size);
+            return size;
+        }
+        return pread(_data_fd, buf, size, slot_offset(id - 1) + offset);
+    }
+
+    // Drops a reference to each chunk. Chunks that are no longer referenced
+    // are punched out of the data file and their slots reused.
+    int release(const std::vector<uint64_t>& ids) {
+        std::lock_guard<std::mutex> lock(_mutex);
+        for (uint64_t id : ids) {
+            if (!id) {
+                continue;
+            }
+            uint64_t slot = id - 1;
+            _references--;
+            _dirty_slots.insert(slot);
+            if (--_slots[slot].refcount) {
+                continue;
+            }
+            uint64_t hash = _slots[slot].hash;
+            auto range = _slots_by_hash.equal_range(hash);
+            for (auto it = range.first; it != range.second; ++it) {
+                if (it->second == slot) {
+                    _slots_by_hash.erase(it);
+                    break;
+                }
+            }
+            punch_hole(_data_fd, slot_offset(slot), _chunk_size);
+            _free_slots.push_back(slot);
+            _stored_chunks--;
+        }
+        return write_dirty_slots();
+    }
+
+    // Makes stored chunks and their new references durable. Chunk data is
+    // synced first, so the index never refers to a chunk that isn't there.
+    int sync() {
+        if (fdatasync(_data_fd) == -1) {
+            return -1;
+        }
+        std::lock_guard<std::mutex> lock(_mutex);
+        return write_dirty_slots();
+    }
+};
+
+// Backend that stores an export as a map of chunk ids into a chunk_store.
+// A write stores each chunk it touches, partial ones after merging them with
+// their current contents, and points the map at the result. The map is kept
+// in a file next to the device file, which is only read to import its data
+// the first time it's exported.
+struct dedup_backend : public storage_backend {
+private:
+    struct map_header {
+        uint32_t magic;
+        uint32_t unused;
+        uint64_t chunk_size;
+        uint64_t device_size;
+    } __attribute__((packed));
+
+    static size_t map_entries_per_page() {
+        return 4096 / sizeof(uint64_t);
+    }
+
+    std::shared_ptr<chunk_store> _store;
+    uint64_t _chunk_size;
+    uint64_t _size;
+    int _map_fd;
+
+    // Serializes syncs, so that an older copy of a map page never overwrites a newer one.
+    std::mutex _sync_mutex;
+    std::shared_timed_mutex _mutex;
+    std::vector<uint64_t> _map;
+    std::set<uint64_t> _dirty_map_pages;
+    // Chunks that were replaced since the last sync, see chunk_store::release().
+    std::vector<uint64_t> _replaced_chunks;
+
+    // Writes [offset, offset + size), taken from data, or zeroes when it's null.
+    int write_range(const char* data, uint64_t size, uint64_t offset) {
+        std::vector<char> chunk(_chunk_size);
+        std::lock_guard<std::shared_timed_mutex> lock(_mutex);
+        for (uint64_t pos = offset; pos < offset + size; ) {
+            uint64_t index = pos / _chunk_size;
+            uint64_t chunk_offset = pos - index * _chunk_size;
+            uint64_t length = std::min(_chunk_size - chunk_offset, offset + size - pos);
+            if (length < _chunk_size && _store->read(_map[index], chunk.data(), _chunk_size, 0) != ssize_t(_chunk_size)) {
+                return -1;
+            }
+            if (data) {
+                memcpy(chunk.data() + chunk_offset, data + (pos - offset), length);
+            } else {
+                memset(chunk.data() + chunk_offset, 0, length);
+            }
+            int64_t id = _store->insert(chunk.data());
+            if (id == -1) {
+                return -1;
+            }
+            _replaced_chunks.push_back(_map[index]);
+            _map[index] = id;
+            _dirty_map_pages.insert(index / map_entries_per_page());
+            pos += length;
+        }
+        return 0;
+    }
+
+    void load_map(const char* map_path, int image_fd) {
+        map_header hdr = {};
+        ssize_t ret = pread(_map_fd, &hdr, sizeof(hdr), 0);
+        if (ret == sizeof(hdr) && hdr.magic == BLOCKV_DEDUP_MAP_MAGIC && hdr.chunk_size == _chunk_size && hdr.device_size == _size) {
+            size_t bytes = _map.size() * sizeof(uint64_t);
+            if (pread(_map_fd, _map.data(), bytes, sizeof(hdr)) != ssize_t(bytes)) {
+                printf("Chunk map %s is truncated!\n", map_path);
+                exit(1);
+            }
+            return;
+        }
+        // A map without a header is new, or its import didn't complete.
+        if (ret == -1 || hdr.magic != 0) {
+            printf("Chunk map %s doesn't match the device it's used with!\n", map_path);
+            exit(1);
+        }
+
+        // First export of this image, so its data is imported into the store.
+        std::vector<char> buf(std::max(_chunk_size, uint64_t(1024 * 1024)) / _chunk_size * _chunk_size);
+        for (uint64_t offset = 0; offset < _size; offset += buf.size()) {
+            uint64_t length = std::min(uint64_t(buf.size()), _size - offset);
+            ret = pread(image_fd, buf.data(), length, offset);
+            if (ret == -1 || write_range(buf.data(), ret, offset) == -1) {
+                perror("Unable to import image into chunk store");
+                exit(1);
+            }
+        }
+        _replaced_chunks.clear();
+        // The header goes last, so that a crash during the import leaves a map
+        // that's imported again rather than one with missing entries.
+        hdr = { BLOCKV_DEDUP_MAP_MAGIC, 0, _chunk_size, _size };
+        if (sync() == -1 || pwrite(_map_fd, &hdr, sizeof(hdr), 0) != sizeof(hdr) || fdatasync(_map_fd) == -1) {
+            perror("Unable to initialize chunk map");
+            exit(1);
+        }
+        printf("Dedup: imported %lu bytes into chunk store\n", _size);
+    }
+public:
+    dedup_backend(std::shared_ptr<chunk_store> store, int image_fd, uint64_t size, const char* map_path)
+        : _store(std::move(store))
+        , _chunk_size(_store->chunk_size())
+        , _size(size)
+        , _map((size + _chunk_size - 1) / _chunk_size) {
+        _map_fd = open(map_path, O_RDWR | O_CREAT, 0644);
+        if (_map_fd == -1) {
+            printf("Unable to open chunk map %s: %s\n", map_path, strerror(errno));
+            exit(1);
+        }
+        load_map(map_path, image_fd);
+        close(image_fd);
+    }
+
+    ~dedup_backend() {
+        sync();
+        close(_map_fd);
+    }
+
+    virtual ssize_t read(char* buf, uint32_t size, uint64_t offset) {
+        std::shared_lock<std::shared_timed_mutex> lock(_mutex);
+        for (uint64_t pos = offset; pos < offset + size; ) {
+            uint64_t index = pos / _chunk_size;
+            uint64_t chunk_offset = pos - index * _chunk_size;
+            uint64_t length = std::min(_chunk_size - chunk_offset, offset + size - pos);
+            ssize_t ret = _store->read(_map[index], buf + (pos - offset), length, chunk_offset);
+            if (ret == -1) {
+                return -1;
+            }
+            if (uint64_t(ret) < length) {
+                // Chunk punched out of the store by a crash before the map was synced.
+                memset(buf + (pos - offset) + ret, 0, length - ret);
+            }
+            pos += length;
+        }
+        return size;
+    }
+
+    virtual ssize_t writev(const struct iovec* iov, int iovcnt, uint64_t offset) {
+        std::vector<char> data;
+        for (int i = 0; i < iovcnt; i++) {
+            data.insert(data.end(), (char*)iov[i].iov_base, (char*)iov[i].iov_base + iov[i].iov_len);
+        }
+        if (write_range(data.data(), data.size(), offset) == -1) {
+            return -1;
+        }
+        return data.size();
+    }
+
+    virtual int write_zeroes(uint64_t offset, uint64_t size) {
+        return write_range(nullptr, size, offset);
+    }
+
+    // New chunks are made durable before the map that points at them, and
+    // replaced chunks are released only after it. Dirty pages are captured
+    // before the store is synced, so that chunks stored by later writes are
+    // never referenced by the map written here.
+    virtual int sync() {
+        std::lock_guard<std::mutex> sync_lock(_sync_mutex);
+        std::map<uint64_t, std::vector<uint64_t>> pages;
+        std::vector<uint64_t> replaced;
+        {
+            std::lock_guard<std::shared_timed_mutex> lock(_mutex);
+            for (uint64_t page : _dirty_map_pages) {
+                uint64_t first = page * map_entries_per_page();
+                uint64_t last = std::min(first + map_entries_per_page(), uint64_t(_map.size()));
+                pages[page].assign(_map.begin() + first, _map.begin() + last);
+            }
+            _dirty_map_pages.clear();
+            replaced.swap(_replaced_chunks);
+        }
+        int ret = _store->sync();
+        for (auto it = pages.begin(); ret != -1 && it != pages.end(); ++it) {
+            uint64_t first = it->first * map_entries_per_page();
+            size_t bytes = it->second.size() * sizeof(uint64_t);
+            if (pwrite(_map_fd, it->second.data(), bytes, sizeof(map_header) + first * sizeof(uint64_t)) != ssize_t(bytes)) {
+                ret = -1;
+            }
+        }
+        if (ret != -1) {
+            ret = fdatasync(_map_fd);
+        }
+        if (ret == -1) {
+            // Left for the next sync to retry.
+            int error = errno;
+            std::lock_guard<std::shared_timed_mutex> lock(_mutex);
+            for (auto& page : pages) {
+                _dirty_map_pages.insert(page.first);
+            }
+            _replaced_chunks.insert(_replaced_chunks.end(), replaced.begin(), replaced.end());
+            errno = error;
+            return -1;
+        }
+        return _store->release(replaced);
+    }
+};
+
+#define BLOCKV_COMPRESSED_INDEX_MAGIC 0x4C5A4958
+#define BLOCKV_DEFAULT_COMPRESSED_CHUNK_SIZE (64 * 1024)
+#define BLOCKV_DEFAULT_COMPRESSED_CACHE_SIZE (64 * 1024 * 1024)
+// Compressed chunks are allocated in multiples of this size.
+#define BLOCKV_COMPRESSED_SECTOR_SIZE 512
+
+// Backend that keeps the export as LZ4-compressed fixed-size chunks, so that
+// compressible data takes fewer reads from slow disks. Chunks are packed in a
+// data file and an index file next to it gives the offset and length of each
+// one. Reads decompress whole chunks into a bounded LRU cache, and writes
+// modify cached chunks, which are only recompressed and written back when
+// they're evicted or on sync(). Chunks of zeroes aren't stored, and chunks
+// that don't compress are stored as they are.
+//
+// A rewritten chunk always goes to free space, and the space it used to take
+// is only reused after the index that points elsewhere is synced, so a crash
+// never leaves the index pointing at overwritten data.
+struct compressed_backend : public storage_backend {
+private:
+    struct index_header {
+        uint32_t magic;
+        uint32_t unused;
+        uint64_t chunk_size;
+        uint64_t device_size;
+    } __attribute__((packed));
+
+    struct index_entry {
+        uint64_t offset;
+        uint32_t length; // 0 for a chunk of zeroes.
+        uint32_t raw; // stored uncompressed.
+    } __attribute__((packed));
+
+    struct cached_chunk {
+        std::vector<char> data;
+        bool dirty = false;
+        std::list<uint64_t>::iterator lru;
+    };
+
+    static size_t index_entries_per_page() {
+        return 4096 / sizeof(index_entry);
+    }
+
+    int _data_fd;
+    int _index_fd;
+    uint64_t _chunk_size;
+    uint64_t _size;
+    size_t _cache_capacity; // in chunks.
+
+    std::mutex _mutex;
+    std::vector<index_entry> _index;
+    std::set<uint64_t> _dirty_index_pages;
+    // Free space of the data file, by offset and by length, and where it ends.
+    std::map<uint64_t, uint64_t> _free_by_offset;
+    std::set<std::pair<uint64_t, uint64_t>> _free_by_length;
+    uint64_t _data_end = 0;
+    // Space of rewritten chunks, which becomes free once the index is synced.
+    std::vector<std::pair<uint64_t, uint64_t>> _pending_free;
+
+    std::unordered_map<uint64_t, cached_chunk> _cache;
+    std::list<uint64_t> _lru; // most recently used first.
+    std::vector<char> _compress_buf;
+
+    uint64_t _cache_hits = 0;
+    uint64_t _cache_misses = 0;
+    uint64_t _writebacks = 0;
+    uint64_t _bytes_read_from_disk = 0;
+    uint64_t _bytes_served = 0;
+
+    static uint64_t round_up(uint64_t length) {
+        return (length + BLOCKV_COMPRESSED_SECTOR_SIZE - 1) / BLOCKV_COMPRESSED_SECTOR_SIZE * BLOCKV_COMPRESSED_SECTOR_SIZE;
+    }
+
+    void insert_free(uint64_t offset, uint64_t length) {
+        auto next = _free_by_offset.lower_bound(offset);
+        if (next != _free_by_offset.end() && next->first == offset + length) {
+            length += next->second;
+            _free_by_length.erase({ next->second, next->first });
+            _free_by_offset.erase(next);
+        }
+        auto prev = _free_by_offset.lower_bound(offset);
+        if (prev != _free_by_offset.begin() && std::prev(prev)->first + std::prev(prev)->second == offset) {
+            --prev;
+            offset = prev->first;
+            length += prev->second;
+            _free_by_length.erase({ prev->second, prev->first });
+            _free_by_offset.erase(prev);
+        }
+        if (offset + length == _data_end) {
+            _data_end = offset;
+            return;
+        }
+        _free_by_offset.emplace(offset, length);
+        _free_by_length.emplace(length, offset);
+    }
+
+    // Best fit among free extents, or the end of the data file.
+    uint64_t allocate(uint64_t length) {
+        auto it = _free_by_length.lower_bound({ length, 0 });
+        if (it == _free_by_length.end()) {
+            uint64_t offset = _data_end;
+            _data_end += length;
+            return offset;
+        }
+        uint64_t extent_length = it->first;
+        uint64_t offset = it->second;
+        _free_by_length.erase(it);
+        _free_by_offset.erase(offset);
+        if (extent_length > length) {
+            _free_by_offset.emplace(offset + length, extent_length - length);
+            _free_by_length.emplace(extent_length - length, offset + length);
+        }
+        return offset;
+    }
+
+    void set_index_entry(uint64_t chunk, index_entry entry) {
+        if (_index[chunk].length) {
+            _pending_free.emplace_back(uint64_t(_index[chunk].offset), round_up(_index[chunk].length));
+        }
+        _index[chunk] = entry;
+        _dirty_index_pages.insert(chunk / index_entries_per_page());
+    }
+
+    int load_chunk(uint64_t chunk, std::vector<char>& data) {
+        index_entry entry = _index[chunk];
+        if (!entry.length) {
+            memset(data.data(), 0, _chunk_size);
+            return 0;
+        }
+        char* dst = (entry.raw) ? data.data() : _compress_buf.data();
+        if (pread(_data_fd, dst, entry.length, entry.offset) != ssize_t(entry.length)) {
+            return -1;
+        }
+        _bytes_read_from_disk += entry.length;
+        if (!entry.raw && lz4_decompress(_compress_buf.data(), entry.length, data.data(), _chunk_size) == -1) {
+            printf("Compressed chunk %lu is corrupted!\n", chunk);
+            errno = EIO;
+            return -1;
+        }
+        return 0;
+    }
+
+    int write_back(uint64_t chunk, cached_chunk& c) {
+        if (is_zero_buffer(c.data.data(), _chunk_size)) {
+            set_index_entry(chunk, index_entry{ 0, 0, 0 });
+            c.dirty = false;
+            return 0;
+        }
+        size_t length = lz4_compress(c.data.data(), _chunk_size, _compress_buf.data(), _chunk_size - 1);
+        bool raw = !length;
+        const char* src = (raw) ? c.data.data() : _compress_buf.data();
+        if (raw) {
+            length = _chunk_size;
+        }
+        uint64_t offset = allocate(round_up(length));
+        if (pwrite(_data_fd, src, length, offset) != ssize_t(length)) {
+            insert_free(offset, round_up(length));
+            return -1;
+        }
+        set_index_entry(chunk, index_entry{ offset, uint32_t(length), raw });
+        c.dirty = false;
+        _writebacks++;
+        return 0;
+    }
+
+    // Returns the cached copy of a chunk, loading it unless it's about to be
+    // overwritten entirely. Returns null on failure.
+    cached_chunk* get_chunk(uint64_t chunk, bool overwrite) {
+        auto it = _cache.find(chunk);
+        if (it != _cache.end()) {
+            _cache_hits++;
+            _lru.splice(_lru.begin(), _lru, it->second.lru);
+            return &it->second;
+        }
+        _cache_misses++;
+        while (_cache.size() >= _cache_capacity) {
+            auto victim = _cache.find(_lru.back());
+            if (victim->second.dirty && write_back(victim->first, victim->second) == -1) {
+                return nullptr;
+            }
+            _lru.pop_back();
+            _cache.erase(victim);
+        }
+        cached_chunk c;
+        c.data.resize(_chunk_size);
+        if (!overwrite && load_chunk(chunk, c.data) == -1) {
+            return nullptr;
+        }
+        _lru.push_front(chunk);
+        c.lru = _lru.begin();
+        return &_cache.emplace(chunk, std::move(c)).first->second;
+    }
+
+    // Writes [offset, offset + size), taken from data, or zeroes when it's null.
+    int write_range(const char* data, uint64_t size, uint64_t offset) {
+        std::lock_guard<std::mutex> lock(_mutex);
+        for (uint64_t pos = offset; pos < offset + size; ) {
+            uint64_t chunk = pos / _chunk_size;
+            uint64_t chunk_offset = pos - chunk * _chunk_size;
+            uint64_t length = std::min(_chunk_size - chunk_offset, offset + size - pos);
+            cached_chunk* c = get_chunk(chunk, length == _chunk_size);
+            if (!c) {
+                return -1;
+            }
+            if (data) {
+                memcpy(c->data.data() + chunk_offset, data + (pos - offset), length);
+            } else {
+                memset(c->data.data() + chunk_offset, 0, length);
+            }
+            c->dirty = true;
+            pos += length;
+        }
+        return 0;
+    }
+
+    void load_index(int image_fd) {
+        index_header hdr = {};
+        ssize_t ret = pread(_index_fd, &hdr, sizeof(hdr), 0);
+        if (ret == sizeof(hdr) && hdr.magic == BLOCKV_COMPRESSED_INDEX_MAGIC && hdr.chunk_size == _chunk_size && hdr.device_size == _size) {
+            size_t bytes = _index.size() * sizeof(index_entry);
+            if (pread(_index_fd, _index.data(), bytes, sizeof(hdr)) != ssize_t(bytes)) {
+                printf("Compressed chunk index is truncated!\n");
+                exit(1);
+            }
+            // Whatever isn't used by a chunk is free space.
+            std::vector<std::pair<uint64_t, uint64_t>> used;
+            for (auto& entry : _index) {
+                if (entry.length) {
+                    used.emplace_back(uint64_t(entry.offset), round_up(entry.length));
+                }
+            }
+            std::sort(used.begin(), used.end());
+            for (auto& extent : used) {
+                if (extent.first > _data_end) {
+                    _free_by_offset.emplace(_data_end, extent.first - _data_end);
+                    _free_by_length.emplace(extent.first - _data_end, _data_end);
+                }
+                _data_end = std::max(_data_end, extent.first + extent.second);
+            }
+            return;
+        }
+        // An index without a header is new, or its import didn't complete.
+        if (ret == -1 || hdr.magic != 0) {
+            printf("Compressed chunk index doesn't match the device it's used with!\n");
+            exit(1);
+        }
+
+        // First export of this image, so its data is compressed.
+        std::vector<char> buf(std::max(_chunk_size, uint64_t(1024 * 1024)) / _chunk_size * _chunk_size);
+        for (uint64_t offset = 0; offset < _size; offset += buf.size()) {
+            uint64_t length = std::min(uint64_t(buf.size()), _size - offset);
+            ret = pread(image_fd, buf.data(), length, offset);
+            if (ret == -1 || write_range(buf.data(), ret, offset) == -1) {
+                perror("Unable to compress image");
+                exit(1);
+            }
+        }
+        // The header goes last, so that a crash during the import leaves an
+        // index that's imported again rather than one with missing entries.
+        hdr = { BLOCKV_COMPRESSED_INDEX_MAGIC, 0, _chunk_size, _size };
+        if (sync() == -1 || pwrite(_index_fd, &hdr, sizeof(hdr), 0) != sizeof(hdr) || fdatasync(_index_fd) == -1) {
+            perror("Unable to initialize compressed chunk index");
+            exit(1);
+        }
+        printf("Compression: imported %lu bytes\n", _size);
+    }
+public:
+    compressed_backend(int image_fd, uint64_t size, const char* data_path, uint64_t chunk_size, uint64_t cache_size)
+        : _chunk_size(chunk_size)
+        , _size(size)
+        , _cache_capacity(std::max(uint64_t(1), cache_size / chunk_size))
+        , _index((size + chunk_size - 1) / chunk_size)
+        , _compress_buf(chunk_size) {
+        _data_fd = open(data_path, O_RDWR | O_CREAT | O_LARGEFILE, 0644);
+        std::string index_path = std::string(data_path) + ".index";
+        _index_fd = open(index_path.c_str(), O_RDWR | O_CREAT, 0644);
+        if (_data_fd == -1 || _index_fd == -1) {
+            printf("Unable to open compressed image %s: %s\n", data_path, strerror(errno));
+            exit(1);
+        }
+        load_index(image_fd);
+        close(image_fd);
+    }
+
+    ~compressed_backend() {
+        sync();
+        uint64_t chunks = 0, stored_bytes = 0;
+        for (auto& entry : _index) {
+            if (entry.length) {
+                chunks++;
+                stored_bytes += entry.length;
+            }
+        }
+        printf("Compression: %lu chunks stored in %lu bytes (ratio %.2f), %lu written back\n", chunks, stored_bytes,
+            (stored_bytes) ? double(chunks * _chunk_size) / stored_bytes : 1.0, _writebacks);
+        printf("Compression: cache hits %lu, misses %lu; %lu bytes read from disk for %lu bytes served\n",
+            _cache_hits, _cache_misses, _bytes_read_from_disk, _bytes_served);
+        close(_index_fd);
+        close(_data_fd);
+    }
+
+    virtual ssize_t read(char* buf, uint32_t size, uint64_t offset) {
+        std::lock_guard<std::mutex> lock(_mutex);
+        for (uint64_t pos = offset; pos < offset + size; ) {
+            uint64_t chunk = pos / _chunk_size;
+            uint64_t chunk_offset = pos - chunk * _chunk_size;
+            uint64_t length = std::min(_chunk_size - chunk_offset, offset + size - pos);
+            cached_chunk* c = get_chunk(chunk, false);
+            if (!c) {
+                return -1;
+            }
+            memcpy(buf + (pos - offset), c->data.data() + chunk_offset, length);
+            pos += length;
+        }
+        _bytes_served += size;
+        return size;
+    }
+
+    virtual ssize_t writev(const struct iovec* iov, int iovcnt, uint64_t offset) {
+        std::vector<char> data;
+        for (int i = 0; i < iovcnt; i++) {
+            data.insert(data.end(), (char*)iov[i].iov_base, (char*)iov[i].iov_base + iov[i].iov_len);
+        }
+        if (write_range(data.data(), data.size(), offset) == -1) {
+            return -1;
+        }
+        return data.size();
+    }
+
+    virtual int write_zeroes(uint64_t offset, uint64_t size) {
+        return write_range(nullptr, size, offset);
+    }
+
+    // Dirty chunks are written back and synced before the index that points
+    // at them, and only then is the space of the chunks they replaced freed.
+    virtual int sync() {
+        std::lock_guard<std::mutex> lock(_mutex);
+        for (auto& it : _cache) {
+            if (it.second.dirty && write_back(it.first, it.second) == -1) {
+                return -1;
+            }
+        }
+        if (fdatasync(_data_fd) == -1) {
+            return -1;
+        }
+        for (uint64_t page : _dirty_index_pages) {
+            uint64_t first = page * index_entries_per_page();
+            size_t bytes = std::min(index_entries_per_page(), _index.size() - first) * sizeof(index_entry);
+            if (pwrite(_index_fd, _index.data() + first, bytes, sizeof(index_header) + first * sizeof(index_entry)) != ssize_t(bytes)) {
+                return -1;
+            }
+        }
+        _dirty_index_pages.clear();
+        if (fdatasync(_index_fd) == -1) {
+            return -1;
+        }
+        for (auto& extent : _pending_free) {
+            punch_hole(_data_fd, extent.first, extent.second);
+            insert_free(extent.first, extent.second);
+        }
+        _pending_free.clear();
+        // Space freed at the end of the data file is given back.
+        struct stat st;
+        if (fstat(_data_fd, &st) == 0 && uint64_t(st.st_size) > _data_end) {
+            return ftruncate(_data_fd, _data_end);
+        }
+        return 0;
+    }
+};
+
+#define BLOCKV_TIER_MAP_MAGIC 0x54494552
+#define BLOCKV_DEFAULT_TIER_EXTENT_SIZE (1024 * 1024)
+#define BLOCKV_DEFAULT_TIER_MIGRATION_INTERVAL_S 10
+// Bound on extents moved between tiers per migration round, so migration
+// doesn't compete too much with clients for the disks.
+#define BLOCKV_TIER_MIGRATIONS_PER_ROUND 64
+// Heat an extent must reach to be promoted to the fast tier.
+#define BLOCKV_TIER_PROMOTE_MIN_HEAT 4
+// Extent map entry of an extent that only lives in the slow tier.
+#define BLOCKV_TIER_NO_SLOT UINT32_MAX
+
+// Backend with a small fast tier (e.g. a file on NVMe) in front of a large
+// slow tier (e.g. an HDD array). The slow tier is laid out like the device;
+// the fast tier holds copies of hot extents in slots, and an extent map tells
+// which extents live there. Extents in the fast tier are only written there,
+// and copied back when they're demoted.
+//
+// Each access bumps a saturating 8-bit heat counter of the extents it
+// touches, and a migration thread periodically promotes the hottest extents
+// of the slow tier, demotes the coldest ones of the fast tier to make room,
+// then halves every counter, so heat reflects recent accesses.
+//
+// Extents are copied without blocking clients; a write that hits an extent
+// being copied makes the migration start over later. The map is synced on
+// every change, after the data it points at, so it's always safe to use
+// after a crash. Extents of the fast tier are assumed to be newer than their
+// slow copy after a restart.
+struct tiered_backend : public storage_backend {
+private:
+    struct map_header {
+        uint32_t magic;
+        uint32_t unused;
+        uint64_t extent_size;
+        uint64_t device_size;
+        uint64_t slots;
+    } __attribute__((packed));
+
+    int _slow_fd;
+    int _fast_fd;
+    int _map_fd;
+    uint64_t _extent_size;
+    uint64_t _size;
+    std::chrono::seconds _migration_interval;
+
+    // Held shared by requests, and exclusively to change where an extent lives.
+    std::shared_timed_mutex _mutex;
+    std::vector<uint32_t> _slot_of_extent;
+    std::vector<uint64_t> _extent_of_slot; // _size for a free slot.
+    std::vector<std::atomic<uint8_t>> _heat;
+    std::unique_ptr<std::atomic<bool>[]> _slot_dirty;
+    // Extent being copied by migration, and whether it was written meanwhile.
+    std::atomic<uint64_t> _migrating_extent;
+    std::atomic<bool> _migration_raced{false};
+
+    std::mutex _migration_mutex;
+    std::condition_variable _migration_cv;
+    bool _stopping = false;
+    std::thread _migrator;
+
+    std::atomic<uint64_t> _fast_tier_bytes{0};
+    std::atomic<uint64_t> _slow_tier_bytes{0};
+    uint64_t _promotions = 0;
+    uint64_t _demotions = 0;
+    uint64_t _aborted_migrations = 0;
+
+    uint64_t slot_offset(uint32_t slot) const {
+        return uint64_t(slot) * _extent_size;
+    }
+
+    uint64_t extent_length(uint64_t extent) const {
+        return std::min(_extent_size, _size - extent * _extent_size);
+    }
+
+    // Runs fn(fd, offset_in_fd, pos, length) for each piece of [offset, offset + size),
+    // split at extent boundaries. Must be called with _mutex held.
+    int for_each_piece(uint64_t offset, uint64_t size, bool write, std::function<ssize_t(int, uint64_t, uint64_t, uint64_t)> fn) {
+        for (uint64_t pos = offset; pos < offset + size; ) {
+            uint64_t extent = pos / _extent_size;
+            uint64_t extent_offset = pos - extent * _extent_size;
+            uint64_t length = std::min(_extent_size - extent_offset, offset + size - pos);
+            uint8_t heat = _heat[extent].load(std::memory_order_relaxed);
+            if (heat < 255) {
+                _heat[extent].store(heat + 1, std::memory_order_relaxed);
+            }
+            if (write && _migrating_extent == extent) {
+                _migration_raced = true;
+            }
+            uint32_t slot = _slot_of_extent[extent];
+            ssize_t ret;
+            if (slot != BLOCKV_TIER_NO_SLOT) {
+                if (write) {
+                    _slot_dirty[slot] = true;
+                }
+                ret = fn(_fast_fd, slot_offset(slot) + extent_offset, pos, length);
+                _fast_tier_bytes += length;
+            } else {
+                ret = fn(_slow_fd, pos, pos, length);
+                _slow_tier_bytes += length;
+            }
+            if (ret == -1) {
+                return -1;
+            }
+            pos += length;
+        }
+        return 0;
+    }
+
+    int write_map_entry(uint64_t extent) {
+        if (pwrite(_map_fd, &_slot_of_extent[extent], sizeof(uint32_t), sizeof(map_header) + extent * sizeof(uint32_t)) != sizeof(uint32_t)) {
+            return -1;
+        }
+        return fdatasync(_map_fd);
+    }
+
+    void load_map(const char* map_path, uint64_t slots) {
+        map_header hdr;
+        ssize_t ret = pread(_map_fd, &hdr, sizeof(hdr), 0);
+        if (ret == 0) {
+            hdr = { BLOCKV_TIER_MAP_MAGIC, 0, _extent_size, _size, slots };
+            size_t bytes = _slot_of_extent.size() * sizeof(uint32_t);
+            if (pwrite(_map_fd, &hdr, sizeof(hdr), 0) != sizeof(hdr) ||
+                    pwrite(_map_fd, _slot_of_extent.data(), bytes, sizeof(hdr)) != ssize_t(bytes) || fdatasync(_map_fd) == -1) {
+                perror("Unable to initialize tier map");
+                exit(1);
+            }
+            return;
+        }
+        if (ret != sizeof(hdr) || hdr.magic != BLOCKV_TIER_MAP_MAGIC || hdr.extent_size != _extent_size || hdr.device_size != _size || hdr.slots > slots) {
+            printf("Tier map %s doesn't match the devices it's used with!\n", map_path);
+            exit(1);
+        }
+        size_t bytes = _slot_of_extent.size() * sizeof(uint32_t);
+        if (pread(_map_fd, _slot_of_extent.data(), bytes, sizeof(hdr)) != ssize_t(bytes)) {
+            printf("Tier map %s is truncated!\n", map_path);
+            exit(1);
+        }
+        for (uint64_t extent = 0; extent < _slot_of_extent.size(); extent++) {
+            uint32_t slot = _slot_of_extent[extent];
+            if (slot != BLOCKV_TIER_NO_SLOT) {
+                _extent_of_slot[slot] = extent;
+                _slot_dirty[slot] = true;
+            }
+        }
+    }
+
+    int copy(int from_fd, uint64_t from, int to_fd, uint64_t to, uint64_t length) {
+        std::vector<char> buf(length);
+        ssize_t ret = pread(from_fd, buf.data(), length, from);
+        if (ret == -1) {
+            return -1;
+        }
+        // Slow tier shorter than the device reads as zeroes.
+        memset(buf.data() + ret, 0, length - ret);
+        if (pwrite(to_fd, buf.data(), length, to) != ssize_t(length)) {
+            return -1;
+        }
+        return fdatasync(to_fd);
+    }
+
+    // Copies an extent between tiers, then calls commit with _mutex held
+    // exclusively, unless the extent was written during the copy. The extent
+    // is published under _mutex too, so that every write either completes
+    // before the copy starts or sees it.
+    bool migrate(uint64_t extent, int from_fd, uint64_t from, int to_fd, uint64_t to, std::function<int()> commit) {
+        {
+            std::lock_guard<std::shared_timed_mutex> lock(_mutex);
+            _migration_raced = false;
+            _migrating_extent = extent;
+        }
+        int ret = copy(from_fd, from, to_fd, to, extent_length(extent));
+        std::lock_guard<std::shared_timed_mutex> lock(_mutex);
+        _migrating_extent = _size;
+        if (ret == -1 || _migration_raced) {
+            if (ret == -1) {
+                perror("Tier migration failed");
+            }
+            _aborted_migrations++;
+            return false;
+        }
+        if (commit() == -1) {
+            perror("Unable to update tier map");
+            return false;
+        }
+        return true;
+    }
+
+    bool promote(uint64_t extent, uint32_t slot) {
+        return migrate(extent, _slow_fd, extent * _extent_size, _fast_fd, slot_offset(slot), [this, extent, slot] {
+            _slot_of_extent[extent] = slot;
+            _extent_of_slot[slot] = extent;
+            _slot_dirty[slot] = false;
+            _promotions++;
+            return write_map_entry(extent);
+        });
+    }
+
+    bool demote(uint32_t slot) {
+        uint64_t extent = _extent_of_slot[slot];
+        auto commit = [this, extent, slot] {
+            _slot_of_extent[extent] = BLOCKV_TIER_NO_SLOT;
+            _extent_of_slot[slot] = _size;
+            _demotions++;
+            return write_map_entry(extent);
+        };
+        if (!_slot_dirty[slot]) {
+            std::lock_guard<std::shared_timed_mutex> lock(_mutex);
+            return !_slot_dirty[slot] && commit() == 0;
+        }
+        {
+            std::lock_guard<std::shared_timed_mutex> lock(_mutex);
+            _slot_dirty[slot] = false;
+        }
+        if (!migrate(extent, _fast_fd, slot_offset(slot), _slow_fd, extent * _extent_size, commit)) {
+            _slot_dirty[slot] = true;
+            return false;
+        }
+        return true;
+    }
+
+    void migration_round() {
+        // Hottest extents of the slow tier, and coldest ones of the fast tier.
+        std::vector<std::pair<uint8_t, uint64_t>> hot;
+        std::vector<std::pair<uint8_t, uint32_t>> cold;
+        std::vector<uint32_t> free_slots;
+        {
+            std::shared_lock<std::shared_timed_mutex> lock(_mutex);
+            for (uint64_t extent = 0; extent < _slot_of_extent.size(); extent++) {
+                uint8_t heat = _heat[extent].load(std::memory_order_relaxed);
+                if (_slot_of_extent[extent] == BLOCKV_TIER_NO_SLOT && heat >= BLOCKV_TIER_PROMOTE_MIN_HEAT) {
+                    hot.emplace_back(heat, extent);
+                }
+            }
+            for (uint32_t slot = 0; slot < _extent_of_slot.size(); slot++) {
+                if (_extent_of_slot[slot] == _size) {
+                    free_slots.push_back(slot);
+                } else {
+                    cold.emplace_back(_heat[_extent_of_slot[slot]].load(std::memory_order_relaxed), slot);
+                }
+            }
+        }
+        size_t candidates = std::min(hot.size(), size_t(BLOCKV_TIER_MIGRATIONS_PER_ROUND));
+        std::partial_sort(hot.begin(), hot.begin() + candidates, hot.end(), std::greater<std::pair<uint8_t, uint64_t>>());
+        std::sort(cold.begin(), cold.end());
+
+        auto next_cold = cold.begin();
+        for (size_t i = 0; i < candidates; i++) {
+            uint64_t extent = hot[i].second;
+            uint32_t slot;
+            if (!free_slots.empty()) {
+                slot = free_slots.back();
+                free_slots.pop_back();
+            } else if (next_cold != cold.end() && next_cold->first < hot[i].first / 2) {
+                // Only clearly colder extents are demoted, so that extents
+                // with similar heat don't keep trading places.
+                slot = (next_cold++)->second;
+                if (!demote(slot)) {
+                    continue;
+                }
+            } else {
+                break;
+            }
+            if (!promote(extent, slot)) {
+                free_slots.push_back(slot);
+            }
+        }
+
+        for (auto& heat : _heat) {
+            heat.store(heat.load(std::memory_order_relaxed) / 2, std::memory_order_relaxed);
+        }
+    }
+
+    void migration_loop() {
+        std::unique_lock<std::mutex> lock(_migration_mutex);
+        while (!_stopping) {
+            _migration_cv.wait_for(lock, _migration_interval);
+            if (_stopping) {
+                break;
+            }
+            lock.unlock();
+            migration_round();
+            lock.lock();
+        }
+    }
+public:
+    tiered_backend(int slow_fd, uint64_t size, int fast_fd, uint64_t fast_size, const char* map_path,
+            uint64_t extent_size, std::chrono::seconds migration_interval)
+        : _slow_fd(slow_fd)
+        , _fast_fd(fast_fd)
+        , _extent_size(extent_size)
+        , _size(size)
+        , _migration_interval(migration_interval)
+        , _slot_of_extent((size + extent_size - 1) / extent_size, BLOCKV_TIER_NO_SLOT)
+        , _extent_of_slot(std::min(fast_size / extent_size, uint64_t(BLOCKV_TIER_NO_SLOT)), size)
+        , _heat(_slot_of_extent.size())
+        , _slot_dirty(new std::atomic<bool>[_extent_of_slot.size()])
+        , _migrating_extent(size) {
+        for (size_t slot = 0; slot < _extent_of_slot.size(); slot++) {
+            _slot_dirty[slot] = false;
+        }
+        _map_fd = open(map_path, O_RDWR | O_CREAT, 0644);
+        if (_map_fd == -1) {
+            printf("Unable to open tier map %s: %s\n", map_path, strerror(errno));
+            exit(1);
+        }
+        load_map(map_path, _extent_of_slot.size());
+        uint64_t used = std::count_if(_extent_of_slot.begin(), _extent_of_slot.end(), [size] (uint64_t e) { return e != size; });
+        printf("Tiers: %lu of %lu fast tier slots in use\n", used, _extent_of_slot.size());
+        _migrator = std::thread([this] { migration_loop(); });
+    }
+
+    ~tiered_backend() {
+        {
+            std::lock_guard<std::mutex> lock(_migration_mutex);
+            _stopping = true;
+        }
+        _migration_cv.notify_one();
+        _migrator.join();
+        uint64_t total = _fast_tier_bytes + _slow_tier_bytes;
+        printf("Tiers: %lu promotions, %lu demotions, %lu migrations aborted by writes\n", _promotions, _demotions, _aborted_migrations);
+        printf("Tiers: %lu bytes served from fast tier (%.1f%%), %lu from slow tier\n", uint64_t(_fast_tier_bytes),
+            (total) ? 100.0 * _fast_tier_bytes / total : 0.0, uint64_t(_slow_tier_bytes));
+        close(_map_fd);
+        close(_fast_fd);
+        close(_slow_fd);
+    }
+
+    virtual ssize_t read(char* buf, uint32_t size, uint64_t offset) {
+        std::shared_lock<std::shared_timed_mutex> lock(_mutex);
+        int ret = for_each_piece(offset, size, false, [buf, offset] (int fd, uint64_t fd_offset, uint64_t pos, uint64_t length) {
+            ssize_t ret = pread(fd, buf + (pos - offset), length, fd_offset);
+            if (ret >= 0 && uint64_t(ret) < length) {
+                memset(buf + (pos - offset) + ret, 0, length - ret);
+            }
+            return ret;
+        });
+        return (ret == -1) ? -1 : size;
+    }
+
+    virtual ssize_t writev(const struct iovec* iov, int iovcnt, uint64_t offset) {
+        uint64_t size = 0;
+        for (int i = 0; i < iovcnt; i++) {
+            size += iov[i].iov_len;
+        }
+        std::shared_lock<std::shared_timed_mutex> lock(_mutex);
+        int ret = for_each_piece(offset, size, true, [iov, iovcnt, offset] (int fd, uint64_t fd_offset, uint64_t pos, uint64_t length) {
+            std::vector<struct iovec> piece;
+            slice_iovec(iov, iovcnt, pos - offset, length, piece);
+            return pwritev_all(fd, std::move(piece), fd_offset);
+        });
+        return (ret == -1) ? -1 : size;
+    }
+
+    virtual int sync() {
+        if (fdatasync(_fast_fd) == -1) {
+            return -1;
+        }
+        return fdatasync(_slow_fd);
+    }
+};
+
+// Merges adjacent or overlapping writes that arrive within a bounded delay, so
+// that bursts of small sequential writes reach the disk as a few large
+// pwritev() calls instead of one pwrite() each.
+//
+// A write is acknowledged as soon as it's buffered here. Reads that overlap a
+// pending write drain the combiner first, so they always see the latest data.
+// A write that fails to reach the disk after it was acknowledged makes every
+// later drain() fail, so that the next flush reports the loss.
+struct write_combiner {
+private:
+    using clock = std::chrono::steady_clock;
+
+    storage_backend& _backend;
+    std::shared_timed_mutex& _device_mutex;
+    std::chrono::microseconds _max_delay;
+    size_t _max_pending_bytes;
+
+    std::mutex _mutex;
+    std::condition_variable _cv;
+    // Pending writes keyed by offset. Entries never overlap each other.
+    std::map<uint64_t, std::vector<char>> _pending;
+    size_t _pending_bytes = 0;
+    clock::time_point _oldest_pending;
+    bool _stopping = false;
+    std::thread _flusher;
+
+    uint64_t _writes = 0;
+    uint64_t _backend_writes = 0;
+    // errno value of the first acknowledged write that failed, 0 if none did.
+    int _error = 0;
+
+    bool overlaps(uint64_t offset, uint32_t size) const {
+        auto it = _pending.lower_bound(offset + size);
+        if (it == _pending.begin()) {
+            return false;
+        }
+        --it;
+        return it->first + it->second.size() > offset;
+    }
+
+    void write_run(std::vector<struct iovec>& iov, uint64_t offset, size_t size) {
+        ssize_t ret = _backend.writev(iov.data(), iov.size(), offset);
+        if (ret == -1) {
+            _error = (_error) ? _error : errno;
+            perror("pwritev");
+        } else if (size_t(ret) != size) {
+            printf("Short write while draining write combiner: expected: %lu, actual %ld\n", size, ret);
+            _error = (_error) ? _error : EIO;
+        }
+        _backend_writes++;
+        iov.clear();
+    }
+
+    // Writes all pending data to disk, merging contiguous entries into a
+    // single pwritev(). Must be called with _mutex held.
+    void flush_locked() {
+        if (_pending.empty()) {
+            return;
+        }
+        std::lock_guard<std::shared_timed_mutex> device_lock(_device_mutex);
+        std::vector<struct iovec> iov;
+        uint64_t run_offset = 0;
+        size_t run_size = 0;
+
+        for (auto& it : _pending) {
+            bool contiguous = !iov.empty() && run_offset + run_size == it.first;
+            if (!iov.empty() && (!contiguous || iov.size() == IOV_MAX)) {
+                write_run(iov, run_offset, run_size);
+            }
+            if (iov.empty()) {
+                run_offset = it.first;
+                run_size = 0;
+            }
+            iov.push_back({ it.second.data(), it.second.size() });
+            run_size += it.second.size();
+        }
+        write_run(iov, run_offset, run_size);
+
+        _pending.clear();
+        _pending_bytes = 0;
+    }
+
+    void flusher_loop() {
+        std::unique_lock<std::mutex> lock(_mutex);
+        while (!_stopping) {
+            if (_pending.empty()) {
+                _cv.wait(lock);
+                continue;
+            }
+            auto deadline = _oldest_pending + _max_delay;
+            if (clock::now() >= deadline) {
+                flush_locked();
+                continue;
+            }
+            _cv.wait_until(lock, deadline);
+        }
+        flush_locked();
+    }
+public:
+    write_combiner(storage_backend& backend, std::shared_timed_mutex& device_mutex, std::chrono::microseconds max_delay, size_t max_pending_bytes)
+        : _backend(backend)
+        , _device_mutex(device_mutex)
+        , _max_delay(max_delay)
+        , _max_pending_bytes(max_pending_bytes) {
+        _flusher = std::thread([this] { flusher_loop(); });
+    }
+
+    ~write_combiner() {
+        {
+            std::lock_guard<std::mutex> lock(_mutex);
+            _stopping = true;
+        }
+        _cv.notify_one();
+        _flusher.join();
+        printf("Write combiner: %lu writes issued as %lu backend writes\n", _writes, _backend_writes);
+    }
+
+    void add(const char* buf, uint32_t size, uint64_t offset) {
+        std::lock_guard<std::mutex> lock(_mutex);
+        uint64_t end = offset + size;
+
+        // Trim or drop pending entries that the new write overlaps, so that
+        // the most recent data always wins.
+        auto it = _pending.upper_bound(offset);
+        if (it != _pending.begin()) {
+            --it;
+        }
+        while (it != _pending.end() && it->first < end) {
+            uint64_t entry_offset = it->first;
+            uint64_t entry_end = entry_offset + it->second.size();
+            if (entry_end <= offset) {
+                ++it;
+                continue;
+            }
+            std::vector<char> data = std::move(it->second);
+            _pending_bytes -= data.size();
+            it = _pending.erase(it);
+            if (entry_offset < offset) {
+                _pending.emplace(entry_offset, std::vector<char>(data.begin(), data.begin() + (offset - entry_offset)));
+                _pending_bytes += offset - entry_offset;
+            }
+            if (entry_end > end) {
+                it = _pending.emplace(end, std::vector<char>(data.begin() + (end - entry_offset), data.end())).first;
+                _pending_bytes += entry_end - end;
+            }
+        }
+
+        if (_pending.empty()) {
+            _oldest_pending = clock::now();
+        }
+        _pending.emplace(offset, std::vector<char>(buf, buf + size));
+        _pending_bytes += size;
+        _writes++;
+
+        if (_pending_bytes >= _max_pending_bytes) {
+            flush_locked();
+        } else {
+            _cv.notify_one();
+        }
+    }
+
+    // Returns true if data may be pending for the given range, without
+    // waiting for a drain in progress.
+    bool may_have_pending(uint64_t offset, uint32_t size) {
+        std::unique_lock<std::mutex> lock(_mutex, std::try_to_lock);
+        return !lock.owns_lock() || overlaps(offset, size);
+    }
+
+    // Makes sure that data pending for the given range reached the disk.
+    void drain_range(uint64_t offset, uint32_t size) {
+        std::lock_guard<std::mutex> lock(_mutex);
+        if (overlaps(offset, size)) {
+            flush_locked();
+        }
+    }
+
+    // Returns 0 if every write acknowledged so far reached the disk, or an
+    // errno value.
+    int drain() {
+        std::lock_guard<std::mutex> lock(_mutex);
+        flush_locked();
+        return _error;
+    }
+};
+
+// Makes durable writes of many connections share a single fdatasync().
+//
+// Callers that need durability join the open batch and sleep. A committer
+// thread closes the batch, syncs the device once and wakes every member of
+// the batch together. Requests that arrive while a sync is in progress join
+// the next batch, and the committer additionally waits up to an adaptive
+// window for more members when batching is paying off.
+struct group_commit {
+private:
+    using clock = std::chrono::steady_clock;
+
+    struct batch {
+        clock::time_point opened = clock::now();
+        size_t members = 0;
+        int error = 0;
+        bool done = false;
+    };
+
+    storage_backend& _backend;
+    // Called before every sync so that data buffered in the server is
+    // included. Returns 0, or an errno value that fails the batch.
+    std::function<int()> _before_sync;
+    std::chrono::microseconds _max_window;
+    std::chrono::microseconds _window{0};
+    std::chrono::microseconds _sync_latency{0};
+
+    std::mutex _mutex;
+    std::condition_variable _committer_cv;
+    std::condition_variable _members_cv;
+    std::shared_ptr<batch> _open_batch;
+    bool _stopping = false;
+    std::thread _committer;
+
+    log2_histogram _batch_size;
+    log2_histogram _commit_latency_us;
+
+    // Grow the window while batches have company, shrink it when a member is
+    // alone, and never wait longer than a sync is expected to take.
+    void adapt_window(size_t members) {
+        if (members > 1) {
+            _window = std::max(_window * 2, std::chrono::microseconds(50));
+        } else {
+            _window /= 2;
+        }
+        _window = std::min(_window, std::min(_max_window, _sync_latency));
+    }
+
+    void committer_loop() {
+        std::unique_lock<std::mutex> lock(_mutex);
+        for (;;) {
+            _committer_cv.wait(lock, [this] { return _open_batch || _stopping; });
+            if (!_open_batch) {
+                break;
+            }
+            auto deadline = _open_batch->opened + _window;
+            _committer_cv.wait_until(lock, deadline, [this] { return _stopping; });
+
+            std::shared_ptr<batch> b = std::move(_open_batch);
+            lock.unlock();
+
+            auto start = clock::now();
+            int error = _before_sync();
+            if (_backend.sync() == -1) {
+                error = (error) ? error : errno;
+                perror("sync");
+            }
+            auto sync_latency = std::chrono::duration_cast<std::chrono::microseconds>(clock::now() - start);
+
+            lock.lock();
+            b->error = error;
+            b->done = true;
+            _sync_latency = (_sync_latency * 7 + sync_latency) / 8;
+            adapt_window(b->members);
+            _batch_size.add(b->members);
+            _commit_latency_us.add(std::chrono::duration_cast<std::chrono::microseconds>(clock::now() - b->opened).count());
+            _members_cv.notify_all();
+        }
+    }
+public:
+    group_commit(storage_backend& backend, std::function<int()> before_sync, std::chrono::microseconds max_window)
+        : _backend(backend)
+        , _before_sync(std::move(before_sync))
+        , _max_window(max_window) {
+        _committer = std::thread([this] { committer_loop(); });
+    }
+
+    ~group_commit() {
+        {
+            std::lock_guard<std::mutex> lock(_mutex);
+            _stopping = true;
+        }
+        _committer_cv.notify_one();
+        _committer.join();
+        _batch_size.print("Group commit batch size", "requests");
+        _commit_latency_us.print("Group commit latency", "us");
+    }
+
+    // Returns once every write acknowledged before the call is durable.
+    // Returns 0 on success, or an errno value if the sync failed.
+    int commit() {
+        std::unique_lock<std::mutex> lock(_mutex);
+        if (!_open_batch) {
+            _open_batch = std::make_shared<batch>();
+        }
+        std::shared_ptr<batch> b = _open_batch;
+        b->members++;
+        _committer_cv.notify_one();
+        _members_cv.wait(lock, [&b] { return b->done; });
+        return b->error;
+    }
+};
+
+#define BLOCKV_ZERO_MAP_BLOCK_SIZE (64 * 1024)
+
+// Map of the blocks of a device that are known to read back as zeroes, so
+// that reads of them are answered without any I/O. Freshly provisioned
+// devices are mostly unallocated, and guests scan them all the time. Blocks
+// are learned in the background by walking the holes of the backend, and
+// from write_zeroes(); they're forgotten as soon as they're written to.
+// Lookups don't take locks.
+struct zero_map {
+private:
+    storage_backend& _backend;
+    uint64_t _device_size;
+    uint64_t _blocks;
+    std::unique_ptr<std::atomic<uint64_t>[]> _zero;
+    // Blocks written since the walk started. The walk may have seen a hole
+    // before a write reached it, so it must not mark them as zero.
+    block_bitmap _written;
+    std::mutex _mutex;
+    std::thread _walker;
+    std::atomic<bool> _stopping{false};
+
+    void set(uint64_t block) {
+        _zero[block / 64] |= uint64_t(1) << (block % 64);
+    }
+
+    bool test(uint64_t block) const {
+        return _zero[block / 64] & (uint64_t(1) << (block % 64));
+    }
+
+    // Blocks that [offset, offset + size) covers entirely, the last block of
+    // the device being covered once its end is.
+    bool covered_blocks(uint64_t offset, uint64_t size, uint64_t& first, uint64_t& last) const {
+        uint64_t end = offset + size;
+        first = (offset + BLOCKV_ZERO_MAP_BLOCK_SIZE - 1) / BLOCKV_ZERO_MAP_BLOCK_SIZE;
+        uint64_t end_block = (end >= _device_size) ? _blocks : end / BLOCKV_ZERO_MAP_BLOCK_SIZE;
+        if (first >= end_block) {
+            return false;
+        }
+        last = end_block - 1;
+        return true;
+    }
+
+    void walk() {
+        uint64_t offset = 0;
+        uint64_t zero_bytes = 0;
+        while (offset < _device_size && !_stopping) {
+            std::lock_guard<std::mutex> lock(_mutex);
+            int64_t data = _backend.seek(offset, SEEK_DATA);
+            if (data == -1 && errno != ENXIO) {
+                perror("Unable to find the holes of the device");
+                return;
+            }
+            // Past the last data, the rest of the device is a hole.
+            uint64_t hole_end = (data == -1) ? _device_size : std::min(uint64_t(data), _device_size);
+            uint64_t first, last;
+            if (covered_blocks(offset, hole_end - offset, first, last)) {
+                for (uint64_t block = first; block <= last; block++) {
+                    if (!_written.test(block)) {
+                        set(block);
+                    }
+                }
+                zero_bytes += std::min((last + 1) * BLOCKV_ZERO_MAP_BLOCK_SIZE, _device_size) - first * BLOCKV_ZERO_MAP_BLOCK_SIZE;
+            }
+            if (hole_end == _device_size) {
+                break;
+            }
+            int64_t hole = _backend.seek(hole_end, SEEK_HOLE);
+            if (hole == -1) {
+                perror("Unable to find the holes of the device");
+                return;
+            }
+            offset = hole;
+        }
+        if (!_stopping) {
+            printf("Zero map: %lu of %lu bytes of the device are unallocated\n", zero_bytes, _device_size);
+        }
+    }
+public:
+    zero_map(storage_backend& backend, uint64_t device_size)
+        : _backend(backend)
+        , _device_size(device_size)
+        , _blocks((device_size + BLOCKV_ZERO_MAP_BLOCK_SIZE - 1) / BLOCKV_ZERO_MAP_BLOCK_SIZE)
+        , _zero(new std::atomic<uint64_t>[(_blocks + 63) / 64])
+        , _written(device_size, BLOCKV_ZERO_MAP_BLOCK_SIZE) {
+        for (uint64_t i = 0; i < (_blocks + 63) / 64; i++) {
+            _zero[i] = 0;
+        }
+        _walker = std::thread([this] { walk(); });
+    }
+    ~zero_map() {
+        _stopping = true;
+        _walker.join();
+    }
+
+    // Tells whether [offset, offset + size) is known to read back as zeroes.
+    bool is_zero(uint64_t offset, uint32_t size) const {
+        if (!size) {
+            return false;
+        }
+        uint64_t last = (offset + size - 1) / BLOCKV_ZERO_MAP_BLOCK_SIZE;
+        for (uint64_t block = offset / BLOCKV_ZERO_MAP_BLOCK_SIZE; block <= last; block++) {
+            if (!test(block)) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    // Must be called once data written to [offset, offset + size) may be
+    // read back, i.e. once it reached the backend or a write combiner.
+    void written(uint64_t offset, uint32_t size) {
+        if (!size) {
+            return;
+        }
+        std::lock_guard<std::mutex> lock(_mutex);
+        uint64_t last = (offset + size - 1) / BLOCKV_ZERO_MAP_BLOCK_SIZE;
+        for (uint64_t block = offset / BLOCKV_ZERO_MAP_BLOCK_SIZE; block <= last; block++) {
+            _written.set(block);
+            _zero[block / 64] &= ~(uint64_t(1) << (block % 64));
+        }
+    }
+
+    // Must be called once [offset, offset + size) was zeroed, with no other
+    // write to the range in flight.
+    void zeroed(uint64_t offset, uint32_t size) {
+        uint64_t first, last;
+        if (!covered_blocks(offset, size, first, last)) {
+            return;
+        }
+        std::lock_guard<std::mutex> lock(_mutex);
+        for (uint64_t block = first; block <= last; block++) {
+            set(block);
+        }
+    }
+};
+
+#define BLOCKV_REPLICATION_BLOCK_SIZE (64 * 1024)
+// Writes are sent to the secondary in pieces of at most this size, and
+// blocks are resynced from the device in runs of at most this size.
+#define BLOCKV_REPLICATION_MAX_WRITE (1024 * 1024)
+// Logged writes that are sent without waiting for the max lag to pass.
+#define BLOCKV_REPLICATION_BATCH (8 * 1024 * 1024)
+#define BLOCKV_DEFAULT_REPLICATION_BUFFER (64 * 1024 * 1024)
+#define BLOCKV_DEFAULT_REPLICATION_MAX_LAG_MS 100
+#define BLOCKV_REPLICATION_RETRY_INTERVAL_S 1
+
+// Replicates the writes of a device to the same device exported by another
+// blockv server (the secondary), after they're acknowledged. Writes are
+// logged in memory, where one that overlaps or follows the write logged
+// right before is merged into it, and they're sent at most max_lag later, in
+// batches of pipelined tagged writes followed by a flush. Writes that don't
+// fit in the log, and the ones in flight when the secondary fails, are only
+// remembered as blocks to be resynced from the device once the log is sent.
+// Those blocks are kept on disk across clean restarts; the whole device is
+// resynced on first use and after a crash.
+// With synchronous replication, writes wait for room in the log, then for the
+// secondary to have them durably, unless it's unreachable.
+//
+// Writes are logged as they're acknowledged, which, with write combining, is
+// before they reach the device: the secondary may have a write before the
+// device does, and keeps it if writing it to the device fails later.
+struct replicator {
+private:
+    using clock = std::chrono::steady_clock;
+
+    struct log_entry {
+        uint64_t offset;
+        uint64_t size;
+        std::vector<char> data; // empty for zeroes.
+        uint64_t seq;
+        clock::time_point logged_at;
+    };
+
+    struct in_flight_write {
+        uint64_t offset;
+        uint32_t size;
+    };
+
+    std::string _secondary;
+    uint64_t _size;
+    // Reads the device, to resync blocks whose writes weren't kept.
+    std::function<int(char*, uint32_t, uint64_t)> _read;
+    size_t _buffer_size;
+    std::chrono::milliseconds _max_lag;
+    bool _synchronous;
+    std::unique_ptr<persistent_bitmap> _persisted_resync;
+    std::mutex _mutex;
+    std::condition_variable _cv;
+    std::condition_variable _replicated_cv;
+    std::deque<log_entry> _log;
+    size_t _log_bytes = 0;
+    bool _log_full = false;
+    block_bitmap _resync;
+    uint64_t _resync_blocks = 0;
+    uint64_t _resync_cursor = 0;
+    uint64_t _next_seq = 1;
+    // Every logged write up to this one is durable on the secondary.
+    uint64_t _replicated_seq = 0;
+    bool _connected = false;
+    // Failures to connect are reported once until it succeeds.
+    bool _unreachable = false;
+    bool _stopping = false;
+    int _fd = -1;
+    uint32_t _credit_requests = 0;
+    uint32_t _credit_bytes = 0;
+    std::thread _sender;
+    uint64_t _sent_writes = 0;
+    uint64_t _sent_bytes = 0;
+    uint64_t _coalesced_writes = 0;
+    uint64_t _resynced_bytes = 0;
+
+    void mark_resync(uint64_t offset, uint64_t size) {
+        if (!size) {
+            return;
+        }
+        for (uint64_t block = offset / _resync.block_size(); block <= (offset + size - 1) / _resync.block_size(); block++) {
+            if (!_resync.test(block)) {
+                _resync.set(block);
+                _resync_blocks++;
+            }
+        }
+    }
+
+    // Logs a write, or marks its blocks to be resynced if the log is full.
+    // An empty log takes any write. Returns its sequence number, or 0 if it
+    // wasn't logged.
+    uint64_t log(const char* buf, uint64_t size, uint64_t offset) {
+        if (!size) {
+            return 0;
+        }
+        if (buf && !has_room(size)) {
+            if (!_log_full) {
+                printf("Replication: log is full, writes will be resynced from the device\n");
+                _log_full = true;
+            }
+            mark_resync(offset, size);
+            return 0;
+        }
+        if (buf && !_log.empty()) {
+            log_entry& last = _log.back();
+            uint64_t end = std::max(last.offset + last.size, offset + size);
+            if (!last.data.empty() && offset >= last.offset && offset <= last.offset + last.size &&
+                    end - last.offset <= BLOCKV_REPLICATION_MAX_WRITE) {
+                _log_bytes += end - last.offset - last.size;
+                last.data.resize(end - last.offset);
+                memcpy(last.data.data() + (offset - last.offset), buf, size);
+                last.size = end - last.offset;
+                last.seq = _next_seq++;
+                _coalesced_writes++;
+                return last.seq;
+            }
+        }
+        log_entry entry;
+        entry.offset = offset;
+        entry.size = size;
+        if (buf) {
+            entry.data.assign(buf, buf + size);
+            _log_bytes += size;
+        }
+        entry.seq = _next_seq++;
+        entry.logged_at = clock::now();
+        _log.push_back(std::move(entry));
+        return _log.back().seq;
+    }
+
+    bool has_room(uint64_t size) const {
+        return _log.empty() || _log_bytes + size <= _buffer_size;
+    }
+
+    void disconnect() {
+        if (_fd != -1) {
+            close(_fd);
+            _fd = -1;
+        }
+        std::lock_guard<std::mutex> lock(_mutex);
+        _connected = false;
+        _replicated_cv.notify_all();
+    }
+
+    // Connects to the secondary and says hello, so that writes are pipelined
+    // within the credits it grants.
+    bool connect() {
+        blockv_server_info info;
+        _fd = blockv_connect(_secondary.c_str(), info);
+        if (_fd == -1) {
+            if (!_unreachable) {
+                printf("Replication: unable to connect to secondary %s: %s\n", _secondary.c_str(), strerror(errno));
+                _unreachable = true;
+            }
+            return false;
+        }
+        int one = 1;
+        setsockopt(_fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+        blockv_hello_request hello_request;
+        blockv_hello_response hello_response;
+        // Any server that takes tagged writes with credits will do.
+        if (info.version < 6 || info.version > BLOCKV_PROTOCOL_VERSION || info.device_size != _size || info.read_only ||
+                !blockv_write_exact(_fd, &hello_request, blockv_hello_request::serialized_size()) ||
+                !blockv_read_exact(_fd, &hello_response, blockv_hello_response::serialized_size())) {
+            hello_response.error = EPROTO;
+        } else {
+            blockv_hello_response::to_host(hello_response);
+        }
+        if (hello_response.error) {
+            if (!_unreachable) {
+                printf("Replication: secondary %s doesn't match the device, or can't be written to\n", _secondary.c_str());
+                _unreachable = true;
+            }
+            disconnect();
+            return false;
+        }
+        _credit_requests = hello_response.credit_requests;
+        _credit_bytes = std::min(hello_response.credit_bytes, uint32_t(BLOCKV_REPLICATION_MAX_WRITE));
+        printf("Replication: connected to secondary %s\n", _secondary.c_str());
+        _unreachable = false;
+        std::lock_guard<std::mutex> lock(_mutex);
+        _connected = true;
+        return true;
+    }
+
+    bool send_request(uint64_t handle, uint8_t priority, uint8_t request, const char* data, uint32_t size, uint64_t offset) {
+        char header[blockv_request_tag::serialized_size() + blockv_write_request::serialized_size(0)];
+        *(blockv_request_tag*) header = blockv_request_tag::to_network(priority, handle, 0);
+        blockv_write_request* write_request = (blockv_write_request*) (header + blockv_request_tag::serialized_size());
+        write_request->request = request;
+        if (request == blockv_requests::FLUSH) {
+            return blockv_write_exact(_fd, header, blockv_request_tag::serialized_size() + sizeof(request));
+        }
+        write_request->size = htonl(size);
+        write_request->offset = htobe64(offset);
+        return blockv_write_exact(_fd, header, sizeof(header)) && blockv_write_exact(_fd, data, size);
+    }
+
+    // Reads the response to a request in flight, and returns false if the
+    // request failed.
+    bool receive_response(std::unordered_map<uint64_t, in_flight_write>& in_flight, uint64_t& bytes_in_flight) {
+        blockv_response_tag tag;
+        if (!blockv_read_exact(_fd, &tag, blockv_response_tag::serialized_size())) {
+            return false;
+        }
+        blockv_response_tag::to_host(tag);
+        auto it = in_flight.find(tag.handle);
+        if (it == in_flight.end() || tag.error) {
+            return false;
+        }
+        uint32_t result;
+        if (!blockv_read_exact(_fd, &result, sizeof(result))) {
+            return false;
+        }
+        result = ntohl(result);
+        // Writes respond with the bytes written, and the flush with an error.
+        bool flush = !it->second.size;
+        bytes_in_flight -= it->second.size;
+        uint32_t expected = it->second.size;
+        in_flight.erase(it);
+        return (flush) ? result == 0 : result == expected;
+    }
+
+    // Sends the writes, in order, followed by a flush. Writes are pipelined,
+    // except that one overlapping a write in flight waits for it, as the
+    // secondary may complete requests in any order. Returns false if the
+    // secondary failed.
+    bool send_batch(const std::vector<log_entry>& entries, uint8_t priority) {
+        static const std::vector<char> zeroes(BLOCKV_REPLICATION_MAX_WRITE);
+        std::unordered_map<uint64_t, in_flight_write> in_flight;
+        uint64_t bytes_in_flight = 0;
+        uint64_t handle = 0;
+
+        for (const log_entry& entry : entries) {
+            for (uint64_t pos = 0; pos < entry.size; ) {
+                uint32_t size = std::min(entry.size - pos, uint64_t(_credit_bytes));
+                uint64_t offset = entry.offset + pos;
+                auto overlaps = [&] {
+                    for (auto& w : in_flight) {
+                        if (offset < w.second.offset + w.second.size && w.second.offset < offset + size) {
+                            return true;
+                        }
+                    }
+                    return false;
+                };
+                while (!in_flight.empty() && (in_flight.size() == _credit_requests || bytes_in_flight + size > _credit_bytes || overlaps())) {
+                    if (!receive_response(in_flight, bytes_in_flight)) {
+                        return false;
+                    }
+                }
+                const char* data = (entry.data.empty()) ? zeroes.data() : entry.data.data() + pos;
+                if (!send_request(handle, priority, blockv_requests::WRITE, data, size, offset)) {
+                    return false;
+                }
+                in_flight[handle++] = { offset, size };
+                bytes_in_flight += size;
+                _sent_writes++;
+                _sent_bytes += size;
+                pos += size;
+            }
+        }
+        while (!in_flight.empty()) {
+            if (!receive_response(in_flight, bytes_in_flight)) {
+                return false;
+            }
+        }
+        in_flight[handle] = { 0, 0 };
+        return send_request(handle, priority, blockv_requests::FLUSH, nullptr, 0, 0) && receive_response(in_flight, bytes_in_flight);
+    }
+
+    // Takes runs of blocks to be resynced, up to a batch, and reads them from
+    // the device. Their bits are cleared first, so that blocks written
+    // meanwhile are resynced again.
+    std::vector<log_entry> take_resync_batch(std::unique_lock<std::mutex>& lock) {
+        std::vector<log_entry> entries;
+        uint64_t block_size = _resync.block_size();
+        uint64_t max_blocks = BLOCKV_REPLICATION_MAX_WRITE / block_size;
+        uint64_t batch_blocks = 0;
+        for (uint64_t scanned = 0; scanned < _resync.blocks() && batch_blocks < BLOCKV_REPLICATION_BATCH / block_size; scanned++) {
+            uint64_t block = _resync_cursor;
+            _resync_cursor = (_resync_cursor + 1) % _resync.blocks();
+            if (!_resync.test(block)) {
+                continue;
+            }
+            if (entries.empty() || entries.back().offset + entries.back().size != block * block_size ||
+                    entries.back().size == max_blocks * block_size) {
+                entries.push_back({ block * block_size, 0, {}, 0, {} });
+            }
+            entries.back().size += std::min(block_size, _size - block * block_size);
+            _resync.clear(block);
+            _resync_blocks--;
+            batch_blocks++;
+        }
+        lock.unlock();
+        for (log_entry& entry : entries) {
+            entry.data.resize(entry.size);
+            if (_read(entry.data.data(), entry.size, entry.offset) != int(entry.size)) {
+                // Sent as zeroes otherwise.
+                printf("Replication: failed to read %lu bytes at offset %lu to be resynced\n", entry.size, entry.offset);
+                std::fill(entry.data.begin(), entry.data.end(), 0);
+            }
+            _resynced_bytes += entry.size;
+        }
+        lock.lock();
+        return entries;
+    }
+
+    void send_loop() {
+        std::unique_lock<std::mutex> lock(_mutex);
+        for (;;) {
+            // Logged writes are still sent on shutdown if the secondary is
+            // connected; blocks to be resynced are kept on disk instead.
+            if (_stopping && (_log.empty() || _fd == -1)) {
+                break;
+            }
+            if (_fd == -1) {
+                lock.unlock();
+                bool connected = connect();
+                lock.lock();
+                if (!connected) {
+                    _cv.wait_for(lock, std::chrono::seconds(BLOCKV_REPLICATION_RETRY_INTERVAL_S), [this] { return _stopping; });
+                }
+                continue;
+            }
+            if (_log.empty() && (!_resync_blocks || _stopping)) {
+                _cv.wait(lock);
+                continue;
+            }
+            // Writes wait to be batched with later ones, unless they're waited for.
+            if (!_log.empty() && !_synchronous && !_stopping && _log_bytes < BLOCKV_REPLICATION_BATCH &&
+                    clock::now() < _log.front().logged_at + _max_lag) {
+                _cv.wait_until(lock, _log.front().logged_at + _max_lag);
+                continue;
+            }
+
+            // Resyncing reads the latest data of blocks, so it waits for the
+            // log to be sent, which may hold older writes to them.
+            std::vector<log_entry> entries;
+            bool resync = _log.empty();
+            if (resync) {
+                entries = take_resync_batch(lock);
+            } else {
+                while (!_log.empty()) {
+                    _log_bytes -= _log.front().data.size();
+                    entries.push_back(std::move(_log.front()));
+                    _log.pop_front();
+                }
+                _log_full = false;
+                // Synchronous writes may be waiting for room.
+                _replicated_cv.notify_all();
+            }
+            uint64_t seq = (resync) ? 0 : entries.back().seq;
+            lock.unlock();
+            bool sent = send_batch(entries, (resync) ? blockv_priorities::BACKGROUND : blockv_priorities::FOREGROUND);
+            if (!sent) {
+                printf("Replication: lost secondary %s, its pending writes will be resynced\n", _secondary.c_str());
+                disconnect();
+            }
+            lock.lock();
+            if (!sent) {
+                // Whether writes in flight reached the secondary is unknown.
+                for (const log_entry& entry : entries) {
+                    mark_resync(entry.offset, entry.size);
+                }
+                continue;
+            }
+            _replicated_seq = std::max(_replicated_seq, seq);
+            _replicated_cv.notify_all();
+            if (resync && !_resync_blocks) {
+                printf("Replication: secondary %s is in sync\n", _secondary.c_str());
+            }
+        }
+    }
+public:
+    replicator(const std::string& secondary, const char* log_path, uint64_t size, std::function<int(char*, uint32_t, uint64_t)> read,
+            size_t buffer_size, std::chrono::milliseconds max_lag, bool synchronous)
+        : _secondary(secondary)
+        , _size(size)
+        , _read(std::move(read))
+        , _buffer_size(buffer_size)
+        , _max_lag(max_lag)
+        , _synchronous(synchronous)
+        , _resync(size, BLOCKV_REPLICATION_BLOCK_SIZE) {
+        // Blocks left to be resynced by the last run, unless it's the first
+        // one. The file then claims that every block is, until shutdown.
+        bool first_run = access(log_path, F_OK) == -1;
+        _persisted_resync.reset(new persistent_bitmap(log_path, size, BLOCKV_REPLICATION_BLOCK_SIZE));
+        for (uint64_t block = 0; block < _resync.blocks(); block++) {
+            if (first_run || _persisted_resync->test(block)) {
+                _resync.set(block);
+                _resync_blocks++;
+            }
+            _persisted_resync->set(block);
+        }
+        if (_persisted_resync->sync() == -1) {
+            printf("Unable to write replication log %s: %s\n", log_path, strerror(errno));
+            exit(1);
+        }
+        printf("Replication: %s to %s, %lu blocks to resync\n", (synchronous) ? "synchronous" : "asynchronous", secondary.c_str(),
+            _resync_blocks);
+        _sender = std::thread([this] { send_loop(); });
+    }
+
+    ~replicator() {
+        {
+            std::lock_guard<std::mutex> lock(_mutex);
+            _stopping = true;
+        }
+        _cv.notify_all();
+        _replicated_cv.notify_all();
+        _sender.join();
+        if (_fd != -1) {
+            close(_fd);
+        }
+        for (const log_entry& entry : _log) {
+            mark_resync(entry.offset, entry.size);
+        }
+        for (uint64_t block = 0; block < _resync.blocks(); block++) {
+            if (!_resync.test(block)) {
+                _persisted_resync->clear(block);
+            }
+        }
+        printf("Replication: %lu writes (%lu bytes, %lu resynced) sent, %lu coalesced, %lu blocks left to resync\n",
+            _sent_writes, _sent_bytes, _resynced_bytes, _coalesced_writes, _resync_blocks);
+    }
+
+    // Logs a write of buf, or of zeroes if it's null, to be replicated.
+    void write(const char* buf, uint64_t size, uint64_t offset) {
+        std::unique_lock<std::mutex> lock(_mutex);
+        // A synchronous write that didn't fit would only be resynced later.
+        if (_synchronous && buf) {
+            _replicated_cv.wait(lock, [this, size] { return has_room(size) || !_connected || _stopping; });
+        }
+        uint64_t seq = log(buf, size, offset);
+        _cv.notify_one();
+        if (_synchronous && seq) {
+            _replicated_cv.wait(lock, [this, seq] { return _replicated_seq >= seq || !_connected || _stopping; });
+        }
+    }
+};
+
+#define BLOCKV_CBT_BLOCK_SIZE (64 * 1024)
+// Checkpoints kept; changes can't be listed since older ones.
+#define BLOCKV_CBT_MAX_CHECKPOINTS 16
+
+// Tracks the blocks changed since each checkpoint, so that incremental
+// backups only read those. Every checkpoint has a bitmap of the blocks
+// changed from it until the next one, in <path>-<id>, and the blocks changed
+// since a checkpoint are the union of its bitmap and the later ones. The
+// index file at path lists the checkpoints, and tells whether the server
+// was shut down cleanly: bitmaps are only synced on shutdown, so after a
+// crash they may have missed changes, and every checkpoint is dropped.
+struct changed_block_tracker {
+private:
+    std::string _path;
+    uint64_t _size;
+    std::mutex _mutex;
+    // Oldest first; only the last one is being written.
+    std::deque<std::pair<uint64_t, std::unique_ptr<persistent_bitmap>>> _checkpoints;
+    uint64_t _last_id = 0;
+
+    std::string bitmap_path(uint64_t id) const {
+        return _path + "-" + std::to_string(id);
+    }
+
+    // Replaces the index atomically. Returns 0 on success, or -1 with errno set.
+    int write_index(bool clean) {
+        std::string tmp_path = _path + ".tmp";
+        FILE* f = fopen(tmp_path.c_str(), "w");
+        if (!f) {
+            return -1;
+        }
+        fprintf(f, "%s %lu\n", (clean) ? "clean" : "running", _last_id);
+        for (auto& checkpoint : _checkpoints) {
+            fprintf(f, "%lu\n", checkpoint.first);
+        }
+        if (fflush(f) != 0 || fdatasync(fileno(f)) == -1) {
+            int saved_errno = errno;
+            fclose(f);
+            errno = saved_errno;
+            return -1;
+        }
+        fclose(f);
+        return rename(tmp_path.c_str(), _path.c_str());
+    }
+public:
+    changed_block_tracker(const char* path, uint64_t size) : _path(path), _size(size) {
+        FILE* f = fopen(path, "r");
+        if (f) {
+            char state[16];
+            bool clean = fscanf(f, "%15s %lu", state, &_last_id) == 2 && !strcmp(state, "clean");
+            uint64_t id;
+            while (fscanf(f, "%lu", &id) == 1) {
+                if (clean) {
+                    std::unique_ptr<persistent_bitmap> bitmap(new persistent_bitmap(bitmap_path(id).c_str(), size, BLOCKV_CBT_BLOCK_SIZE));
+                    _checkpoints.emplace_back(id, std::move(bitmap));
+                } else {
+                    unlink(bitmap_path(id).c_str());
+                }
+            }
+            fclose(f);
+            if (!clean) {
+                printf("Changed block tracking: checkpoints dropped, as changes may have been missed by a crash\n");
+            }
+        }
+        if (write_index(false) == -1) {
+            printf("Unable to write changed block tracking index %s: %s\n", path, strerror(errno));
+            exit(1);
+        }
+        printf("Changed block tracking: %lu checkpoints (index: %s)\n", _checkpoints.size(), path);
+    }
+
+    ~changed_block_tracker() {
+        bool synced = true;
+        for (auto& checkpoint : _checkpoints) {
+            synced &= checkpoint.second->sync() == 0;
+        }
+        if (!synced || write_index(true) == -1) {
+            printf("Failed to save changed block tracking, checkpoints will be dropped\n");
+        }
+    }
+
+    void changed(uint64_t offset, uint64_t size) {
+        std::lock_guard<std::mutex> lock(_mutex);
+        if (_checkpoints.empty() || !size) {
+            return;
+        }
+        persistent_bitmap& bitmap = *_checkpoints.back().second;
+        for (uint64_t block = offset / BLOCKV_CBT_BLOCK_SIZE; block <= (offset + size - 1) / BLOCKV_CBT_BLOCK_SIZE; block++) {
+            bitmap.set(block);
+        }
+    }
+
+    // Blocks changed from now on are tracked under a new checkpoint, whose
+    // id is returned in id. The oldest checkpoint is dropped once there are
+    // too many. Returns 0 on success, or an errno value.
+    int checkpoint(uint64_t& id) {
+        std::lock_guard<std::mutex> lock(_mutex);
+        id = _last_id + 1;
+        std::string path = bitmap_path(id);
+        unlink(path.c_str());
+        std::unique_ptr<persistent_bitmap> bitmap(new persistent_bitmap(path.c_str(), _size, BLOCKV_CBT_BLOCK_SIZE));
+        _checkpoints.emplace_back(id, std::move(bitmap));
+        _last_id = id;
+        if (_checkpoints.size() > BLOCKV_CBT_MAX_CHECKPOINTS) {
+            uint64_t dropped = _checkpoints.front().first;
+            _checkpoints.pop_front();
+            unlink(bitmap_path(dropped).c_str());
+        }
+        return (write_index(false) == -1) ? errno : 0;
+    }
+
+    // Calls fn with every extent changed since checkpoint id, in offset
+    // order. Returns 0 on success, ENOENT if there's no such checkpoint, or
+    // the errno value fn failed with.
+    int changed_extents(uint64_t id, const std::function<int(uint64_t, uint64_t)>& fn) {
+        // Writes aren't held back while the extents are sent.
+        block_bitmap changed(_size, BLOCKV_CBT_BLOCK_SIZE);
+        {
+            std::lock_guard<std::mutex> lock(_mutex);
+            auto first = std::find_if(_checkpoints.begin(), _checkpoints.end(), [id] (const auto& checkpoint) {
+                return checkpoint.first == id;
+            });
+            if (first == _checkpoints.end()) {
+                return ENOENT;
+            }
+            for (auto it = first; it != _checkpoints.end(); ++it) {
+                it->second->merge_into(changed);
+            }
+        }
+
+        uint64_t extent_start = 0;
+        uint64_t extent_blocks = 0;
+        for (uint64_t block = 0; block <= changed.blocks(); block++) {
+            if (block < changed.blocks() && changed.test(block)) {
+                if (!extent_blocks) {
+                    extent_start = block;
+                }
+                extent_blocks++;
+                continue;
+            }
+            if (extent_blocks) {
+                uint64_t offset = extent_start * BLOCKV_CBT_BLOCK_SIZE;
+                int error = fn(offset, std::min(extent_blocks * BLOCKV_CBT_BLOCK_SIZE, _size - offset));
+                if (error) {
+                    return error;
+                }
+                extent_blocks = 0;
+            }
+        }
+        return 0;
+    }
+};
+
+#define BLOCKV_DEFAULT_READAHEAD_MAX (8 * 1024 * 1024)
+
+// What an export leaves in the page cache after reading.
+enum class cache_policies {
+    AUTO, // drops pages behind long sequential streams, e.g. backups.
+    KEEP, // leaves it to the kernel.
+    DROP, // drops pages of every read, e.g. for an export only used by backups.
+};
+
+static bool parse_cache_policy(const char* arg, cache_policies& policy) {
+    if (!strcmp(arg, "auto")) {
+        policy = cache_policies::AUTO;
+    } else if (!strcmp(arg, "keep")) {
+        policy = cache_policies::KEEP;
+    } else if (!strcmp(arg, "drop")) {
+        policy = cache_policies::DROP;
+    } else {
+        return false;
+    }
+    return true;
+}
+
+struct block_device_options {
+    bool read_only = false;
+    std::chrono::microseconds coalesce_delay{BLOCKV_DEFAULT_COALESCE_DELAY_US};
+    std::chrono::microseconds group_commit_window{BLOCKV_DEFAULT_GROUP_COMMIT_WINDOW_US};
+    // When set, writes are appended to this journal instead of the image.
+    const char* journal_path = nullptr;
+    uint64_t journal_fold_threshold = BLOCKV_DEFAULT_JOURNAL_FOLD_THRESHOLD;
+    // When set, the device file is a copy-on-write delta on top of this image.
+    const char* overlay_base = nullptr;
+    // When set, the device file caches the device exported by this upstream server.
+    std::string proxy;
+    // Bandwidth at which the cache is hydrated in the background, 0 to only fetch blocks on reads.
+    uint64_t proxy_hydrate_bandwidth = 0;
+    // The device is migrated from the proxy upstream, which stops taking writes.
+    bool migrate = false;
+    uint64_t migrate_bandwidth = BLOCKV_DEFAULT_MIGRATE_BANDWIDTH;
+    // When set, writes are replicated to the same device exported by this server.
+    std::string replicate_to;
+    size_t replication_buffer = BLOCKV_DEFAULT_REPLICATION_BUFFER;
+    std::chrono::milliseconds replication_max_lag{BLOCKV_DEFAULT_REPLICATION_MAX_LAG_MS};
+    // Writes are acknowledged once the secondary has them durably.
+    bool replication_sync = false;
+    // Blocks changed since checkpoints are tracked, for incremental backups.
+    bool changed_block_tracking = false;
+    // Bandwidth of snapshots that have to be copied, in bytes per second.
+    uint64_t snapshot_copy_bandwidth = BLOCKV_DEFAULT_SNAPSHOT_COPY_BANDWIDTH;
+    // Chunk size used when several device files are striped.
+    uint64_t stripe_size = BLOCKV_DEFAULT_STRIPE_SIZE;
+    // Several device files are mirrored instead of striped.
+    bool mirror = false;
+    // Mirror members that must be fully resynced, e.g. because they were replaced.
+    std::vector<unsigned> mirror_members_to_resync;
+    // When set, the device is stored as chunks in this deduplicating store.
+    std::string dedup_store;
+    uint64_t dedup_chunk_size = BLOCKV_DEFAULT_DEDUP_CHUNK_SIZE;
+    // The device is stored as compressed chunks, with a cache of decompressed ones.
+    bool compress = false;
+    uint64_t compress_chunk_size = BLOCKV_DEFAULT_COMPRESSED_CHUNK_SIZE;
+    uint64_t compress_cache_size = BLOCKV_DEFAULT_COMPRESSED_CACHE_SIZE;
+    // When set, hot extents of the device file are migrated to this faster one.
+    const char* tier_fast = nullptr;
+    uint64_t tier_extent_size = BLOCKV_DEFAULT_TIER_EXTENT_SIZE;
+    std::chrono::seconds tier_migration_interval{BLOCKV_DEFAULT_TIER_MIGRATION_INTERVAL_S};
+    // Max readahead of a sequential stream of reads, 0 to disable readahead.
+    uint64_t readahead_max = BLOCKV_DEFAULT_READAHEAD_MAX;
+    cache_policies cache_policy = cache_policies::AUTO;
+};
+
+struct block_device {
+private:
+    std::unique_ptr<storage_backend> _backend;
+    std::string _path;
+    uint64_t _block_device_size;
+    bool _read_only;
+    uint64_t _snapshot_copy_bandwidth;
+    std::shared_timed_mutex _mutex;
+    std::unique_ptr<write_combiner> _combiner;
+    std::unique_ptr<group_commit> _group_commit;
+    std::atomic<uint64_t> _zero_writes{0};
+    std::atomic<uint64_t> _zero_bytes{0};
+    std::atomic<uint64_t> _nowait_reads{0};
+    std::atomic<uint64_t> _nowait_hits{0};
+    uint64_t _readahead_max;
+    std::atomic<uint64_t> _readaheads{0};
+    std::atomic<uint64_t> _readahead_bytes{0};
+    cache_policies _cache_policy;
+    std::atomic<uint64_t> _dropped_bytes{0};
+    std::unique_ptr<zero_map> _zero_map;
+    std::atomic<uint64_t> _zero_map_reads{0};
+    // Held shared by writes, so that none is in progress once the device
+    // is migrated to another server.
+    std::shared_timed_mutex _migrate_mutex;
+    std::atomic<bool> _migrated{false};
+    std::unique_ptr<replicator> _replicator;
+    std::unique_ptr<changed_block_tracker> _tracker;
+
+    // Answers reads of ranges that are known to be zero without any I/O.
+    bool read_zero_map(char* buf, uint32_t size, uint64_t offset) {
+        if (!_zero_map || !_zero_map->is_zero(offset, size)) {
+            return false;
+        }
+        memset(buf, 0, size);
+        _zero_map_reads++;
+        return true;
+    }
+
+    void forget_zeroes(uint64_t offset, uint32_t size) {
+        if (_zero_map) {
+            _zero_map->written(offset, size);
+        }
+    }
+
+    // Hands a write to the replicator, or zeroes if buf is null, and tracks
+    // its blocks as changed. A write that failed is handled too, as it may
+    // have changed part of the range.
+    void written(const char* buf, uint32_t size, uint64_t offset) {
+        if (_replicator) {
+            _replicator->write(buf, size, offset);
+        }
+        if (_tracker) {
+            _tracker->changed(offset, size);
+        }
+    }
+
+    uint32_t get_actual_size(uint32_t size, uint64_t offset) const {
+        uint32_t actual_size = 0;
+        if (offset < _block_device_size) {
+            // Do nothing if offset + size causes integer overflow.
+            if (offset + size < offset) {
+                return 0;
+            }
+            if (offset + size > _block_device_size) {
+                size = _block_device_size - offset;
+            }
+            actual_size = size;
+        }
+        return actual_size;
+    }
+public:
+    block_device() = delete;
+    block_device(std::unique_ptr<storage_backend> backend, const char* path, uint64_t size, const block_device_options& options)
+        : _backend(std::move(backend))
+        , _path(path)
+        , _block_device_size(size)
+        , _read_only(options.read_only)
+        , _snapshot_copy_bandwidth(options.snapshot_copy_bandwidth)
+        , _readahead_max(options.readahead_max)
+        , _cache_policy(options.cache_policy) {
+        std::string marker_path = _path + ".migrated";
+        if (access(marker_path.c_str(), F_OK) == 0) {
+            printf("Device %s was migrated to another server, writes are refused (remove %s to take them again)\n",
+                _path.c_str(), marker_path.c_str());
+            _migrated = true;
+        }
+        if (!_read_only) {
+            _group_commit.reset(new group_commit(*_backend, [this] { return drain_pending_writes(); }, options.group_commit_window));
+        }
+        if (_backend->seek(0, SEEK_DATA) != -1 || errno == ENXIO) {
+            _zero_map.reset(new zero_map(*_backend, _block_device_size));
+        }
+        if (!_read_only && !options.replicate_to.empty()) {
+            std::string log_path = _path + ".replog";
+            _replicator.reset(new replicator(options.replicate_to, log_path.c_str(), _block_device_size,
+                [this] (char* buf, uint32_t size, uint64_t offset) { return read(buf, size, offset); },
+                options.replication_buffer, options.replication_max_lag, options.replication_sync));
+        }
+        if (options.changed_block_tracking) {
+            std::string index_path = _path + ".cbt";
+            _tracker.reset(new changed_block_tracker(index_path.c_str(), _block_device_size));
+        }
+    }
+    ~block_device() {
+        // Resyncing the secondary reads the device.
+        _replicator.reset();
+        _zero_map.reset();
+        _group_commit.reset();
+        _combiner.reset();
+        printf("Zero map: %lu reads served without I/O\n", uint64_t(_zero_map_reads));
+        printf("Zero writes: %lu (%lu bytes kept unallocated)\n", uint64_t(_zero_writes), uint64_t(_zero_bytes));
+        printf("Inline reads: %lu of %lu (%.1f%%) served without waiting for the disk\n", uint64_t(_nowait_hits),
+            uint64_t(_nowait_reads), (_nowait_reads) ? 100.0 * _nowait_hits / _nowait_reads : 0.0);
+        printf("Readahead: %lu requests, %lu bytes\n", uint64_t(_readaheads), uint64_t(_readahead_bytes));
+        printf("Page cache: %lu bytes dropped after being read\n", uint64_t(_dropped_bytes));
+        printf("Closing disk image...\n");
+        _backend.reset();
+    }
+
+    // Writes will be merged by a write combiner that holds them for at most
+    // max_delay before they reach the disk.
+    void enable_write_combining(std::chrono::microseconds max_delay, size_t max_pending_bytes) {
+        _combiner.reset(new write_combiner(*_backend, _mutex, max_delay, max_pending_bytes));
+    }
+
+    // Makes sure that every acknowledged write reached the disk. Returns 0
+    // on success, or an errno value if one of them was lost.
+    int drain_pending_writes() {
+        if (_combiner) {
+            return _combiner->drain();
+        }
+        return 0;
+    }
+
+    // Makes every acknowledged write durable. Concurrent callers share a
+    // single sync. Returns 0 on success, or an errno value.
+    int flush() {
+        if (!_group_commit) {
+            return 0;
+        }
+        return _group_commit->commit();
+    }
+
+    // Creates a point-in-time copy of the device named <device file>.snapshot-<name>.
+    // Client I/O is only held back while acknowledged writes are flushed.
+    // Returns 0 on success, or an errno value.
+    int snapshot(const std::string& name) {
+        if (name.empty() || name == "." || name == ".." || name.find('/') != std::string::npos) {
+            return EINVAL;
+        }
+        std::string path = _path + ".snapshot-" + name;
+
+        int error = drain_pending_writes();
+        if (error) {
+            printf("Failed to create snapshot %s: %s\n", path.c_str(), strerror(error));
+            return error;
+        }
+        std::lock_guard<std::shared_timed_mutex> lock(_mutex);
+        if (_backend->sync() == -1 || _backend->snapshot(path.c_str(), _block_device_size, _snapshot_copy_bandwidth) == -1) {
+            printf("Failed to create snapshot %s: %s\n", path.c_str(), strerror(errno));
+            return errno;
+        }
+        return 0;
+    }
+
+    // Stops taking writes for good, because another server is migrating the
+    // device, and makes every acknowledged write durable, so that the other
+    // server copies it. <device file>.migrated is left behind, so that writes
+    // are still refused after a restart. Returns 0 on success, or an errno value.
+    int migrate() {
+        {
+            std::lock_guard<std::shared_timed_mutex> lock(_migrate_mutex);
+            _migrated = true;
+        }
+        drain_pending_writes();
+        int error = flush();
+        if (error) {
+            return error;
+        }
+        std::string marker_path = _path + ".migrated";
+        int fd = open(marker_path.c_str(), O_WRONLY | O_CREAT, 0644);
+        if (fd == -1 || fsync(fd) == -1) {
+            error = errno;
+            printf("Unable to create %s: %s\n", marker_path.c_str(), strerror(error));
+            if (fd != -1) {
+                close(fd);
+            }
+            return error;
+        }
+        close(fd);
+        // The marker is a new entry of its directory, which must be synced too.
+        size_t slash = _path.rfind('/');
+        std::string dir = (slash == std::string::npos) ? "." : _path.substr(0, slash + 1);
+        fd = open(dir.c_str(), O_RDONLY | O_DIRECTORY);
+        if (fd == -1 || fsync(fd) == -1) {
+            error = errno;
+            printf("Unable to sync directory %s: %s\n", dir.c_str(), strerror(error));
+        }
+        if (fd != -1) {
+            close(fd);
+        }
+        return error;
+    }
+
+    // Starts a checkpoint, returned in id, since which changed extents can
+    // be listed. Returns 0 on success, or an errno value.
+    int checkpoint(uint64_t& id) {
+        if (!_tracker) {
+            return EOPNOTSUPP;
+        }
+        return _tracker->checkpoint(id);
+    }
+
+    // Calls fn with every extent changed since checkpoint id. Returns 0 on
+    // success, or an errno value.
+    int changed_extents(uint64_t id, const std::function<int(uint64_t, uint64_t)>& fn) {
+        if (!_tracker) {
+            return EOPNOTSUPP;
+        }
+        return _tracker->changed_extents(id, fn);
+    }
+
+    bool read_only() const {
+        return _read_only || _migrated;
+    }
+
+    uint64_t size() const {
+        return _block_device_size;
+    }
+
+    uint64_t readahead_max() const {
+        return _readahead_max;
+    }
+
+    cache_policies cache_policy() const {
+        return _cache_policy;
+    }
+
+    // Prefetches [offset, offset + size), which a stream of reads is about to reach.
+    void readahead(uint64_t offset, uint64_t size) {
+        if (!size || offset >= _block_device_size) {
+            return;
+        }
+        size = std::min(size, _block_device_size - offset);
+        _readaheads++;
+        _readahead_bytes += size;
+        _backend->readahead(offset, size);
+    }
+
+    // Drops [offset, offset + size), which was read, from the page cache.
+    void drop_cache(uint64_t offset, uint64_t size) {
+        if (!size) {
+            return;
+        }
+        _dropped_bytes += size;
+        _backend->drop_cache(offset, size);
+    }
+
+    int read(char* buf, uint32_t size, uint64_t offset) {
+        int ret = 0;
+
+        size = get_actual_size(size, offset);
+        if (read_zero_map(buf, size, offset)) {
+            return size;
+        }
+        if (_combiner) {
+            _combiner->drain_range(offset, size);
+        }
+        _mutex.lock_shared();
+        ret = _backend->read(buf, size, offset);
+        _mutex.unlock_shared();
+        if (ret == -1) {
+            perror("read");
+            ret = 0;
+        }
+        if (_cache_policy == cache_policies::DROP) {
+            drop_cache(offset, ret);
+        }
+        return ret;
+    }
+
+    // Same as read(), but returns -1 instead of waiting, whether for the disk,
+    // for pending writes to the range to be drained, or for a writer.
+    int read_nowait(char* buf, uint32_t size, uint64_t offset) {
+        size = get_actual_size(size, offset);
+        _nowait_reads++;
+        if (read_zero_map(buf, size, offset)) {
+            _nowait_hits++;
+            return size;
+        }
+        if (_combiner && _combiner->may_have_pending(offset, size)) {
+            return -1;
+        }
+        if (!_mutex.try_lock_shared()) {
+            return -1;
+        }
+        ssize_t ret = _backend->read_nowait(buf, size, offset);
+        _mutex.unlock_shared();
+        if (ret == -1) {
+            if (errno != EAGAIN) {
+                perror("read");
+            }
+            return -1;
+        }
+        _nowait_hits++;
+        if (_cache_policy == cache_policies::DROP) {
+            drop_cache(offset, ret);
+        }
+        return ret;
+    }
+
+    // Returns the number of bytes written, or -1 with errno set; EROFS if
+    // the device was migrated.
+    int write(const char* buf, uint32_t size, uint64_t offset) {
+        int ret = 0;
+
+        std::shared_lock<std::shared_timed_mutex> migrate_lock(_migrate_mutex);
+        if (_migrated) {
+            errno = EROFS;
+            return -1;
+        }
+        size = get_actual_size(size, offset);
+        if (_combiner) {
+            if (size) {
+                _combiner->add(buf, size, offset);
+                forget_zeroes(offset, size);
+                written(buf, size, offset);
+            }
+            return size;
+        }
+        _mutex.lock();
+        ret = _backend->write(buf, size, offset);
+        _mutex.unlock();
+        // Even a failed write may have changed part of the range.
+        forget_zeroes(offset, size);
+        written(buf, size, offset);
+        if (ret == -1) {
+            int error = errno;
+            perror("write");
+            errno = error;
+        }
+        return ret;
+    }
+
+    // Same as write() of a buffer full of zeroes, but lets the backend keep
+    // the range unallocated.
+    int write_zeroes(uint32_t size, uint64_t offset) {
+        std::shared_lock<std::shared_timed_mutex> migrate_lock(_migrate_mutex);
+        if (_migrated) {
+            errno = EROFS;
+            return -1;
+        }
+        size = get_actual_size(size, offset);
+        // Buffered writes to the range must not land after the zeroes.
+        if (_combiner) {
+            _combiner->drain_range(offset, size);
+        }
+        std::unique_lock<std::shared_timed_mutex> lock(_mutex);
+        if (_backend->write_zeroes(offset, size) == -1) {
+            int error = errno;
+            perror("write_zeroes");
+            forget_zeroes(offset, size);
+            lock.unlock();
+            written(nullptr, size, offset);
+            errno = error;
+            return -1;
+        }
+        // Writes buffered since the range was drained would land after the zeroes.
+        if (_zero_map && !(_combiner && _combiner->may_have_pending(offset, size))) {
+            _zero_map->zeroed(offset, size);
+        }
+        _zero_writes++;
+        _zero_bytes += size;
+        lock.unlock();
+        written(nullptr, size, offset);
+        return size;
+    }
+};
+
+#define BLOCKV_READAHEAD_STREAMS 8
+#define BLOCKV_READAHEAD_MIN (256 * 1024)
+// Sequential reads in a row after which a stream is read ahead.
+#define BLOCKV_READAHEAD_TRIGGER 3
+// Pipelined clients have several reads in flight, which may arrive out of
+// order by up to this many requests and still count as sequential.
+#define BLOCKV_READAHEAD_REORDER 4
+// The readahead window covers what the stream reads in this much time.
+#define BLOCKV_READAHEAD_TIME_MS 200
+// Streams that read this much are taken for one-pass scans, e.g. backups,
+// whose pages are dropped from the page cache behind them.
+#define BLOCKV_DROP_BEHIND_MIN (64 * 1024 * 1024)
+#define BLOCKV_DROP_BEHIND_BATCH (1024 * 1024)
+
+// What to do about a stream after one of its reads.
+struct stream_hints {
+    uint64_t readahead_offset = 0;
+    uint64_t readahead_size = 0; // 0 if there's nothing to prefetch.
+    uint64_t drop_offset = 0;
+    uint64_t drop_size = 0; // 0 if there's nothing to drop from the page cache.
+};
+
+// Detects sequential streams among the reads of a connection, e.g. a guest
+// file system scanning a file in 128 KiB requests, which would otherwise pay
+// the latency of the backend for every request in turn. Once a stream is
+// detected, it's prefetched a window ahead, which follows its rate: it
+// grows as the stream speeds up and shrinks as it slows down, so that slow
+// streams don't fill the page cache with data read long before it's needed.
+// Streams that stop are forgotten as new ones take their slot.
+//
+// With drop-behind, long streams also have the pages they already read
+// dropped, so that a backup doesn't evict the working set of everything
+// else on the host.
+struct stream_detector {
+private:
+    using clock = std::chrono::steady_clock;
+
+    struct stream {
+        uint64_t start = 0;
+        uint64_t next = 0; // where the next read of the stream is expected.
+        unsigned reads = 0;
+        uint64_t prefetched = 0; // end of the readahead issued so far.
+        uint64_t dropped = 0; // end of the range dropped behind the stream.
+        double rate = 0; // moving average, in bytes per second.
+        clock::time_point last_read;
+    };
+
+    std::array<stream, BLOCKV_READAHEAD_STREAMS> _streams;
+    uint64_t _max_window;
+    bool _drop_behind;
+
+    static uint64_t distance(uint64_t a, uint64_t b) {
+        return (a > b) ? a - b : b - a;
+    }
+
+    void drop_behind(stream& s, uint32_t size, stream_hints& hints) {
+        // Reads that may still be in flight keep their pages.
+        uint64_t lag = uint64_t(BLOCKV_READAHEAD_REORDER) * size;
+        if (!_drop_behind || s.next - s.start < BLOCKV_DROP_BEHIND_MIN || s.next < lag) {
+            return;
+        }
+        uint64_t end = s.next - lag;
+        if (end >= s.dropped + BLOCKV_DROP_BEHIND_BATCH) {
+            hints.drop_offset = s.dropped;
+            hints.drop_size = end - s.dropped;
+            s.dropped = end;
+        }
+    }
+public:
+    stream_detector(uint64_t max_window, bool drop_behind)
+        : _max_window(max_window)
+        , _drop_behind(drop_behind) {}
+
+    // Records a read, and returns what to prefetch and drop if it's part of
+    // a sequential stream.
+    stream_hints add_read(uint64_t offset, uint32_t size) {
+        stream_hints hints;
+        if (!_max_window && !_drop_behind) {
+            return hints;
+        }
+        auto now = clock::now();
+        stream* s = nullptr;
+        for (auto& candidate : _streams) {
+            if (candidate.reads && distance(offset, candidate.next) <= uint64_t(BLOCKV_READAHEAD_REORDER) * size) {
+                s = &candidate;
+                break;
+            }
+        }
+        if (!s) {
+            s = &*std::min_element(_streams.begin(), _streams.end(), [] (const stream& a, const stream& b) {
+                return a.last_read < b.last_read;
+            });
+            *s = stream();
+            s->start = s->dropped = offset;
+            s->next = offset + size;
+            s->reads = 1;
+            s->last_read = now;
+            return hints;
+        }
+
+        double seconds = std::chrono::duration<double>(now - s->last_read).count();
+        double rate = (seconds > 0) ? size / seconds : s->rate;
+        s->rate = (s->reads == 1) ? rate : 0.75 * s->rate + 0.25 * rate;
+        s->reads++;
+        s->next = std::max(s->next, offset + size);
+        s->last_read = now;
+        if (s->reads < BLOCKV_READAHEAD_TRIGGER) {
+            return hints;
+        }
+        drop_behind(*s, size, hints);
+
+        uint64_t window = std::min(std::max(uint64_t(s->rate * BLOCKV_READAHEAD_TIME_MS / 1000), uint64_t(BLOCKV_READAHEAD_MIN)), _max_window);
+        // Readahead is issued in batches, once less than half the window is left.
+        if (!_max_window || s->prefetched > s->next + window / 2) {
+            return hints;
+        }
+        hints.readahead_offset = std::max(s->prefetched, s->next);
+        hints.readahead_size = s->next + window - hints.readahead_offset;
+        s->prefetched = s->next + window;
+        return hints;
+    }
+};
+
+// Opens a disk image or block device and determines its size. Exits on failure.
+static int open_device(const char *path, int flags, uint64_t& size) {
+    struct stat sb;
+    if (stat(path, &sb) == -1) {
+        printf("Unable to get status of the file %s: %s\n", path, strerror(errno));
+        exit(1);
+    }
+
+    int fd = open(path, flags | O_LARGEFILE);
+    if (fd == -1) {
+        perror("open");
+        exit(1);
+    }
+
+    switch (sb.st_mode & S_IFMT) {
+    case S_IFREG:
+        size = sb.st_size;
+        break;
+    case S_IFBLK: {
+        int ret = ::ioctl(fd, BLKGETSIZE64, &size);
+        assert(ret == 0);
+        if ((flags & O_ACCMODE) != O_RDONLY) {
+            printf("WARNING: It's not safe to export a block device in read-write mode because a file system stored" \
+                " in it could be easily corrupted after client requests. Proceed at your own risk. It's recommended" \
+                " to use the --read-only program option when exporting a block device.\n");
+        }
+        break;
+    } default:
+        printf("Only regular file is allowed at the moment!\n");
+        exit(1);
+    }
+    return fd;
+}
+
+// Several device files are striped, or mirrored, into a single exported device.
+// Chunk stores opened by the server, by path.
+using chunk_stores = std::map<std::string, std::shared_ptr<chunk_store>>;
+
+// Chunk stores are opened once, and added to stores.
+static std::unique_ptr<block_device> setup_block_device(const std::vector<const char*>& block_device_paths, const block_device_options& options,
+        chunk_stores& stores) {
+    const char *block_device_path = block_device_paths[0];
+    bool read_only = options.read_only;
+    int device_fd = -1;
+    uint64_t device_size = 0;
+    int base_fd = -1;
+    int fast_fd = -1;
+    uint64_t fast_size = 0;
+    std::vector<int> member_fds;
+
+    int layouts = !!options.overlay_base + !!options.journal_path + !options.dedup_store.empty() + options.compress + !!options.tier_fast +
+        !options.proxy.empty();
+    if (block_device_paths.size() > 1 && layouts) {
+        printf("Striping and mirroring can't be combined with an overlay, a journal, deduplication, compression, tiering or a proxy!\n");
+        exit(1);
+    }
+    if (layouts > 1) {
+        printf("Only one of --overlay-base, --journal, --dedup-store, --compress, --tier-fast and --proxy can be used!\n");
+        exit(1);
+    }
+
+    // TODO: we should probably use flock on the file representing disk image.
+    // Durability is provided by group commit when clients ask for it, so the
+    // image isn't opened with O_SYNC.
+    if (options.overlay_base) {
+        // The delta is created on first use, with the size of the base image.
+        base_fd = open_device(options.overlay_base, O_RDONLY, device_size);
+        int fd = open(block_device_path, O_RDWR | O_CREAT | O_LARGEFILE, 0644);
+        if (fd == -1 || ftruncate(fd, device_size) == -1) {
+            printf("Unable to create overlay delta %s: %s\n", block_device_path, strerror(errno));
+            exit(1);
+        }
+        close(fd);
+        uint64_t delta_size;
+        device_fd = open_device(block_device_path, (read_only) ? O_RDONLY : O_RDWR, delta_size);
+    } else if (!options.proxy.empty()) {
+        // The cache is created on first use, with the size of the upstream
+        // device. It's written by reads too, even if the export is read-only.
+        // Once created, it's served without the upstream if that's gone,
+        // e.g. because the migration from it completed.
+        blockv_client upstream(options.proxy);
+        bool connected = upstream.connect() != -1;
+        int connect_errno = errno;
+        int fd = open(block_device_path, O_RDWR | O_CREAT | O_LARGEFILE, 0644);
+        struct stat st;
+        if (fd == -1 || fstat(fd, &st) == -1) {
+            printf("Unable to create proxy cache %s: %s\n", block_device_path, strerror(errno));
+            exit(1);
+        }
+        if (!connected && st.st_size == 0) {
+            printf("Unable to connect to upstream %s: %s\n", options.proxy.c_str(), strerror(connect_errno));
+            exit(1);
+        }
+        if (!connected) {
+            printf("Unable to connect to upstream %s (%s), serving the blocks present in the cache\n", options.proxy.c_str(),
+                strerror(connect_errno));
+        }
+        device_size = (connected) ? upstream.size() : st.st_size;
+        if (st.st_size == 0 && ftruncate(fd, device_size) == -1) {
+            printf("Unable to create proxy cache %s: %s\n", block_device_path, strerror(errno));
+            exit(1);
+        }
+        close(fd);
+        uint64_t cache_size;
+        device_fd = open_device(block_device_path, O_RDWR, cache_size);
+        if (cache_size != device_size) {
+            printf("Proxy cache %s doesn't match the size of upstream %s!\n", block_device_path, options.proxy.c_str());
+            exit(1);
+        }
+        // Writes that the source took after a block was copied would be lost.
+        if (connected && options.migrate && upstream.migrate() == -1) {
+            printf("Unable to stop writes to migration source %s: %s\n", options.proxy.c_str(), strerror(errno));
+            exit(1);
+        }
+    } else if (block_device_paths.size() > 1) {
+        uint64_t smallest_member_size = std::numeric_limits<uint64_t>::max();
+        for (const char* path : block_device_paths) {
+            uint64_t member_size;
+            member_fds.push_back(open_device(path, (read_only) ? O_RDONLY : O_RDWR, member_size));
+            smallest_member_size = std::min(smallest_member_size, member_size);
+        }
+        device_size = (options.mirror) ? smallest_member_size :
+            striped_backend::striped_size(smallest_member_size, member_fds.size(), options.stripe_size);
+    } else if (!options.dedup_store.empty() || options.compress) {
+        // The image is only read, to be imported on its first export.
+        device_fd = open_device(block_device_path, O_RDONLY, device_size);
+    } else {
+        device_fd = open_device(block_device_path, (read_only) ? O_RDONLY : O_RDWR, device_size);
+        if (options.tier_fast) {
+            // Extents of the fast tier are written back to the slow one when demoted.
+            fast_fd = open_device(options.tier_fast, O_RDWR, fast_size);
+        }
+    }
+
+    printf("Block device name: %s\n", block_device_path);
+    printf("Block device size: %lu bytes (%.2fG)\n", device_size, (double)device_size/(1024*1024*1024));
+    printf("Read only? %s\n", read_only ? "yes" : "no");
+
+    std::unique_ptr<storage_backend> backend;
+    if (!member_fds.empty() && options.mirror) {
+        printf("Mirrored across %lu members\n", member_fds.size());
+        backend.reset(new mirrored_backend(member_fds, device_size, options.mirror_members_to_resync,
+            std::string(block_device_path) + ".stale"));
+    } else if (!member_fds.empty()) {
+        printf("Striped across %lu members in chunks of %lu bytes\n", member_fds.size(), options.stripe_size);
+        backend.reset(new striped_backend(member_fds, options.stripe_size));
+    } else if (options.overlay_base) {
+        std::string bitmap_path = std::string(block_device_path) + ".bitmap";
+        printf("Overlay on top of base image %s (bitmap: %s)\n", options.overlay_base, bitmap_path.c_str());
+        backend.reset(new overlay_backend(base_fd, device_fd, device_size, bitmap_path.c_str(), BLOCKV_DEFAULT_OVERLAY_BLOCK_SIZE));
+    } else if (!options.proxy.empty()) {
+        std::string bitmap_path = std::string(block_device_path) + ".present";
+        uint64_t hydrate_bandwidth = (options.migrate) ? options.migrate_bandwidth : options.proxy_hydrate_bandwidth;
+        printf("%s %s (bitmap: %s, hydration: %lu bytes/s)\n", (options.migrate) ? "Migrated from" : "Proxy of upstream",
+            options.proxy.c_str(), bitmap_path.c_str(), hydrate_bandwidth);
+        backend.reset(new proxy_backend(options.proxy, device_fd, device_size, bitmap_path.c_str(), BLOCKV_DEFAULT_PROXY_BLOCK_SIZE,
+            hydrate_bandwidth, options.migrate));
+    } else if (!options.dedup_store.empty()) {
+        std::string map_path = std::string(block_device_path) + ".chunkmap";
+        printf("Deduplicated into chunk store %s (chunk map: %s)\n", options.dedup_store.c_str(), map_path.c_str());
+        // The store is locked by the server, so exports that name it share it.
+        std::shared_ptr<chunk_store>& store = stores[options.dedup_store];
+        if (!store) {
+            store = std::make_shared<chunk_store>(options.dedup_store.c_str(), options.dedup_chunk_size);
+        }
+        backend.reset(new dedup_backend(store, device_fd, device_size, map_path.c_str()));
+    } else if (options.compress) {
+        std::string data_path = std::string(block_device_path) + ".lz4";
+        printf("Compressed in chunks of %lu bytes into %s (cache: %lu bytes)\n", options.compress_chunk_size, data_path.c_str(), options.compress_cache_size);
+        backend.reset(new compressed_backend(device_fd, device_size, data_path.c_str(), options.compress_chunk_size, options.compress_cache_size));
+    } else if (options.tier_fast) {
+        std::string map_path = std::string(block_device_path) + ".tiermap";
+        printf("Fast tier: %s (%lu bytes, extents of %lu bytes, tier map: %s)\n", options.tier_fast, fast_size, options.tier_extent_size, map_path.c_str());
+        backend.reset(new tiered_backend(device_fd, device_size, fast_fd, fast_size, map_path.c_str(),
+            options.tier_extent_size, options.tier_migration_interval));
+    } else if (options.journal_path && !read_only) {
+        printf("Journal: %s (folded into the image every %lu bytes)\n", options.journal_path, options.journal_fold_threshold);
+        backend.reset(new journal_backend(device_fd, options.journal_path, options.journal_fold_threshold));
+    } else {
+        backend.reset(new file_backend(device_fd));
+    }
+
+    std::unique_ptr<block_device> dev(new block_device(std::move(backend), block_device_path, device_size, options));
+    if (!read_only && options.coalesce_delay.count() > 0) {
+        dev->enable_write_combining(options.coalesce_delay, BLOCKV_DEFAULT_COALESCE_MAX_BYTES);
+        printf("Write coalescing delay: %ld us\n", long(options.coalesce_delay.count()));
+    }
+    return std::move(dev);
+}
+
+// Devices exported by the server, selected by name when clients connect.
+// They share the listener and the schedulers, so that a host with hundreds
+// of volumes doesn't run a server, with its threads, for each of them.
+// Clients that don't select an export are served the default one.
+struct export_table {
+private:
+    std::map<std::string, std::unique_ptr<block_device>> _exports;
+    block_device* _default = nullptr;
+public:
+    // The first export added is the default one. Returns false if the name is taken.
+    bool add(const std::string& name, std::unique_ptr<block_device> dev) {
+        if (_exports.count(name)) {
+            return false;
+        }
+        if (!_default) {
+            _default = dev.get();
+        }
+        _exports.emplace(name, std::move(dev));
+        return true;
+    }
+
+    block_device* find(const std::string& name) const {
+        auto it = _exports.find(name);
+        return (it != _exports.end()) ? it->second.get() : nullptr;
+    }
+
+    block_device& default_export() const {
+        return *_default;
+    }
+
+    void snapshot_all(const std::string& name) {
+        for (auto& e : _exports) {
+            e.second->snapshot(name);
+        }
+    }
+};
+
+// Parses an export given as <name>=<device file>[,<option>...], whose options
+// override the ones of the server for this export. Options that name a file
+// of their own (a journal or a fast tier) can't be shared, so they only apply
+// to the default export. So do --dedup-store, --proxy, --migrate-from and
+// --replicate-to, as each export names its chunk store, its upstream or its
+// secondary with dedup-store=<file>, proxy=<target>, migrate-from=<target> or
+// replicate-to=<target>. Exports that name the same chunk store share it.
+static bool parse_export(const char* arg, std::string& name, std::string& path, block_device_options& options) {
+    const char* equal = strchr(arg, '=');
+    if (!equal || equal == arg || equal - arg > std::numeric_limits<uint8_t>::max()) {
+        return false;
+    }
+    name.assign(arg, equal);
+    const char* comma = strchr(equal + 1, ',');
+    path.assign(equal + 1, (comma) ? comma : equal + 1 + strlen(equal + 1));
+    if (path.empty()) {
+        return false;
+    }
+    options.journal_path = nullptr;
+    options.dedup_store.clear();
+    options.tier_fast = nullptr;
+    options.proxy.clear();
+    options.migrate = false;
+    options.replicate_to.clear();
+
+    for (const char* option = comma; option; option = strchr(option + 1, ',')) {
+        std::string o(option + 1, strcspn(option + 1, ","));
+        if (o == "read-only") {
+            options.read_only = true;
+        } else if (!o.compare(0, 13, "cache-policy=")) {
+            if (!parse_cache_policy(o.c_str() + 13, options.cache_policy)) {
+                return false;
+            }
+        } else if (!o.compare(0, 14, "readahead-max=")) {
+            options.readahead_max = strtoull(o.c_str() + 14, nullptr, 10);
+        } else if (!o.compare(0, 12, "dedup-store=")) {
+            options.dedup_store = o.substr(12);
+        } else if (!o.compare(0, 6, "proxy=")) {
+            options.proxy = o.substr(6);
+        } else if (!o.compare(0, 13, "migrate-from=")) {
+            options.proxy = o.substr(13);
+            options.migrate = true;
+        } else if (!o.compare(0, 13, "replicate-to=")) {
+            options.replicate_to = o.substr(13);
+        } else if (!o.compare(0, 20, "replication-max-lag=")) {
+            options.replication_max_lag = std::chrono::milliseconds(strtoul(o.c_str() + 20, nullptr, 10));
+        } else if (o == "replication-sync") {
+            options.replication_sync = true;
+        } else if (o == "changed-block-tracking") {
+            options.changed_block_tracking = true;
+        } else {
+            return false;
+        }
+    }
+    return true;
+}
+
+#define BLOCKV_DEFAULT_QOS_CONCURRENCY 4
+// Cost of a request in fair queueing, on top of its size, so that small
+// requests aren't almost free.
+#define BLOCKV_QOS_REQUEST_COST 4096
+
+// Rate limiter that lets up to a second worth of tokens accumulate as burst.
+struct token_bucket {
+private:
+    using clock = std::chrono::steady_clock;
+
+    double _rate;
+    double _tokens;
+    clock::time_point _last_refill;
+public:
+    // A rate of 0 means no limit.
+    explicit token_bucket(double rate)
+        : _rate(rate)
+        , _tokens(rate)
+        , _last_refill(clock::now()) {}
+
+    // Takes tokens, going into debt if there aren't enough, and returns how
+    // long the caller must wait for the debt to be paid off.
+    std::chrono::nanoseconds take(double tokens) {
+        if (!_rate) {
+            return std::chrono::nanoseconds(0);
+        }
+        auto now = clock::now();
+        _tokens = std::min(_rate, _tokens + _rate * std::chrono::duration<double>(now - _last_refill).count());
+        _last_refill = now;
+        _tokens -= tokens;
+        if (_tokens >= 0) {
+            return std::chrono::nanoseconds(0);
+        }
+        return std::chrono::nanoseconds(int64_t(-_tokens / _rate * 1e9));
+    }
+};
+
+struct qos_limits {
+    double weight = 1;
+    uint64_t iops = 0; // 0 means unlimited.
+    uint64_t bandwidth = 0; // in bytes per second, 0 means unlimited.
+};
+
+// Quality of service for clients sharing the device. Each connection is
+// rate limited by token buckets for IOPS and bandwidth, then admitted by
+// start-time fair queueing (a variant of weighted fair queueing): at most
+// a fixed number of requests are in the device at a time, and when clients
+// contend, requests go in the order of their start tags, which advance by
+// cost / weight for each request a client issues. A client doing large
+// sequential scans thus gets its share of the device, not all of it.
+struct qos_scheduler {
+private:
+    using clock = std::chrono::steady_clock;
+
+    qos_limits _default_limits;
+    std::map<std::string, qos_limits> _limits_by_address;
+    unsigned _concurrency;
+
+    std::mutex _mutex;
+    std::condition_variable _cv;
+    unsigned _in_flight = 0;
+    double _virtual_time = 0;
+    uint64_t _next_sequence = 0;
+    // Waiting requests by start tag, with a sequence number to break ties.
+    std::map<std::pair<double, uint64_t>, bool*> _waiting;
+
+    uint64_t _requests = 0;
+    uint64_t _throttled_us = 0;
+    uint64_t _queued_us = 0;
+    log2_histogram _queue_wait_us;
+public:
+    struct client {
+        std::string address;
+        qos_limits limits;
+        token_bucket iops;
+        token_bucket bandwidth;
+        double finish_tag = 0;
+        uint64_t requests = 0;
+        uint64_t throttled_us = 0;
+        uint64_t queued_us = 0;
+
+        client(const std::string& address, const qos_limits& limits)
+            : address(address)
+            , limits(limits)
+            , iops(limits.iops)
+            , bandwidth(limits.bandwidth) {}
+    };
+
+    qos_scheduler(const qos_limits& default_limits, const std::map<std::string, qos_limits>& limits_by_address, unsigned concurrency)
+        : _default_limits(default_limits)
+        , _limits_by_address(limits_by_address)
+        , _concurrency(concurrency) {}
+
+    ~qos_scheduler() {
+        printf("QoS: %lu requests, %lu us throttled by rate limits, %lu us queued for fairness\n", _requests, _throttled_us, _queued_us);
+        _queue_wait_us.print("QoS queue wait", "us");
+    }
+
+    std::unique_ptr<client> connect(int fd) {
+        struct sockaddr_in addr;
+        socklen_t addr_len = sizeof(addr);
+        char address[INET_ADDRSTRLEN] = "unknown";
+        if (getpeername(fd, (struct sockaddr*) &addr, &addr_len) == 0) {
+            inet_ntop(AF_INET, &addr.sin_addr, address, sizeof(address));
+        }
+        auto it = _limits_by_address.find(address);
+        return std::unique_ptr<client>(new client(address, (it != _limits_by_address.end()) ? it->second : _default_limits));
+    }
+
+    void disconnect(const client& c) {
+        printf("QoS: client %s: %lu requests, %lu us throttled by rate limits, %lu us queued for fairness\n",
+            c.address.c_str(), c.requests, c.throttled_us, c.queued_us);
+        std::lock_guard<std::mutex> lock(_mutex);
+        _requests += c.requests;
+        _throttled_us += c.throttled_us;
+        _queued_us += c.queued_us;
+    }
+
+    // Blocks until a request of the client, of the given size, may go to
+    // the device. Must be followed by done() once it's completed.
+    void admit(client& c, uint64_t bytes) {
+        c.requests++;
+        auto wait = std::max(c.iops.take(1), c.bandwidth.take(bytes));
+        if (wait.count() > 0) {
+            std::this_thread::sleep_for(wait);
+            c.throttled_us += std::chrono::duration_cast<std::chrono::microseconds>(wait).count();
+        }
+
+        std::unique_lock<std::mutex> lock(_mutex);
+        double start_tag = std::max(_virtual_time, c.finish_tag);
+        c.finish_tag = start_tag + (bytes + BLOCKV_QOS_REQUEST_COST) / c.limits.weight;
+        if (_in_flight < _concurrency && _waiting.empty()) {
+            _in_flight++;
+            _virtual_time = start_tag;
+            return;
+        }
+        auto start = clock::now();
+        bool granted = false;
+        _waiting.emplace(std::make_pair(start_tag, _next_sequence++), &granted);
+        _cv.wait(lock, [&granted] { return granted; });
+        uint64_t queued_us = std::chrono::duration_cast<std::chrono::microseconds>(clock::now() - start).count();
+        c.queued_us += queued_us;
+        _queue_wait_us.add(queued_us);
+    }
+
+    // Hands the completed request's slot to the waiting request with the
+    // smallest start tag.
+    void done() {
+        std::lock_guard<std::mutex> lock(_mutex);
+        if (_waiting.empty()) {
+            _in_flight--;
+            return;
+        }
+        auto next = _waiting.begin();
+        _virtual_time = next->first.first;
+        *next->second = true;
+        _waiting.erase(next);
+        _cv.notify_all();
+    }
+};
+
+// Holds a request's admission by the QoS scheduler, if there's one, for as
+// long as it's in scope.
+struct qos_admission {
+private:
+    qos_scheduler* _qos;
+public:
+    qos_admission(qos_scheduler* qos, qos_scheduler::client* c, uint64_t bytes)
+        : _qos(qos) {
+        if (_qos) {
+            _qos->admit(*c, bytes);
+        }
+    }
+
+    ~qos_admission() {
+        if (_qos) {
+            _qos->done();
+        }
+    }
+};
+
+// Parses limits of a client given as <address>:<weight>[:<iops>[:<bytes/s>]].
+static bool parse_qos_limits(const char* arg, std::string& address, qos_limits& limits) {
+    const char* colon = strchr(arg, ':');
+    if (!colon) {
+        return false;
+    }
+    address.assign(arg, colon);
+    char* end;
+    limits.weight = strtod(colon + 1, &end);
+    if (limits.weight <= 0) {
+        return false;
+    }
+    if (*end == ':') {
+        limits.iops = strtoull(end + 1, &end, 10);
+    }
+    if (*end == ':') {
+        limits.bandwidth = strtoull(end + 1, &end, 10);
+    }
+    return *end == '\0';
+}
+
+#define BLOCKV_DEFAULT_SCHEDULER_READ_DEADLINE_MS 500
+#define BLOCKV_DEFAULT_SCHEDULER_WRITE_DEADLINE_MS 5000
+// Minimum shares of dispatches, in percent, that background and scrub
+// requests get when higher classes keep the device busy.
+#define BLOCKV_DEFAULT_SCHEDULER_BACKGROUND_SHARE 10
+#define BLOCKV_DEFAULT_SCHEDULER_SCRUB_SHARE 5
+
+// Scheduling stage between request decoding and the device, shared by all
+// connections. Queued requests are dispatched by a few worker threads in
+// elevator order: ascending offset from where the last request ended,
+// wrapping around to the lowest offset (C-LOOK), so that requests of many
+// clients reach the disk as a sweep instead of seeking back and forth in
+// arrival order. A request that has waited past its deadline is dispatched
+// first, so that requests far from the sweep aren't starved. Reads get a
+// shorter deadline than writes, as a client is always blocked on them.
+//
+// Requests are queued by priority class, and the highest class with queued
+// requests is served first. A lower class that has requests queued earns
+// its minimum share of every dispatch, and is served once it has earned a
+// whole one, so it makes progress however busy higher classes keep the device.
+//
+// Requests of pipelined connections may also expire, once the client stopped
+// waiting for them, or be cancelled while queued. Either way they're dropped
+// without doing any I/O, so that a backlog nobody waits for doesn't prolong
+// an overload.
+struct io_scheduler {
+public:
+    using clock = std::chrono::steady_clock;
+    // Called with 0 and what fn returned, or with the error that dropped it.
+    using completion = std::function<void(uint32_t error, int result)>;
+private:
+    using handle_key = std::pair<const void*, uint64_t>;
+
+    struct request {
+        uint64_t offset;
+        uint64_t size;
+        clock::time_point queued_at;
+        clock::time_point expires_at = clock::time_point::max();
+        std::function<int()> fn;
+        // Set for requests submitted asynchronously, which are owned by the scheduler.
+        completion complete;
+        int result = 0;
+        bool done = false;
+        unsigned priority;
+        std::multimap<uint64_t, request*>::iterator by_offset;
+        std::multimap<clock::time_point, request*>::iterator by_deadline;
+        std::multimap<handle_key, request*>::iterator by_handle;
+        bool has_handle = false;
+    };
+
+    struct class_queue {
+        std::multimap<uint64_t, request*> by_offset;
+        std::multimap<clock::time_point, request*> by_deadline;
+        double min_share = 0;
+        double credit = 0;
+        uint64_t dispatched = 0;
+        log2_histogram wait_us;
+    };
+
+    std::chrono::milliseconds _read_deadline;
+    std::chrono::milliseconds _write_deadline;
+
+    std::mutex _mutex;
+    std::condition_variable _workers_cv;
+    std::condition_variable _done_cv;
+    std::array<class_queue, blockv_priorities::PRIORITIES> _classes;
+    std::multimap<handle_key, request*> _by_handle;
+    size_t _queued = 0;
+    uint64_t _head = 0; // where the last dispatched request ended.
+    uint64_t _last_arrival_offset = 0;
+    bool _stopping = false;
+    std::vector<std::thread> _workers;
+
+    uint64_t _dispatched = 0;
+    uint64_t _expired = 0;
+    uint64_t _dropped = 0;
+    uint64_t _cancelled = 0;
+    uint64_t _seek_distance = 0;
+    uint64_t _arrival_seek_distance = 0;
+    log2_histogram _queue_depth;
+
+    static uint64_t distance(uint64_t a, uint64_t b) {
+        return (a > b) ? a - b : b - a;
+    }
+
+    // Must be called with _mutex held, and some request queued.
+    class_queue& pick_class() {
+        class_queue* highest = nullptr;
+        for (auto& c : _classes) {
+            if (c.by_offset.empty()) {
+                c.credit = 0;
+                continue;
+            }
+            if (!highest) {
+                highest = &c;
+                continue;
+            }
+            c.credit = std::min(1.0, c.credit + c.min_share);
+        }
+        for (auto& c : _classes) {
+            if (&c != highest && c.credit >= 1) {
+                c.credit -= 1;
+                return c;
+            }
+        }
+        return *highest;
+    }
+
+    // Must be called with _mutex held.
+    void unqueue(request* r) {
+        class_queue& c = _classes[r->priority];
+        c.by_offset.erase(r->by_offset);
+        c.by_deadline.erase(r->by_deadline);
+        if (r->has_handle) {
+            _by_handle.erase(r->by_handle);
+        }
+        _queued--;
+    }
+
+    // Must be called with _mutex held.
+    void enqueue(request* r, bool write, const void* owner, uint64_t handle) {
+        class_queue& c = _classes[r->priority];
+        _arrival_seek_distance += distance(_last_arrival_offset, r->offset);
+        _last_arrival_offset = r->offset + r->size;
+        r->by_offset = c.by_offset.emplace(r->offset, r);
+        r->by_deadline = c.by_deadline.emplace(r->queued_at + ((write) ? _write_deadline : _read_deadline), r);
+        if (owner) {
+            r->by_handle = _by_handle.emplace(handle_key(owner, handle), r);
+            r->has_handle = true;
+        }
+        _queue_depth.add(++_queued);
+        _workers_cv.notify_one();
+    }
+
+    // Must be called with _mutex held, and some request queued.
+    request* next_request() {
+        class_queue& c = pick_class();
+        auto expired = c.by_deadline.begin();
+        request* r;
+        if (expired->first <= clock::now()) {
+            r = expired->second;
+            _expired++;
+        } else {
+            auto it = c.by_offset.lower_bound(_head);
+            r = (it != c.by_offset.end()) ? it->second : c.by_offset.begin()->second;
+        }
+        unqueue(r);
+        c.dispatched++;
+        c.wait_us.add(std::chrono::duration_cast<std::chrono::microseconds>(clock::now() - r->queued_at).count());
+        _seek_distance += distance(_head, r->offset);
+        _head = r->offset + r->size;
+        _dispatched++;
+        return r;
+    }
+
+    void worker_loop() {
+        std::unique_lock<std::mutex> lock(_mutex);
+        for (;;) {
+            _workers_cv.wait(lock, [this] { return _stopping || _queued; });
+            if (!_queued) {
+                return;
+            }
+            request* r = next_request();
+            bool expired = r->expires_at <= clock::now();
+            _dropped += expired;
+            lock.unlock();
+            if (r->complete) {
+                if (expired) {
+                    r->complete(ETIMEDOUT, 0);
+                } else {
+                    r->complete(0, r->fn());
+                }
+                delete r;
+                lock.lock();
+                continue;
             }
-            if (offset + size > _block_device_size) {
-                size = _block_device_size - offset;
+            int result = r->fn();
+            lock.lock();
+            r->result = result;
+            r->done = true;
+            _done_cv.notify_all();
+        }
+    }
+
+    // Drops queued requests of owner, all of them if all is set, or the first
+    // one with the handle otherwise. Returns how many were dropped.
+    size_t cancel(const void* owner, uint64_t handle, bool all) {
+        std::vector<request*> cancelled;
+        {
+            std::lock_guard<std::mutex> lock(_mutex);
+            auto it = (all) ? _by_handle.lower_bound(handle_key(owner, 0)) : _by_handle.find(handle_key(owner, handle));
+            while (it != _by_handle.end() && it->first.first == owner && (all || it->first.second == handle)) {
+                request* r = (it++)->second;
+                unqueue(r);
+                cancelled.push_back(r);
+                if (!all) {
+                    break;
+                }
             }
-            actual_size = size;
+            _cancelled += cancelled.size();
         }
-        return actual_size;
+        for (request* r : cancelled) {
+            r->complete(ECANCELED, 0);
+            delete r;
+        }
+        return cancelled.size();
     }
 public:
-    block_device() = delete;
-    block_device(int fd, uint64_t size, bool read_only)
-        : _fd(fd)
-        , _block_device_size(size)
-        , _read_only(read_only) {}
-    ~block_device() {
-        printf("Closing disk image...\n");
-        close(_fd);
+    io_scheduler(unsigned workers, std::chrono::milliseconds read_deadline, std::chrono::milliseconds write_deadline,
+            unsigned background_share, unsigned scrub_share)
+        : _read_deadline(read_deadline)
+        , _write_deadline(write_deadline) {
+        _classes[blockv_priorities::BACKGROUND].min_share = background_share / 100.0;
+        _classes[blockv_priorities::SCRUB].min_share = scrub_share / 100.0;
+        for (unsigned i = 0; i < workers; i++) {
+            _workers.emplace_back([this] { worker_loop(); });
+        }
     }
 
-    bool read_only() const {
-        return _read_only;
+    ~io_scheduler() {
+        {
+            std::lock_guard<std::mutex> lock(_mutex);
+            _stopping = true;
+        }
+        _workers_cv.notify_all();
+        for (auto& worker : _workers) {
+            worker.join();
+        }
+        static const char* class_names[] = { "foreground", "background", "scrub" };
+        printf("I/O scheduler: %lu requests dispatched, %lu past their deadline\n", _dispatched, _expired);
+        printf("I/O scheduler: %lu requests dropped as their client stopped waiting, %lu cancelled\n", _dropped, _cancelled);
+        printf("I/O scheduler: seek distance %lu bytes, against %lu bytes in arrival order\n", _seek_distance, _arrival_seek_distance);
+        _queue_depth.print("I/O scheduler queue depth", "requests");
+        for (unsigned i = 0; i < _classes.size(); i++) {
+            std::string name = std::string("I/O scheduler ") + class_names[i] + " queue wait";
+            _classes[i].wait_us.print(name.c_str(), "us");
+        }
     }
 
-    uint64_t size() const {
-        return _block_device_size;
+    // Queues fn, which does I/O on [offset, offset + size), and waits for a
+    // worker to run it. Returns what fn returned.
+    int submit(uint64_t offset, uint64_t size, bool write, unsigned priority, std::function<int()> fn) {
+        request r;
+        r.offset = offset;
+        r.size = size;
+        r.queued_at = clock::now();
+        r.fn = std::move(fn);
+        r.priority = priority;
+        std::unique_lock<std::mutex> lock(_mutex);
+        enqueue(&r, write, nullptr, 0);
+        _done_cv.wait(lock, [&r] { return r.done; });
+        return r.result;
     }
 
-    int read(char* buf, uint32_t size, uint64_t offset) {
-        int ret = 0;
+    // Queues fn on behalf of a pipelined connection, and returns without
+    // waiting. complete is called once fn ran, or once the request was
+    // dropped because it expired or was cancelled through its handle.
+    void submit_async(uint64_t offset, uint64_t size, bool write, unsigned priority, clock::time_point expires_at,
+            const void* owner, uint64_t handle, std::function<int()> fn, completion complete) {
+        request* r = new request;
+        r->offset = offset;
+        r->size = size;
+        r->queued_at = clock::now();
+        r->expires_at = expires_at;
+        r->fn = std::move(fn);
+        r->complete = std::move(complete);
+        r->priority = priority;
+        std::lock_guard<std::mutex> lock(_mutex);
+        enqueue(r, write, owner, handle);
+    }
 
-        size = get_actual_size(size, offset);
-        _mutex.lock_shared();
-        ret = pread(_fd, buf, size, offset);
-        _mutex.unlock_shared();
-        if (ret == -1) {
-            perror("pread");
-            ret = 0;
-        }
-        return ret;
+    // Cancels the queued request of owner with the handle. Returns false if
+    // there's none, e.g. because it's already running.
+    bool cancel(const void* owner, uint64_t handle) {
+        return cancel(owner, handle, false) != 0;
     }
 
-    int write(const char* buf, uint32_t size, uint64_t offset) {
-        int ret = 0;
+    // Cancels every queued request of owner, e.g. once its client is gone.
+    void cancel_all(const void* owner) {
+        cancel(owner, 0, true);
+    }
+};
 
-        size = get_actual_size(size, offset);
-        _mutex.lock();
-        ret = pwrite(_fd, buf, size, offset);
-        _mutex.unlock();
-        if (ret == -1) {
-            perror("pwrite");
-            ret = 0;
+// Runs fn through the I/O scheduler, if there's one.
+static int run_scheduled(io_scheduler* scheduler, uint64_t offset, uint64_t size, bool write, unsigned priority, std::function<int()> fn) {
+    if (!scheduler) {
+        return fn();
+    }
+    return scheduler->submit(offset, size, write, priority, std::move(fn));
+}
+
+// Reads exactly size bytes, which may arrive in several segments. Returns
+// false if the client disconnected first.
+static bool read_exact(int fd, void* buf, size_t size) {
+    char* p = (char*) buf;
+    while (size > 0) {
+        ssize_t ret = read(fd, p, size);
+        if (ret <= 0) {
+            return false;
         }
-        return ret;
+        p += ret;
+        size -= ret;
     }
+    return true;
+}
+
+#define BLOCKV_DEFAULT_CLIENT_CREDIT_REQUESTS 64
+#define BLOCKV_DEFAULT_CLIENT_CREDIT_BYTES (16 << 20)
+// Reads and writes of FUSE clients are up to 128 KiB, and a client must be
+// able to send the largest request it has.
+#define BLOCKV_MIN_CLIENT_CREDIT_BYTES (1 << 20)
+
+// What a pipelined client may have in flight at a time, which bounds the
+// memory the server holds for it: buffers of reads and writes that were
+// received but not responded to yet.
+struct client_credits {
+    uint32_t requests = BLOCKV_DEFAULT_CLIENT_CREDIT_REQUESTS;
+    uint32_t bytes = BLOCKV_DEFAULT_CLIENT_CREDIT_BYTES;
 };
 
-static std::unique_ptr<block_device> setup_block_device(const char *block_device_path, bool read_only) {
-    int device_fd = -1;
-    uint64_t device_size = 0;
+// A connection whose requests are pipelined, as they're tagged with a handle.
+// Requests may complete out of order in the I/O scheduler, so responses are
+// sent by whoever completes them, one at a time.
+//
+// Every request takes a credit, and reads and writes also take credits for
+// their size, until they're responded to. A client that exceeds its credits
+// is disconnected, as it could otherwise make the server hold any amount of
+// memory for it.
+struct tagged_connection {
+private:
+    int _fd;
+    client_credits _credits;
+    std::mutex _write_mutex;
+    std::mutex _mutex;
+    std::condition_variable _cv;
+    unsigned _in_flight = 0;
+    uint32_t _requests = 0;
+    uint64_t _bytes = 0;
+public:
+    tagged_connection(int fd, client_credits credits) : _fd(fd), _credits(credits) {}
 
-    struct stat sb;
-    if (stat(block_device_path, &sb) == -1) {
-        printf("Unable to get status of the file %s: %s\n", block_device_path, strerror(errno));
-        exit(1);
+    // Returns false if the client has as many requests in flight as it may.
+    bool take_request() {
+        std::lock_guard<std::mutex> lock(_mutex);
+        if (_requests == _credits.requests) {
+            return false;
+        }
+        _requests++;
+        return true;
     }
 
-    // TODO: we should probably use flock on the file representing disk image.
-    device_fd = open(block_device_path, ((read_only) ? O_RDONLY : O_RDWR) | O_SYNC | O_LARGEFILE);
-    if (device_fd == -1) {
-        perror("open");
-        exit(1);
+    // Returns false if the request, whose credit was taken, would make the
+    // client exceed its credits for bytes.
+    bool take_bytes(uint64_t bytes) {
+        std::lock_guard<std::mutex> lock(_mutex);
+        if (_bytes + bytes > _credits.bytes) {
+            return false;
+        }
+        _bytes += bytes;
+        return true;
     }
 
-    switch (sb.st_mode & S_IFMT) {
-    case S_IFREG:
-        device_size = sb.st_size;
-        break;
-    case S_IFBLK: {
-        int ret = ::ioctl(device_fd, BLKGETSIZE64, &device_size);
-        assert(ret == 0);
-        if (!read_only) {
-            printf("WARNING: It's not safe to export a block device in read-write mode because a file system stored" \
-                " in it could be easily corrupted after client requests. Proceed at your own risk. It's recommended" \
-                " to use the --read-only program option when exporting a block device.\n");
+    // Gives back the credits of a request, taking bytes for its size, and
+    // sends the response tag, followed by the response if error is 0.
+    // Credits are given back first, as the client may use them as soon as
+    // it sees the response.
+    void respond(uint64_t handle, uint32_t error, const void* response, size_t size, uint64_t bytes = 0) {
+        {
+            std::lock_guard<std::mutex> lock(_mutex);
+            _requests--;
+            _bytes -= bytes;
+        }
+        blockv_response_tag tag = blockv_response_tag::to_network(handle, error);
+        struct iovec iov[2] = { { &tag, blockv_response_tag::serialized_size() }, { (void*) response, (error) ? 0 : size } };
+        size_t expected = iov[0].iov_len + iov[1].iov_len;
+        std::lock_guard<std::mutex> lock(_write_mutex);
+        ssize_t ret = writev(_fd, iov, 2);
+        if (ret != ssize_t(expected)) {
+            printf("Failed to write full response to client: expected: %lu, actual %ld\n", expected, ret);
         }
-        break;
-    } default:
-        printf("Only regular file is allowed at the moment!\n");
-        exit(1);
     }
 
-    printf("Block device name: %s\n", block_device_path);
-    printf("Block device size: %lu bytes (%.2fG)\n", device_size, (double)device_size/(1024*1024*1024));
-    printf("Read only? %s\n", read_only ? "yes" : "no");
+    void start() {
+        std::lock_guard<std::mutex> lock(_mutex);
+        _in_flight++;
+    }
 
-    std::unique_ptr<block_device> dev(new block_device(device_fd, device_size, read_only));
-    return std::move(dev);
+    void finish() {
+        std::lock_guard<std::mutex> lock(_mutex);
+        if (--_in_flight == 0) {
+            _cv.notify_all();
+        }
+    }
+
+    void wait_for_requests() {
+        std::unique_lock<std::mutex> lock(_mutex);
+        _cv.wait(lock, [this] { return _in_flight == 0; });
+    }
+};
+
+// Runs fn for a tagged request, through the I/O scheduler if there's one, in
+// which case it returns before fn runs. complete is called once fn ran, or
+// once the request was dropped. If there's a scheduler, inline_fn is tried
+// first, and fn only runs if it returns -1 because it would have to wait.
+static void run_tagged(tagged_connection& conn, io_scheduler* scheduler, qos_scheduler* qos, qos_scheduler::client* qos_client,
+        const blockv_request_tag& tag, io_scheduler::clock::time_point expires_at, uint64_t offset, uint64_t size, bool write,
+        std::function<int()> fn, io_scheduler::completion complete, std::function<int()> inline_fn = nullptr) {
+    conn.start();
+    std::shared_ptr<qos_admission> admission = std::make_shared<qos_admission>(qos, qos_client, size);
+    // The client may have given up on the request while it waited for admission.
+    if (expires_at <= io_scheduler::clock::now()) {
+        admission.reset();
+        complete(ETIMEDOUT, 0);
+        conn.finish();
+        return;
+    }
+    int ret = (scheduler && inline_fn) ? inline_fn() : -1;
+    if (!scheduler || ret != -1) {
+        if (ret == -1) {
+            ret = fn();
+        }
+        admission.reset();
+        complete(0, ret);
+        conn.finish();
+        return;
+    }
+    scheduler->submit_async(offset, size, write, tag.priority, expires_at, &conn, tag.handle, std::move(fn),
+            [&conn, admission, complete] (uint32_t error, int result) mutable {
+        admission.reset();
+        complete(error, result);
+        conn.finish();
+    });
+}
+
+// Extents sent to the client at a time, while the changed ones are listed.
+#define BLOCKV_CHANGED_EXTENTS_BATCH 4096
+
+// Builds the response to a CHANGED_EXTENTS request, and hands it to send
+// in pieces as the changed extents are found. Returns false if send failed.
+static bool send_changed_extents(block_device& dev, uint64_t checkpoint, const std::function<bool(const void*, size_t)>& send) {
+    std::vector<blockv_extent> extents;
+    bool started = false;
+    auto start = [&] (uint32_t error) {
+        started = true;
+        blockv_changed_extents_response changed_extents_response = blockv_changed_extents_response::to_network(error);
+        return send(&changed_extents_response, blockv_changed_extents_response::serialized_size());
+    };
+    auto send_extents = [&] {
+        bool sent = send(extents.data(), extents.size() * blockv_extent::serialized_size());
+        extents.clear();
+        return sent;
+    };
+
+    // Whether the checkpoint is known is only told by the first extent.
+    int error = dev.changed_extents(checkpoint, [&] (uint64_t offset, uint64_t length) {
+        if (!started && !start(0)) {
+            return EPIPE;
+        }
+        extents.push_back(blockv_extent::to_network(offset, length));
+        if (extents.size() == BLOCKV_CHANGED_EXTENTS_BATCH && !send_extents()) {
+            return EPIPE;
+        }
+        return 0;
+    });
+    if (!started) {
+        if (!start(error)) {
+            return false;
+        }
+        if (error) {
+            return true;
+        }
+    } else if (error) {
+        return false;
+    }
+    extents.push_back(blockv_extent::to_network(0, 0));
+    return send_extents();
+}
+
+// Serves a connection once its client said hello. Every request is preceded
+// by a tag, and requests keep being read while earlier ones are queued, so
+// that a client can cancel them, or have them dropped once their deadline
+// passes.
+static void handle_tagged_requests(int comm_fd, block_device& dev, qos_scheduler* qos, qos_scheduler::client* qos_client,
+        io_scheduler* scheduler, client_credits credits) {
+    tagged_connection conn(comm_fd, credits);
+    stream_detector streams(dev.readahead_max(), dev.cache_policy() == cache_policies::AUTO);
+
+    for (;;) {
+        printf("Waiting for request... ");
+        fflush(stdout);
+        blockv_request_tag tag;
+        blockv_request request;
+        if (!read_exact(comm_fd, &tag, blockv_request_tag::serialized_size()) || !read_exact(comm_fd, &request, sizeof(request))) {
+            printf("Client disconnected.\n");
+            break;
+        }
+        blockv_request_tag::to_host(tag);
+        // kill connection with a client that is unable to send proper requests.
+        if (!request.is_valid() || !tag.is_valid()) {
+            printf("Request invalid!\n");
+            break;
+        }
+        if (request.request != blockv_requests::FINISH && !conn.take_request()) {
+            printf("Client exceeded its credits!\n");
+            break;
+        }
+        auto expires_at = (tag.deadline) ? io_scheduler::clock::now() + std::chrono::milliseconds(tag.deadline)
+            : io_scheduler::clock::time_point::max();
+        uint64_t handle = tag.handle;
+
+        if (request.request == blockv_requests::READ) {
+            blockv_read_request read_request;
+            read_request.request = request.request;
+            if (!read_exact(comm_fd, (char*) &read_request + sizeof(request), blockv_read_request::serialized_size() - sizeof(request))) {
+                printf("Client disconnected.\n");
+                break;
+            }
+            blockv_read_request::to_host(read_request);
+            if (!conn.take_bytes(read_request.size)) {
+                printf("Client exceeded its credits!\n");
+                break;
+            }
+            std::shared_ptr<blockv_read_response> read_response(blockv_read_response::to_network(read_request.size),
+                [] (blockv_read_response* response) { delete[] (char*) response; });
+            if (!read_response) {
+                printf("Failed to allocate data to fulfill read request\n");
+                break;
+            }
+
+            uint32_t size = read_request.size;
+            uint64_t offset = read_request.offset;
+            stream_hints hints = streams.add_read(offset, size);
+            dev.readahead(hints.readahead_offset, hints.readahead_size);
+            dev.drop_cache(hints.drop_offset, hints.drop_size);
+            run_tagged(conn, scheduler, qos, qos_client, tag, expires_at, offset, size, false, [&dev, read_response, size, offset] {
+                return dev.read(read_response->buf, size, offset);
+            }, [&conn, read_response, handle, size, offset] (uint32_t error, int ret) {
+                if (!error) {
+                    printf("Read %u bytes at offset %lu\n", size, offset);
+                    read_response->set_size_to_network(ret);
+                }
+                conn.respond(handle, error, read_response.get(), read_response->serialized_size(), size);
+            }, [&dev, read_response, size, offset] {
+                return dev.read_nowait(read_response->buf, size, offset);
+            });
+        } else if (request.request == blockv_requests::WRITE || request.request == blockv_requests::WRITE_FUA) {
+            char header[sizeof(blockv_write_request)];
+            blockv_write_request& write_request = *(blockv_write_request*) header;
+            write_request.request = request.request;
+            if (!read_exact(comm_fd, header + sizeof(request), sizeof(header) - sizeof(request))) {
+                printf("Client disconnected.\n");
+                break;
+            }
+            blockv_write_request::to_host(write_request);
+            if (!conn.take_bytes(write_request.size)) {
+                printf("Client exceeded its credits!\n");
+                break;
+            }
+            std::shared_ptr<char> buf(new (std::nothrow) char[write_request.size], std::default_delete<char[]>());
+            if (!buf) {
+                printf("Failed to allocate %u bytes to write request\n", write_request.size);
+                break;
+            }
+            if (!read_exact(comm_fd, buf.get(), write_request.size)) {
+                printf("Client disconnected.\n");
+                break;
+            }
+            if (dev.read_only()) {
+                conn.respond(handle, EROFS, nullptr, 0, write_request.size);
+                continue;
+            }
+
+            uint32_t size = write_request.size;
+            uint64_t offset = write_request.offset;
+            bool fua = write_request.request == blockv_requests::WRITE_FUA;
+            run_tagged(conn, scheduler, qos, qos_client, tag, expires_at, offset, size, true, [&dev, buf, size, offset, fua] {
+                int ret = (is_zero_buffer(buf.get(), size)) ? dev.write_zeroes(size, offset) : dev.write(buf.get(), size, offset);
+                // The device may have been migrated while the write was queued.
+                if (ret == -1) {
+                    return (errno == EROFS) ? -EROFS : -EIO;
+                }
+                if (ret == 0) {
+                    printf("dev.write() returned 0 for size %u and offset %lu\n", size, offset);
+                }
+                int error = (fua) ? dev.flush() : 0;
+                if (error) {
+                    printf("Failed to make write durable for size %u and offset %lu\n", size, offset);
+                    return -error;
+                }
+                return int(size);
+            }, [&conn, handle, size, offset] (uint32_t error, int written) {
+                // Failed writes return a negative errno value.
+                if (!error && written < 0) {
+                    error = -written;
+                }
+                if (!error) {
+                    printf("Wrote %u bytes at offset %lu\n", size, offset);
+                }
+                blockv_write_response write_response = blockv_write_response::to_network(written);
+                conn.respond(handle, error, &write_response, blockv_write_response::serialized_size(), size);
+            });
+        } else if (request.request == blockv_requests::FLUSH) {
+            // Every acknowledged write has completed, so the flush covers them.
+            int error;
+            {
+                qos_admission admission(qos, qos_client, 0);
+                error = dev.flush();
+            }
+            blockv_flush_response flush_response = blockv_flush_response::to_network(error);
+            conn.respond(handle, 0, &flush_response, blockv_flush_response::serialized_size());
+        } else if (request.request == blockv_requests::SNAPSHOT) {
+            uint8_t name_size;
+            char name[std::numeric_limits<uint8_t>::max()];
+            if (!read_exact(comm_fd, &name_size, sizeof(name_size)) || !read_exact(comm_fd, name, name_size)) {
+                printf("Client disconnected.\n");
+                break;
+            }
+            printf("Asked to create snapshot %.*s\n", int(name_size), name);
+            blockv_snapshot_response snapshot_response = blockv_snapshot_response::to_network(dev.snapshot(std::string(name, name_size)));
+            conn.respond(handle, 0, &snapshot_response, blockv_snapshot_response::serialized_size());
+        } else if (request.request == blockv_requests::MIGRATE) {
+            printf("Asked to hand the device over to a migration, writes are refused from now on\n");
+            blockv_migrate_response migrate_response = blockv_migrate_response::to_network(dev.migrate());
+            conn.respond(handle, 0, &migrate_response, blockv_migrate_response::serialized_size());
+        } else if (request.request == blockv_requests::CHECKPOINT) {
+            uint64_t checkpoint = 0;
+            uint32_t error = dev.checkpoint(checkpoint);
+            printf("Asked for a checkpoint: %lu\n", checkpoint);
+            blockv_checkpoint_response checkpoint_response = blockv_checkpoint_response::to_network(error, checkpoint);
+            conn.respond(handle, 0, &checkpoint_response, blockv_checkpoint_response::serialized_size());
+        } else if (request.request == blockv_requests::CHANGED_EXTENTS) {
+            blockv_changed_extents_request changed_extents_request;
+            if (!read_exact(comm_fd, (char*) &changed_extents_request + sizeof(request), blockv_changed_extents_request::serialized_size() - sizeof(request))) {
+                printf("Client disconnected.\n");
+                break;
+            }
+            blockv_changed_extents_request::to_host(changed_extents_request);
+            // Tagged responses are sent whole, and the list, which has no
+            // bound, would have to be buffered outside of the credits.
+            printf("Refused to list changed extents on a tagged connection\n");
+            conn.respond(handle, EOPNOTSUPP, nullptr, 0);
+        } else if (request.request == blockv_requests::HELLO) {
+            uint8_t version;
+            if (!read_exact(comm_fd, &version, sizeof(version))) {
+                printf("Client disconnected.\n");
+                break;
+            }
+            // The connection is tagged already.
+            blockv_hello_response hello_response = blockv_hello_response::to_network(EPROTONOSUPPORT, 0, 0);
+            conn.respond(handle, 0, &hello_response, blockv_hello_response::serialized_size());
+        } else if (request.request == blockv_requests::CANCEL) {
+            blockv_cancel_request cancel_request;
+            if (!read_exact(comm_fd, (char*) &cancel_request + sizeof(request), blockv_cancel_request::serialized_size() - sizeof(request))) {
+                printf("Client disconnected.\n");
+                break;
+            }
+            blockv_cancel_request::to_host(cancel_request);
+            bool cancelled = scheduler && scheduler->cancel(&conn, cancel_request.handle);
+            conn.respond(handle, (cancelled) ? 0 : ENOENT, nullptr, 0);
+        } else if (request.request == blockv_requests::FINISH) {
+            printf("Asked to finish\n");
+            break;
+        }
+    }
+    // Nobody waits for the requests still queued.
+    if (scheduler) {
+        scheduler->cancel_all(&conn);
+    }
+    conn.wait_for_requests();
+}
+
+// Sends the fixed-size response to an untagged request.
+template <typename Response>
+static void send_response(int comm_fd, const Response& response) {
+    if (!blockv_write_exact(comm_fd, &response, Response::serialized_size())) {
+        printf("Failed to write full response to client: %s\n", strerror(errno));
+    }
 }
 
-static void handle_client_requests(int comm_fd, block_device& dev) {
+static void handle_client_requests(int comm_fd, const export_table& exports, qos_scheduler* qos, io_scheduler* scheduler,
+        client_credits credits) {
     char buffer[4096];
     int ret;
+    block_device* dev = &exports.default_export();
+    bool first_request = true;
+    // Clients of version 1 of the protocol can't ask for durability, and
+    // expect every acknowledged write to be durable, as it was when the image
+    // was opened with O_SYNC. A connection is treated as such until it sends
+    // a request that only later versions know.
+    bool v1_client = true;
 
     // send server info to new client
-    blockv_server_info server_info_to_network = blockv_server_info::to_network(dev.size(), dev.read_only());
+    blockv_server_info server_info_to_network = blockv_server_info::to_network(dev->size(), dev->read_only());
     write(comm_fd, (const void*)&server_info_to_network, server_info_to_network.serialized_size());
+    std::unique_ptr<qos_scheduler::client> qos_client = (qos) ? qos->connect(comm_fd) : nullptr;
+    stream_detector streams(dev->readahead_max(), dev->cache_policy() == cache_policies::AUTO);
 
     for (;;) {
         printf("Waiting for request... ");
         fflush(stdout);
         bzero(buffer, sizeof(buffer));
         ret = read(comm_fd, buffer, sizeof(buffer));
-        if (ret == 0) {
+        if (ret <= 0) {
             printf("Client disconnected.\n");
             break;
         }
@@ -162,6 +6001,11 @@ static void handle_client_requests(int comm_fd, block_device& dev) {
             printf("Request invalid!\n");
             break;
         }
+        bool first = first_request;
+        first_request = false;
+        if (request->request > blockv_requests::FINISH) {
+            v1_client = false;
+        }
 
         if (request->request == blockv_requests::READ) {
             blockv_read_request* read_request = (blockv_read_request*) request;
@@ -172,14 +6016,27 @@ static void handle_client_requests(int comm_fd, block_device& dev) {
                 printf("Failed to allocate data to fulfill read request\n");
                 break;
             }
+            stream_hints hints = streams.add_read(read_request->offset, read_request->size);
+            dev->readahead(hints.readahead_offset, hints.readahead_size);
+            dev->drop_cache(hints.drop_offset, hints.drop_size);
 
-            ret = dev.read(read_response->buf, read_request->size, read_request->offset);
+            {
+                qos_admission admission(qos, qos_client.get(), read_request->size);
+                // Reads from the page cache are served right away instead of
+                // being handed to a worker of the I/O scheduler.
+                ret = (scheduler) ? dev->read_nowait(read_response->buf, read_request->size, read_request->offset) : -1;
+                if (ret == -1) {
+                    ret = run_scheduled(scheduler, read_request->offset, read_request->size, false, blockv_priorities::FOREGROUND, [&] {
+                        return dev->read(read_response->buf, read_request->size, read_request->offset);
+                    });
+                }
+            }
             if (ret == 0) {
-                printf("dev.read() returned 0 for size %u and offset %u\n", read_request->size, read_request->offset);
+                printf("dev->read() returned 0 for size %u and offset %u\n", read_request->size, read_request->offset);
             }
             printf("Read %u bytes at offset %u\n", read_request->size, read_request->offset);
 
-            // adjust size of read response because dev.read() may return
+            // adjust size of read response because dev->read() may return
             // less data than what read request asked for.
             read_response->set_size_to_network(ret);
 
@@ -189,10 +6046,7 @@ static void handle_client_requests(int comm_fd, block_device& dev) {
             }
 
             delete read_response;
-        } else if (request->request == blockv_requests::WRITE) {
-            if (dev.read_only()) {
-                continue;
-            }
+        } else if (request->request == blockv_requests::WRITE || request->request == blockv_requests::WRITE_FUA) {
             blockv_write_request* write_request = (blockv_write_request*) request;
             blockv_write_request::to_host(*write_request);
 
@@ -216,40 +6070,479 @@ static void handle_client_requests(int comm_fd, block_device& dev) {
             }
             assert(remaining_bytes == 0);
 
-            ret = dev.write(buf.get(), write_request->size, write_request->offset);
+            // Clients don't write to read-only devices, unless the device was
+            // migrated since they connected, and they are told nothing was written.
+            if (dev->read_only()) {
+                send_response(comm_fd, blockv_write_response::to_network(0));
+                continue;
+            }
+
+            qos_admission admission(qos, qos_client.get(), write_request->size);
+            // Zero-filled writes (mkfs, shred, preallocation) would otherwise
+            // allocate the whole range in a thin image.
+            ret = run_scheduled(scheduler, write_request->offset, write_request->size, true, blockv_priorities::FOREGROUND, [&] {
+                if (is_zero_buffer(buf.get(), write_request->size)) {
+                    return dev->write_zeroes(write_request->size, write_request->offset);
+                }
+                return dev->write(buf.get(), write_request->size, write_request->offset);
+            });
             if (ret == 0) {
-                printf("dev.write() returned 0 for size %u and offset %u\n", write_request->size, write_request->offset);
+                printf("dev->write() returned 0 for size %u and offset %u\n", write_request->size, write_request->offset);
             }
             printf("Wrote %u bytes at offset %u\n", write_request->size, write_request->offset);
 
-            blockv_write_response write_response = blockv_write_response::to_network(write_request->size);
+            // The write failed, or the device was migrated while it waited.
+            uint32_t written = (ret == -1) ? 0 : write_request->size;
+            bool fua = write_request->request == blockv_requests::WRITE_FUA || v1_client;
+            if (fua && dev->flush() != 0) {
+                printf("Failed to make write durable for size %u and offset %lu\n", write_request->size, write_request->offset);
+                written = 0;
+            }
+
+            blockv_write_response write_response = blockv_write_response::to_network(written);
             ret = write(comm_fd, (const void*)&write_response, blockv_write_response::serialized_size());
             if (ret != blockv_write_response::serialized_size()) {
                 printf("Failed to write full response to client: expected: %u, actual %u\n", blockv_write_response::serialized_size(), ret);
             }
+        } else if (request->request == blockv_requests::FLUSH) {
+            int error;
+            {
+                qos_admission admission(qos, qos_client.get(), 0);
+                error = dev->flush();
+            }
+            send_response(comm_fd, blockv_flush_response::to_network(error));
+        } else if (request->request == blockv_requests::SNAPSHOT) {
+            blockv_snapshot_request* snapshot_request = (blockv_snapshot_request*) request;
+            if (size_t(ret) < blockv_snapshot_request::serialized_size(0) ||
+                    size_t(ret) != blockv_snapshot_request::serialized_size(snapshot_request->name_size)) {
+                printf("Snapshot request is truncated!\n");
+                break;
+            }
+            std::string name(snapshot_request->name, snapshot_request->name_size);
+            printf("Asked to create snapshot %s\n", name.c_str());
+
+            send_response(comm_fd, blockv_snapshot_response::to_network(dev->snapshot(name)));
+        } else if (request->request == blockv_requests::HELLO) {
+            blockv_hello_request* hello_request = (blockv_hello_request*) request;
+            uint32_t error = 0;
+            // Tags and the HELLO response are the same since version 6, and
+            // later versions only add untagged requests.
+            if (size_t(ret) != blockv_hello_request::serialized_size() ||
+                    hello_request->version < 6 || hello_request->version > BLOCKV_PROTOCOL_VERSION) {
+                error = EPROTONOSUPPORT;
+            }
+            send_response(comm_fd, blockv_hello_response::to_network(error, credits.requests, credits.bytes));
+            if (!error) {
+                handle_tagged_requests(comm_fd, *dev, qos, qos_client.get(), scheduler, credits);
+                break;
+            }
+        } else if (request->request == blockv_requests::EXPORT) {
+            blockv_export_request* export_request = (blockv_export_request*) request;
+            if (size_t(ret) < blockv_export_request::serialized_size(0) ||
+                    size_t(ret) != blockv_export_request::serialized_size(export_request->name_size)) {
+                printf("Export request is truncated!\n");
+                break;
+            }
+            std::string name(export_request->name, export_request->name_size);
+            printf("Asked for export %s\n", name.c_str());
+
+            // The device can't change under requests that were already served.
+            uint32_t error = 0;
+            block_device* selected = exports.find(name);
+            if (!first) {
+                error = EINVAL;
+            } else if (!selected) {
+                error = ENOENT;
+            } else {
+                dev = selected;
+                streams = stream_detector(dev->readahead_max(), dev->cache_policy() == cache_policies::AUTO);
+            }
+            send_response(comm_fd, blockv_export_response::to_network(error, dev->size(), dev->read_only()));
+        } else if (request->request == blockv_requests::MIGRATE) {
+            printf("Asked to hand the device over to a migration, writes are refused from now on\n");
+            send_response(comm_fd, blockv_migrate_response::to_network(dev->migrate()));
+        } else if (request->request == blockv_requests::CHECKPOINT) {
+            uint64_t checkpoint = 0;
+            uint32_t error = dev->checkpoint(checkpoint);
+            printf("Asked for a checkpoint: %lu\n", checkpoint);
+            send_response(comm_fd, blockv_checkpoint_response::to_network(error, checkpoint));
+        } else if (request->request == blockv_requests::CHANGED_EXTENTS) {
+            if (size_t(ret) != blockv_changed_extents_request::serialized_size()) {
+                printf("Changed extents request is truncated!\n");
+                break;
+            }
+            blockv_changed_extents_request* changed_extents_request = (blockv_changed_extents_request*) request;
+            blockv_changed_extents_request::to_host(*changed_extents_request);
+            printf("Asked for extents changed since checkpoint %lu\n", changed_extents_request->checkpoint);
+            // Extents are streamed as they're found.
+            if (!send_changed_extents(*dev, changed_extents_request->checkpoint, [comm_fd] (const void* buf, size_t size) {
+                return blockv_write_exact(comm_fd, buf, size);
+            })) {
+                printf("Failed to send changed extents to client\n");
+                break;
+            }
         } else if (request->request == blockv_requests::FINISH) {
             printf("Asked to finish\n");
             break;
         }
     }
+    dev->drain_pending_writes();
+    if (qos_client) {
+        qos->disconnect(*qos_client);
+    }
+}
+
+// Connections being served, so that they can be shut down on SIGTERM.
+struct client_connections {
+private:
+    std::mutex _mutex;
+    std::condition_variable _cv;
+    std::set<int> _fds;
+public:
+    void add(int fd) {
+        std::lock_guard<std::mutex> lock(_mutex);
+        _fds.insert(fd);
+    }
+
+    void remove(int fd) {
+        std::lock_guard<std::mutex> lock(_mutex);
+        _fds.erase(fd);
+        _cv.notify_all();
+    }
+
+    // Disconnects every client and waits for their handlers to finish.
+    void shutdown_all() {
+        std::unique_lock<std::mutex> lock(_mutex);
+        for (int fd : _fds) {
+            ::shutdown(fd, SHUT_RDWR);
+        }
+        _cv.wait(lock, [this] { return _fds.empty(); });
+    }
+};
+
+static volatile sig_atomic_t stop_requested = 0;
+
+static void handle_stop_signal(int) {
+    stop_requested = 1;
+}
+
+static volatile sig_atomic_t snapshot_requested = 0;
+
+static void handle_snapshot_signal(int) {
+    snapshot_requested = 1;
+}
+
+static void usage(const char *program_name) {
+    printf("Usage:\n" \
+           "%s [options] [<device file>...]\n" \
+           "Several device files are exported as a single device striped, or mirrored, across them.\n" \
+           "Options:\n" \
+           "  --export=<name>=<device file>[,read-only][,cache-policy=<policy>][,readahead-max=<bytes>][,proxy=<target>]\n" \
+           "                                [,migrate-from=<target>][,replicate-to=<target>][,replication-max-lag=<ms>]\n" \
+           "                                [,replication-sync][,changed-block-tracking][,dedup-store=<file>]\n" \
+           "                                also export a device selected by name, with options of its own;\n" \
+           "                                the default export is <device file> if given, the first one otherwise\n" \
+           "  --read-only                   disallow write requests\n" \
+           "  --write-coalesce-delay=<us>   max time a write is held for merging (default: %d, 0 disables)\n" \
+           "  --group-commit-window=<us>    max time a flush waits for others to share its sync (default: %d)\n" \
+           "  --journal=<file>              append writes to a journal that is folded into the image later\n" \
+           "  --journal-fold-threshold=<bytes> journal size that triggers folding (default: %d)\n" \
+           "  --overlay-base=<image>        export <device file> as a copy-on-write delta on top of a read-only image\n" \
+           "  --proxy=<host>:<port>[/<export>] export <device file> as a cache of a device exported by another server\n" \
+           "  --proxy-hydrate-bandwidth=<bytes/s> bandwidth of copying the whole device into the cache (default: 0, disabled)\n" \
+           "  --migrate-from=<host>:<port>[/<export>] move a device exported by another server into <device file>,\n" \
+           "                                serving it meanwhile; the other server stops taking writes to it\n" \
+           "  --migrate-bandwidth=<bytes/s> bandwidth of copying the device during a migration (default: %d)\n" \
+           "  --replicate-to=<host>:<port>[/<export>] replicate writes to the same device exported by another server\n" \
+           "  --replication-buffer=<bytes>  memory holding writes not replicated yet, beyond which they're resynced\n" \
+           "                                from the device later (default: %d)\n" \
+           "  --replication-max-lag=<ms>    max time a write is held to be replicated in a batch (default: %d)\n" \
+           "  --replication-sync            acknowledge writes once they're replicated, while the secondary is reachable\n" \
+           "  --changed-block-tracking      track blocks changed since checkpoints, for incremental backups\n" \
+           "  --snapshot-copy-bandwidth=<bytes/s> bandwidth of snapshots that can't use reflink (default: %d)\n" \
+           "  --stripe-size=<bytes>         chunk size of striped devices (default: %d)\n" \
+           "  --mirror                      mirror device files instead of striping them\n" \
+           "  --mirror-resync=<index>       copy a mirror member, counting from 0, from the others in the background\n" \
+           "  --dedup-store=<file>          store the device as deduplicated chunks in a chunk store\n" \
+           "  --dedup-chunk-size=<bytes>    chunk size of a new chunk store (default: %d)\n" \
+           "  --compress                    store the device as LZ4-compressed chunks\n" \
+           "  --compress-chunk-size=<bytes> chunk size of a new compressed device (default: %d)\n" \
+           "  --compress-cache-size=<bytes> memory used to cache decompressed chunks (default: %d)\n" \
+           "  --tier-fast=<file>            migrate hot extents of <device file> to this faster file or device\n" \
+           "  --tier-extent-size=<bytes>    unit of migration between tiers (default: %d)\n" \
+           "  --tier-migration-interval=<s> time between migration rounds (default: %d)\n" \
+           "  --readahead-max=<bytes>       max readahead of sequential streams of reads (default: %d, 0 disables)\n" \
+           "  --cache-policy=<policy>       pages dropped from the page cache after reads: auto (behind long sequential\n" \
+           "                                streams, the default), keep (none) or drop (all)\n" \
+           "  --qos-concurrency=<n>         requests in the device at a time, shared fairly by clients (default: %d)\n" \
+           "  --qos-iops=<n>                max requests per second of each client\n" \
+           "  --qos-bandwidth=<bytes/s>     max bandwidth of each client\n" \
+           "  --qos-client=<address>:<weight>[:<iops>[:<bytes/s>]] fair share weight and limits of a client\n" \
+           "  --scheduler-workers=<n>       dispatch requests of all clients in offset order with n threads (default: 0, disabled)\n" \
+           "  --scheduler-read-deadline=<ms> time after which a read is dispatched out of order (default: %d)\n" \
+           "  --scheduler-write-deadline=<ms> time after which a write is dispatched out of order (default: %d)\n" \
+           "  --scheduler-min-shares=<background %%>:<scrub %%> dispatches guaranteed to lower priority classes (default: %d:%d)\n" \
+           "  --client-credit-requests=<n>  requests a pipelined client may have in flight (default: %d)\n" \
+           "  --client-credit-bytes=<bytes> bytes of reads and writes a pipelined client may have in flight (default: %d, min: %d)\n",
+           program_name, BLOCKV_DEFAULT_COALESCE_DELAY_US, BLOCKV_DEFAULT_GROUP_COMMIT_WINDOW_US,
+           BLOCKV_DEFAULT_JOURNAL_FOLD_THRESHOLD, BLOCKV_DEFAULT_MIGRATE_BANDWIDTH,
+           BLOCKV_DEFAULT_REPLICATION_BUFFER, BLOCKV_DEFAULT_REPLICATION_MAX_LAG_MS, BLOCKV_DEFAULT_SNAPSHOT_COPY_BANDWIDTH, BLOCKV_DEFAULT_STRIPE_SIZE,
+           BLOCKV_DEFAULT_DEDUP_CHUNK_SIZE, BLOCKV_DEFAULT_COMPRESSED_CHUNK_SIZE, BLOCKV_DEFAULT_COMPRESSED_CACHE_SIZE,
+           BLOCKV_DEFAULT_TIER_EXTENT_SIZE, BLOCKV_DEFAULT_TIER_MIGRATION_INTERVAL_S, BLOCKV_DEFAULT_READAHEAD_MAX,
+           BLOCKV_DEFAULT_QOS_CONCURRENCY,
+           BLOCKV_DEFAULT_SCHEDULER_READ_DEADLINE_MS, BLOCKV_DEFAULT_SCHEDULER_WRITE_DEADLINE_MS,
+           BLOCKV_DEFAULT_SCHEDULER_BACKGROUND_SHARE, BLOCKV_DEFAULT_SCHEDULER_SCRUB_SHARE,
+           BLOCKV_DEFAULT_CLIENT_CREDIT_REQUESTS, BLOCKV_DEFAULT_CLIENT_CREDIT_BYTES, BLOCKV_MIN_CLIENT_CREDIT_BYTES);
 }
 
-int main(int argc, const char **argv) {
+int main(int argc, char **argv) {
     int listen_fd, comm_fd, ret;
     struct sockaddr_in servaddr;
-    bool read_only = false;
+    block_device_options options;
+    long coalesce_delay_us = BLOCKV_DEFAULT_COALESCE_DELAY_US;
+    long group_commit_window_us = BLOCKV_DEFAULT_GROUP_COMMIT_WINDOW_US;
+    bool qos_enabled = false;
+    unsigned qos_concurrency = BLOCKV_DEFAULT_QOS_CONCURRENCY;
+    qos_limits qos_default_limits;
+    std::map<std::string, qos_limits> qos_limits_by_address;
+    unsigned scheduler_workers = 0;
+    unsigned long scheduler_read_deadline_ms = BLOCKV_DEFAULT_SCHEDULER_READ_DEADLINE_MS;
+    unsigned long scheduler_write_deadline_ms = BLOCKV_DEFAULT_SCHEDULER_WRITE_DEADLINE_MS;
+    unsigned scheduler_background_share = BLOCKV_DEFAULT_SCHEDULER_BACKGROUND_SHARE;
+    unsigned scheduler_scrub_share = BLOCKV_DEFAULT_SCHEDULER_SCRUB_SHARE;
+    client_credits credits;
+    std::vector<const char*> export_args;
 
-    if (argc != 2 && argc != 3) {
-        printf("Usage:\n" \
-               "%s <device file>\n" \
-               "%s <device file> --read-only\n", argv[0], argv[0]);
-        return -1;
+    enum { OPT_READ_ONLY = 256, OPT_WRITE_COALESCE_DELAY, OPT_GROUP_COMMIT_WINDOW, OPT_JOURNAL, OPT_JOURNAL_FOLD_THRESHOLD,
+        OPT_OVERLAY_BASE, OPT_PROXY, OPT_PROXY_HYDRATE_BANDWIDTH, OPT_MIGRATE_FROM, OPT_MIGRATE_BANDWIDTH,
+        OPT_REPLICATE_TO, OPT_REPLICATION_BUFFER, OPT_REPLICATION_MAX_LAG, OPT_REPLICATION_SYNC,
+        OPT_CHANGED_BLOCK_TRACKING, OPT_SNAPSHOT_COPY_BANDWIDTH, OPT_STRIPE_SIZE,
+        OPT_MIRROR, OPT_MIRROR_RESYNC, OPT_DEDUP_STORE, OPT_DEDUP_CHUNK_SIZE,
+        OPT_COMPRESS, OPT_COMPRESS_CHUNK_SIZE, OPT_COMPRESS_CACHE_SIZE,
+        OPT_TIER_FAST, OPT_TIER_EXTENT_SIZE, OPT_TIER_MIGRATION_INTERVAL, OPT_READAHEAD_MAX, OPT_CACHE_POLICY, OPT_EXPORT,
+        OPT_QOS_CONCURRENCY, OPT_QOS_IOPS, OPT_QOS_BANDWIDTH, OPT_QOS_CLIENT,
+        OPT_SCHEDULER_WORKERS, OPT_SCHEDULER_READ_DEADLINE, OPT_SCHEDULER_WRITE_DEADLINE, OPT_SCHEDULER_MIN_SHARES,
+        OPT_CLIENT_CREDIT_REQUESTS, OPT_CLIENT_CREDIT_BYTES };
+    static const struct option long_options[] = {
+        { "read-only", no_argument, nullptr, OPT_READ_ONLY },
+        { "write-coalesce-delay", required_argument, nullptr, OPT_WRITE_COALESCE_DELAY },
+        { "group-commit-window", required_argument, nullptr, OPT_GROUP_COMMIT_WINDOW },
+        { "journal", required_argument, nullptr, OPT_JOURNAL },
+        { "journal-fold-threshold", required_argument, nullptr, OPT_JOURNAL_FOLD_THRESHOLD },
+        { "overlay-base", required_argument, nullptr, OPT_OVERLAY_BASE },
+        { "proxy", required_argument, nullptr, OPT_PROXY },
+        { "proxy-hydrate-bandwidth", required_argument, nullptr, OPT_PROXY_HYDRATE_BANDWIDTH },
+        { "migrate-from", required_argument, nullptr, OPT_MIGRATE_FROM },
+        { "migrate-bandwidth", required_argument, nullptr, OPT_MIGRATE_BANDWIDTH },
+        { "replicate-to", required_argument, nullptr, OPT_REPLICATE_TO },
+        { "replication-buffer", required_argument, nullptr, OPT_REPLICATION_BUFFER },
+        { "replication-max-lag", required_argument, nullptr, OPT_REPLICATION_MAX_LAG },
+        { "replication-sync", no_argument, nullptr, OPT_REPLICATION_SYNC },
+        { "changed-block-tracking", no_argument, nullptr, OPT_CHANGED_BLOCK_TRACKING },
+        { "snapshot-copy-bandwidth", required_argument, nullptr, OPT_SNAPSHOT_COPY_BANDWIDTH },
+        { "stripe-size", required_argument, nullptr, OPT_STRIPE_SIZE },
+        { "mirror", no_argument, nullptr, OPT_MIRROR },
+        { "mirror-resync", required_argument, nullptr, OPT_MIRROR_RESYNC },
+        { "dedup-store", required_argument, nullptr, OPT_DEDUP_STORE },
+        { "dedup-chunk-size", required_argument, nullptr, OPT_DEDUP_CHUNK_SIZE },
+        { "compress", no_argument, nullptr, OPT_COMPRESS },
+        { "compress-chunk-size", required_argument, nullptr, OPT_COMPRESS_CHUNK_SIZE },
+        { "compress-cache-size", required_argument, nullptr, OPT_COMPRESS_CACHE_SIZE },
+        { "tier-fast", required_argument, nullptr, OPT_TIER_FAST },
+        { "tier-extent-size", required_argument, nullptr, OPT_TIER_EXTENT_SIZE },
+        { "tier-migration-interval", required_argument, nullptr, OPT_TIER_MIGRATION_INTERVAL },
+        { "readahead-max", required_argument, nullptr, OPT_READAHEAD_MAX },
+        { "cache-policy", required_argument, nullptr, OPT_CACHE_POLICY },
+        { "export", required_argument, nullptr, OPT_EXPORT },
+        { "qos-concurrency", required_argument, nullptr, OPT_QOS_CONCURRENCY },
+        { "qos-iops", required_argument, nullptr, OPT_QOS_IOPS },
+        { "qos-bandwidth", required_argument, nullptr, OPT_QOS_BANDWIDTH },
+        { "qos-client", required_argument, nullptr, OPT_QOS_CLIENT },
+        { "scheduler-workers", required_argument, nullptr, OPT_SCHEDULER_WORKERS },
+        { "scheduler-read-deadline", required_argument, nullptr, OPT_SCHEDULER_READ_DEADLINE },
+        { "scheduler-write-deadline", required_argument, nullptr, OPT_SCHEDULER_WRITE_DEADLINE },
+        { "scheduler-min-shares", required_argument, nullptr, OPT_SCHEDULER_MIN_SHARES },
+        { "client-credit-requests", required_argument, nullptr, OPT_CLIENT_CREDIT_REQUESTS },
+        { "client-credit-bytes", required_argument, nullptr, OPT_CLIENT_CREDIT_BYTES },
+        { nullptr, 0, nullptr, 0 },
+    };
+    int opt;
+    while ((opt = getopt_long(argc, argv, "", long_options, nullptr)) != -1) {
+        switch (opt) {
+        case OPT_READ_ONLY:
+            options.read_only = true;
+            break;
+        case OPT_WRITE_COALESCE_DELAY:
+            coalesce_delay_us = strtol(optarg, nullptr, 10);
+            break;
+        case OPT_GROUP_COMMIT_WINDOW:
+            group_commit_window_us = strtol(optarg, nullptr, 10);
+            break;
+        case OPT_JOURNAL:
+            options.journal_path = optarg;
+            break;
+        case OPT_JOURNAL_FOLD_THRESHOLD:
+            options.journal_fold_threshold = strtoull(optarg, nullptr, 10);
+            break;
+        case OPT_OVERLAY_BASE:
+            options.overlay_base = optarg;
+            break;
+        case OPT_PROXY:
+            options.proxy = optarg;
+            break;
+        case OPT_PROXY_HYDRATE_BANDWIDTH:
+            options.proxy_hydrate_bandwidth = strtoull(optarg, nullptr, 10);
+            break;
+        case OPT_MIGRATE_FROM:
+            options.proxy = optarg;
+            options.migrate = true;
+            break;
+        case OPT_MIGRATE_BANDWIDTH:
+            options.migrate_bandwidth = strtoull(optarg, nullptr, 10);
+            break;
+        case OPT_REPLICATE_TO:
+            options.replicate_to = optarg;
+            break;
+        case OPT_REPLICATION_BUFFER:
+            options.replication_buffer = strtoull(optarg, nullptr, 10);
+            break;
+        case OPT_REPLICATION_MAX_LAG:
+            options.replication_max_lag = std::chrono::milliseconds(strtoul(optarg, nullptr, 10));
+            break;
+        case OPT_REPLICATION_SYNC:
+            options.replication_sync = true;
+            break;
+        case OPT_CHANGED_BLOCK_TRACKING:
+            options.changed_block_tracking = true;
+            break;
+        case OPT_SNAPSHOT_COPY_BANDWIDTH:
+            options.snapshot_copy_bandwidth = strtoull(optarg, nullptr, 10);
+            break;
+        case OPT_STRIPE_SIZE:
+            options.stripe_size = strtoull(optarg, nullptr, 10);
+            break;
+        case OPT_MIRROR:
+            options.mirror = true;
+            break;
+        case OPT_MIRROR_RESYNC:
+            options.mirror_members_to_resync.push_back(strtoul(optarg, nullptr, 10));
+            break;
+        case OPT_DEDUP_STORE:
+            options.dedup_store = optarg;
+            break;
+        case OPT_DEDUP_CHUNK_SIZE:
+            options.dedup_chunk_size = strtoull(optarg, nullptr, 10);
+            break;
+        case OPT_COMPRESS:
+            options.compress = true;
+            break;
+        case OPT_COMPRESS_CHUNK_SIZE:
+            options.compress_chunk_size = strtoull(optarg, nullptr, 10);
+            break;
+        case OPT_COMPRESS_CACHE_SIZE:
+            options.compress_cache_size = strtoull(optarg, nullptr, 10);
+            break;
+        case OPT_TIER_FAST:
+            options.tier_fast = optarg;
+            break;
+        case OPT_TIER_EXTENT_SIZE:
+            options.tier_extent_size = strtoull(optarg, nullptr, 10);
+            break;
+        case OPT_TIER_MIGRATION_INTERVAL:
+            options.tier_migration_interval = std::chrono::seconds(strtoul(optarg, nullptr, 10));
+            break;
+        case OPT_READAHEAD_MAX:
+            options.readahead_max = strtoull(optarg, nullptr, 10);
+            break;
+        case OPT_CACHE_POLICY:
+            if (!parse_cache_policy(optarg, options.cache_policy)) {
+                usage(argv[0]);
+                return -1;
+            }
+            break;
+        case OPT_EXPORT:
+            export_args.push_back(optarg);
+            break;
+        case OPT_QOS_CONCURRENCY:
+            qos_concurrency = strtoul(optarg, nullptr, 10);
+            qos_enabled = true;
+            break;
+        case OPT_QOS_IOPS:
+            qos_default_limits.iops = strtoull(optarg, nullptr, 10);
+            qos_enabled = true;
+            break;
+        case OPT_QOS_BANDWIDTH:
+            qos_default_limits.bandwidth = strtoull(optarg, nullptr, 10);
+            qos_enabled = true;
+            break;
+        case OPT_QOS_CLIENT: {
+            std::string address;
+            qos_limits limits;
+            if (!parse_qos_limits(optarg, address, limits)) {
+                usage(argv[0]);
+                return -1;
+            }
+            qos_limits_by_address[address] = limits;
+            qos_enabled = true;
+            break;
+        }
+        case OPT_SCHEDULER_WORKERS:
+            scheduler_workers = strtoul(optarg, nullptr, 10);
+            break;
+        case OPT_SCHEDULER_READ_DEADLINE:
+            scheduler_read_deadline_ms = strtoul(optarg, nullptr, 10);
+            break;
+        case OPT_SCHEDULER_WRITE_DEADLINE:
+            scheduler_write_deadline_ms = strtoul(optarg, nullptr, 10);
+            break;
+        case OPT_SCHEDULER_MIN_SHARES:
+            if (sscanf(optarg, "%u:%u", &scheduler_background_share, &scheduler_scrub_share) != 2 ||
+                    scheduler_background_share + scheduler_scrub_share > 100) {
+                usage(argv[0]);
+                return -1;
+            }
+            break;
+        case OPT_CLIENT_CREDIT_REQUESTS:
+            credits.requests = strtoul(optarg, nullptr, 10);
+            break;
+        case OPT_CLIENT_CREDIT_BYTES:
+            credits.bytes = strtoul(optarg, nullptr, 10);
+            break;
+        default:
+            usage(argv[0]);
+            return -1;
+        }
     }
-    if (argc == 3) {
-        read_only = (std::string(argv[2]) == "--read-only");
+    if ((optind == argc && export_args.empty()) || coalesce_delay_us < 0 || group_commit_window_us < 0 || !options.stripe_size ||
+            !options.dedup_chunk_size || !options.compress_chunk_size || !options.tier_extent_size ||
+            !options.tier_migration_interval.count() || !options.migrate_bandwidth || !qos_concurrency || !credits.requests ||
+            credits.bytes < BLOCKV_MIN_CLIENT_CREDIT_BYTES) {
+        usage(argv[0]);
+        return -1;
     }
+    options.coalesce_delay = std::chrono::microseconds(coalesce_delay_us);
+    options.group_commit_window = std::chrono::microseconds(group_commit_window_us);
 
-    std::unique_ptr<block_device> dev = setup_block_device(argv[1], read_only);
+    // Outlives the exports, whose chunk maps are synced last.
+    chunk_stores stores;
+    export_table exports;
+    if (optind < argc) {
+        std::vector<const char*> block_device_paths(argv + optind, argv + argc);
+        exports.add("default", setup_block_device(block_device_paths, options, stores));
+    }
+    for (const char* arg : export_args) {
+        std::string name, path;
+        block_device_options export_options = options;
+        if (!parse_export(arg, name, path, export_options)) {
+            usage(argv[0]);
+            return -1;
+        }
+        printf("Export %s:\n", name.c_str());
+        if (!exports.add(name, setup_block_device({ path.c_str() }, export_options, stores))) {
+            printf("Export %s is given more than once!\n", name.c_str());
+            return -1;
+        }
+    }
 
     listen_fd = socket(AF_INET, SOCK_STREAM, 0);
     if (listen_fd == -1) {
@@ -275,12 +6568,57 @@ int main(int argc, const char **argv) {
     }
     printf("Listening on port number %d...\n", BLOCKV_SERVER_PORT);
 
-    for (;;) {
+    // No SA_RESTART, so that accept() is interrupted by the signal.
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = handle_stop_signal;
+    sigaction(SIGTERM, &sa, nullptr);
+    sigaction(SIGINT, &sa, nullptr);
+    sa.sa_handler = handle_snapshot_signal;
+    sigaction(SIGUSR1, &sa, nullptr);
+    signal(SIGPIPE, SIG_IGN);
+
+    std::unique_ptr<qos_scheduler> qos;
+    if (qos_enabled) {
+        qos.reset(new qos_scheduler(qos_default_limits, qos_limits_by_address, qos_concurrency));
+        printf("QoS: up to %u requests in the device at a time, default limits: %lu IOPS, %lu bytes/s\n",
+            qos_concurrency, qos_default_limits.iops, qos_default_limits.bandwidth);
+    }
+
+    std::unique_ptr<io_scheduler> scheduler;
+    if (scheduler_workers) {
+        scheduler.reset(new io_scheduler(scheduler_workers, std::chrono::milliseconds(scheduler_read_deadline_ms),
+            std::chrono::milliseconds(scheduler_write_deadline_ms), scheduler_background_share, scheduler_scrub_share));
+        printf("I/O scheduler: %u workers, deadlines: %lu ms for reads, %lu ms for writes, minimum shares: %u%% background, %u%% scrub\n",
+            scheduler_workers, scheduler_read_deadline_ms, scheduler_write_deadline_ms, scheduler_background_share, scheduler_scrub_share);
+    }
+
+    // Each client is served by its own thread, so that durable writes of
+    // different clients can share a group commit.
+    client_connections clients;
+    while (!stop_requested) {
+        if (snapshot_requested) {
+            // Snapshots requested through SIGUSR1 are named after the time they're taken.
+            snapshot_requested = 0;
+            exports.snapshot_all(std::to_string(time(nullptr)));
+        }
         comm_fd = accept(listen_fd, (struct sockaddr*) NULL, NULL);
+        if (comm_fd == -1) {
+            if (errno != EINTR) {
+                perror("accept");
+            }
+            continue;
+        }
         printf("\n{ NEW CLIENT }\n");
-        handle_client_requests(comm_fd, *dev);
-        close(comm_fd);
+        clients.add(comm_fd);
+        std::thread([comm_fd, &exports, &qos, &scheduler, &clients, credits] {
+            handle_client_requests(comm_fd, exports, qos.get(), scheduler.get(), credits);
+            clients.remove(comm_fd);
+            close(comm_fd);
+        }).detach();
     }
 
+    printf("Shutting down...\n");
+    clients.shutdown_all();
     close(listen_fd);
 }
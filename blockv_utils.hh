@@ -0,0 +1,331 @@
+/*
+ * Copyright (C) 2016 Raphael S. Carvalho
+ *
+ * This program can be distributed under the terms of the GNU GPL.
+ * See the file COPYING.
+ */
+
+#ifndef UTILS_H
+#define UTILS_H
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netdb.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <string>
+#include <limits>
+#include <functional>
+#include "blockv_protocol.hh"
+
+// Client side of the protocol shared by blockv FUSE and by blockv servers
+// that are themselves clients of another server.
+
+#define BLOCKV_DEFAULT_PORT "22000"
+
+// Splits a target given as <host>:<port>[/<export>][?<options>], e.g.
+// localhost:22000/vm1. The port defaults to 22000, and the export to the
+// default one of the server.
+static inline bool blockv_parse_target(const char* target, std::string& host, std::string& port, std::string& export_name) {
+    std::string address(target, strcspn(target, "?"));
+    size_t slash = address.find('/');
+    if (slash != std::string::npos) {
+        export_name = address.substr(slash + 1);
+        address.resize(slash);
+    }
+    size_t colon = address.rfind(':');
+    host = address.substr(0, colon);
+    port = (colon != std::string::npos) ? address.substr(colon + 1) : BLOCKV_DEFAULT_PORT;
+    return !host.empty() && !port.empty() && export_name.size() <= std::numeric_limits<uint8_t>::max();
+}
+
+// Reads or writes exactly size bytes. Returns false if the connection
+// failed or was closed, with errno set.
+static inline bool blockv_read_exact(int fd, void* buf, size_t size) {
+    while (size) {
+        ssize_t ret = ::read(fd, buf, size);
+        if (ret <= 0) {
+            if (ret == 0) {
+                errno = ECONNRESET;
+            }
+            return false;
+        }
+        buf = (char*)buf + ret;
+        size -= ret;
+    }
+    return true;
+}
+
+static inline bool blockv_write_exact(int fd, const void* buf, size_t size) {
+    while (size) {
+        ssize_t ret = ::write(fd, buf, size);
+        if (ret <= 0) {
+            return false;
+        }
+        buf = (const char*)buf + ret;
+        size -= ret;
+    }
+    return true;
+}
+
+// Connects to the server of target, and selects the export it names. On
+// success, returns the socket with info filled in, in host order, with the
+// size and the mode of the export. Returns -1 with errno set otherwise:
+// EINVAL if target is invalid, EHOSTUNREACH if its host can't be resolved,
+// EPROTONOSUPPORT if the server can't select exports, or the error of the
+// server, e.g. ENOENT if there's no such export.
+static inline int blockv_connect(const char* target, blockv_server_info& info) {
+    std::string host, port, export_name;
+    if (!blockv_parse_target(target, host, port, export_name)) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    struct addrinfo hints;
+    struct addrinfo* addresses;
+    memset(&hints, 0, sizeof hints);
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_STREAM;
+    if (getaddrinfo(host.c_str(), port.c_str(), &hints, &addresses) != 0) {
+        errno = EHOSTUNREACH;
+        return -1;
+    }
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd == -1) {
+        freeaddrinfo(addresses);
+        return -1;
+    }
+    int ret = connect(fd, addresses->ai_addr, addresses->ai_addrlen);
+    freeaddrinfo(addresses);
+    if (ret == -1 || !blockv_read_exact(fd, &info, blockv_server_info::serialized_size())) {
+        int saved_errno = errno;
+        close(fd);
+        errno = saved_errno;
+        return -1;
+    }
+    blockv_server_info::to_host(info);
+    if (!info.is_valid()) {
+        close(fd);
+        errno = EPROTO;
+        return -1;
+    }
+
+    // Servers older than version 7 only have a default export.
+    if (!export_name.empty()) {
+        if (info.version < 7) {
+            close(fd);
+            errno = EPROTONOSUPPORT;
+            return -1;
+        }
+        blockv_export_request* export_request = blockv_export_request::to_network(export_name.c_str());
+        blockv_export_response export_response;
+        bool sent = export_request && blockv_write_exact(fd, export_request, export_request->serialized_size());
+        delete[] (char *) export_request;
+        if (!sent || !blockv_read_exact(fd, &export_response, blockv_export_response::serialized_size())) {
+            int saved_errno = errno;
+            close(fd);
+            errno = saved_errno;
+            return -1;
+        }
+        blockv_export_response::to_host(export_response);
+        if (export_response.error) {
+            close(fd);
+            errno = export_response.error;
+            return -1;
+        }
+        info.device_size = export_response.device_size;
+        info.read_only = export_response.read_only;
+    }
+    return fd;
+}
+
+// Connection to a blockv server that serves one request at a time, with the
+// untagged requests every server version understands. It's reopened by the
+// next request after a failure.
+struct blockv_client {
+private:
+    std::string _target;
+    int _fd = -1;
+    blockv_server_info _info;
+    // Set by migrate(), after which every new connection stops writes first.
+    bool _migrating = false;
+
+    void disconnect() {
+        if (_fd != -1) {
+            close(_fd);
+            _fd = -1;
+        }
+    }
+
+    // Drops the connection after a failure, which left errno set.
+    int fail() {
+        int saved_errno = errno;
+        disconnect();
+        errno = saved_errno;
+        return -1;
+    }
+
+    // Sends MIGRATE on the open connection. Returns 0 on success, or -1 with
+    // errno set.
+    int send_migrate() {
+        if (_info.version < 8) {
+            errno = EPROTONOSUPPORT;
+            return -1;
+        }
+        blockv_migrate_request migrate_request;
+        blockv_migrate_response migrate_response;
+        if (!blockv_write_exact(_fd, &migrate_request, blockv_migrate_request::serialized_size()) ||
+                !blockv_read_exact(_fd, &migrate_response, blockv_migrate_response::serialized_size())) {
+            return fail();
+        }
+        blockv_migrate_response::to_host(migrate_response);
+        if (migrate_response.error) {
+            errno = migrate_response.error;
+            return -1;
+        }
+        return 0;
+    }
+public:
+    explicit blockv_client(const std::string& target) : _target(target) {}
+    ~blockv_client() {
+        disconnect();
+    }
+
+    blockv_client(const blockv_client&) = delete;
+    blockv_client& operator=(const blockv_client&) = delete;
+
+    // Returns 0 on success, or -1 with errno set.
+    int connect() {
+        if (_fd != -1) {
+            return 0;
+        }
+        _fd = blockv_connect(_target.c_str(), _info);
+        if (_fd == -1) {
+            return -1;
+        }
+        // The server may have restarted since writes were stopped.
+        if (_migrating && send_migrate() == -1) {
+            return fail();
+        }
+        return 0;
+    }
+
+    const std::string& target() const {
+        return _target;
+    }
+
+    // Only valid once connected.
+    uint64_t size() const {
+        return _info.device_size;
+    }
+
+    bool read_only() const {
+        return _info.read_only;
+    }
+
+    // Reads exactly size bytes at offset. Returns 0 on success, or -1 with
+    // errno set; EIO if the server returned less than asked for.
+    int read(char* buf, uint32_t size, uint64_t offset) {
+        if (connect() == -1) {
+            return -1;
+        }
+        blockv_read_request read_request = blockv_read_request::to_network(size, offset);
+        uint32_t response_size;
+        if (!blockv_write_exact(_fd, &read_request, blockv_read_request::serialized_size()) ||
+                !blockv_read_exact(_fd, &response_size, sizeof(response_size))) {
+            int saved_errno = errno;
+            disconnect();
+            errno = saved_errno;
+            return -1;
+        }
+        response_size = ntohl(response_size);
+        if (response_size > size || !blockv_read_exact(_fd, buf, response_size)) {
+            int saved_errno = (response_size > size) ? EPROTO : errno;
+            disconnect();
+            errno = saved_errno;
+            return -1;
+        }
+        if (response_size < size) {
+            errno = EIO;
+            return -1;
+        }
+        return 0;
+    }
+
+    // Stops writes to the export on its server, once this server migrates
+    // it. Every connection opened from now on does it again before any other
+    // request, and fails if it can't. Returns 0 on success, or -1 with errno
+    // set; EPROTONOSUPPORT if the server is older than version 8.
+    int migrate() {
+        _migrating = true;
+        if (_fd == -1) {
+            return connect();
+        }
+        return send_migrate();
+    }
+
+    // Starts a checkpoint of the export, whose id is returned in checkpoint.
+    // Returns 0 on success, or -1 with errno set; EPROTONOSUPPORT if the
+    // server is older than version 9, or EOPNOTSUPP if it doesn't track the
+    // changed blocks of the export.
+    int checkpoint(uint64_t& checkpoint) {
+        if (connect() == -1) {
+            return -1;
+        }
+        if (_info.version < 9) {
+            errno = EPROTONOSUPPORT;
+            return -1;
+        }
+        blockv_checkpoint_request checkpoint_request;
+        blockv_checkpoint_response checkpoint_response;
+        if (!blockv_write_exact(_fd, &checkpoint_request, blockv_checkpoint_request::serialized_size()) ||
+                !blockv_read_exact(_fd, &checkpoint_response, blockv_checkpoint_response::serialized_size())) {
+            return fail();
+        }
+        blockv_checkpoint_response::to_host(checkpoint_response);
+        if (checkpoint_response.error) {
+            errno = checkpoint_response.error;
+            return -1;
+        }
+        checkpoint = checkpoint_response.checkpoint;
+        return 0;
+    }
+
+    // Calls fn with every extent of the export changed since checkpoint, in
+    // offset order, as the server streams them. Returns 0 on success, or -1
+    // with errno set; ENOENT if the server doesn't know the checkpoint.
+    int changed_extents(uint64_t checkpoint, const std::function<void(uint64_t, uint64_t)>& fn) {
+        if (connect() == -1) {
+            return -1;
+        }
+        if (_info.version < 9) {
+            errno = EPROTONOSUPPORT;
+            return -1;
+        }
+        blockv_changed_extents_request changed_extents_request = blockv_changed_extents_request::to_network(checkpoint);
+        blockv_changed_extents_response changed_extents_response;
+        if (!blockv_write_exact(_fd, &changed_extents_request, blockv_changed_extents_request::serialized_size()) ||
+                !blockv_read_exact(_fd, &changed_extents_response, blockv_changed_extents_response::serialized_size())) {
+            return fail();
+        }
+        blockv_changed_extents_response::to_host(changed_extents_response);
+        if (changed_extents_response.error) {
+            errno = changed_extents_response.error;
+            return -1;
+        }
+        for (;;) {
+            blockv_extent extent;
+            if (!blockv_read_exact(_fd, &extent, blockv_extent::serialized_size())) {
+                return fail();
+            }
+            blockv_extent::to_host(extent);
+            if (!extent.length) {
+                return 0;
+            }
+            fn(extent.offset, extent.length);
+        }
+    }
+};
+
+#endif
@@ -0,0 +1,172 @@
+/*
+ * Copyright (C) 2016 Raphael S. Carvalho
+ *
+ * This program can be distributed under the terms of the GNU GPL.
+ * See the file COPYING.
+ */
+
+#include <atomic>
+#include <mutex>
+#include <set>
+#include <thread>
+#include "../blockv_utils.hh"
+#include "blockv_test.hh"
+
+// Checks changed-block tracking: the extents changed since a checkpoint cover
+// every write acknowledged after the checkpoint was taken, even while writers
+// race with it, and copying them brings a backup up to date. CHANGED_EXTENTS
+// fails with EOPNOTSUPP on a tagged connection, and checkpoints are forgotten
+// by a crash of the server.
+//
+// g++ --std=c++14 -O2 tests/blockv_cbt_test.cc -o blockv_cbt_test -lpthread
+// ./blockv_cbt_test ./blockv_server
+
+#define DEVICE_SIZE (8 * 1024 * 1024)
+#define BLOCK_SIZE 4096
+#define WRITERS 4
+
+// Blocks written by the writers, once the write was acknowledged.
+struct written_blocks {
+    std::mutex mutex;
+    std::set<uint64_t> offsets;
+};
+
+static void tracked_writes(std::vector<char>& model, int writer, unsigned count, written_blocks& written) {
+    test_connection conn;
+    uint64_t region = DEVICE_SIZE / WRITERS;
+    std::vector<char> buf(BLOCK_SIZE);
+    for (unsigned i = 0; i < count; i++) {
+        uint64_t offset = writer * region + (rand() % (region / BLOCK_SIZE)) * BLOCK_SIZE;
+        fill_random(buf.data(), buf.size());
+        uint32_t size = conn.write(buf.data(), buf.size(), offset);
+        assert(size == BLOCK_SIZE);
+        std::copy(buf.begin(), buf.end(), model.begin() + offset);
+        std::lock_guard<std::mutex> lock(written.mutex);
+        written.offsets.insert(offset);
+    }
+}
+
+static void run_writers(std::vector<char>& model, unsigned count, written_blocks& written) {
+    std::vector<std::thread> writers;
+    for (int i = 0; i < WRITERS; i++) {
+        writers.emplace_back(tracked_writes, std::ref(model), i, count, std::ref(written));
+    }
+    for (auto& writer : writers) {
+        writer.join();
+    }
+}
+
+static std::vector<std::pair<uint64_t, uint64_t>> changed_extents(blockv_client& client, uint64_t checkpoint) {
+    std::vector<std::pair<uint64_t, uint64_t>> extents;
+    int ret = client.changed_extents(checkpoint, [&extents] (uint64_t offset, uint64_t length) {
+        assert(extents.empty() || extents.back().first + extents.back().second <= offset);
+        extents.emplace_back(offset, length);
+    });
+    assert(ret == 0);
+    return extents;
+}
+
+static void check_covered(const std::vector<std::pair<uint64_t, uint64_t>>& extents, const std::set<uint64_t>& offsets) {
+    for (uint64_t offset : offsets) {
+        auto it = std::upper_bound(extents.begin(), extents.end(), std::make_pair(offset, UINT64_MAX));
+        bool covered = it != extents.begin() && offset + BLOCK_SIZE <= std::prev(it)->first + std::prev(it)->second;
+        if (!covered) {
+            printf("Block at offset %lu isn't among the changed extents\n", offset);
+            assert(false);
+        }
+    }
+}
+
+int main(int argc, char **argv) {
+    if (argc != 2) {
+        printf("Usage: %s <blockv server>\n", argv[0]);
+        return -1;
+    }
+    std::string dir = make_test_dir();
+    std::vector<char> model(DEVICE_SIZE);
+    fill_random(model.data(), model.size());
+    create_file(dir + "/image", model);
+    std::vector<std::string> args = { "--changed-block-tracking", dir + "/image" };
+    pid_t pid = start_server(argv[1], dir, args);
+
+    uint64_t first;
+    {
+        blockv_client client("127.0.0.1:" + std::to_string(BLOCKV_TEST_PORT));
+        std::vector<char> backup = model;
+        int ret = client.checkpoint(first);
+        assert(ret == 0);
+        written_blocks written;
+        run_writers(model, 200, written);
+
+        // Copying the changed extents brings the backup up to date.
+        auto extents = changed_extents(client, first);
+        check_covered(extents, written.offsets);
+        for (auto& extent : extents) {
+            for (uint64_t pos = 0; pos < extent.second; pos += BLOCK_SIZE) {
+                ret = client.read(backup.data() + extent.first + pos, BLOCK_SIZE, extent.first + pos);
+                assert(ret == 0);
+            }
+        }
+        assert(backup == model);
+    }
+
+    uint64_t second;
+    {
+        // Writes acknowledged once the checkpoint is taken are tracked,
+        // whatever the writers were doing when it was taken.
+        written_blocks before, after;
+        std::atomic<bool> taken(false);
+        std::thread checkpointer([&] {
+            blockv_client client("127.0.0.1:" + std::to_string(BLOCKV_TEST_PORT));
+            usleep(20 * 1000);
+            int ret = client.checkpoint(second);
+            assert(ret == 0);
+            taken = true;
+        });
+        while (!taken) {
+            run_writers(model, 20, before);
+        }
+        checkpointer.join();
+        run_writers(model, 100, after);
+        blockv_client client("127.0.0.1:" + std::to_string(BLOCKV_TEST_PORT));
+        check_covered(changed_extents(client, second), after.offsets);
+        check_covered(changed_extents(client, first), before.offsets);
+        check_covered(changed_extents(client, first), after.offsets);
+    }
+
+    {
+        test_connection conn;
+        conn.set_timeout(30);
+        uint32_t error = conn.hello();
+        assert(error == 0);
+        conn.send_tag(1);
+        blockv_changed_extents_request changed_extents_request = blockv_changed_extents_request::to_network(second);
+        conn.send(&changed_extents_request, blockv_changed_extents_request::serialized_size());
+        blockv_response_tag tag = conn.receive_tag();
+        assert(tag.handle == 1 && tag.error == EOPNOTSUPP);
+        // The connection is still usable.
+        conn.send_tagged_read(2, BLOCK_SIZE, 0);
+        tag = conn.receive_tag();
+        assert(tag.handle == 2 && tag.error == 0);
+    }
+    {
+        test_connection conn;
+        uint32_t error = conn.flush();
+        assert(error == 0);
+    }
+
+    stop_server(pid, SIGKILL);
+    pid = start_server(argv[1], dir, args);
+    {
+        blockv_client client("127.0.0.1:" + std::to_string(BLOCKV_TEST_PORT));
+        int ret = client.changed_extents(second, [] (uint64_t, uint64_t) {});
+        assert(ret == -1 && errno == ENOENT);
+        test_connection conn;
+        check_device(conn, model);
+    }
+    stop_server(pid, SIGTERM);
+
+    remove_test_dir(dir);
+    printf("OK\n");
+    return 0;
+}
@@ -0,0 +1,48 @@
+/*
+ * Copyright (C) 2016 Raphael S. Carvalho
+ *
+ * This program can be distributed under the terms of the GNU GPL.
+ * See the file COPYING.
+ */
+
+#include "blockv_test.hh"
+
+// Checks that flushed writes to a compressed export survive crashes of the
+// server. Writers share every 64K chunk, so that read-modify-writes of a
+// chunk race with each other and with evictions of a small decompression
+// cache.
+//
+// g++ --std=c++14 -O2 tests/blockv_compressed_test.cc -o blockv_compressed_test -lpthread
+// ./blockv_compressed_test ./blockv_server
+
+#define DEVICE_SIZE (8 * 1024 * 1024)
+#define BLOCK_SIZE 4096
+
+// Partly random, then a repeated byte, so that chunks compress to various sizes.
+static void fill_compressible(char* buf, size_t size) {
+    size_t random_size = rand() % size;
+    fill_random(buf, random_size);
+    memset(buf + random_size, rand(), size - random_size);
+}
+
+int main(int argc, char **argv) {
+    if (argc != 2) {
+        printf("Usage: %s <blockv server>\n", argv[0]);
+        return -1;
+    }
+    std::string dir = make_test_dir();
+    std::vector<char> content(DEVICE_SIZE);
+    fill_compressible(content.data(), content.size());
+    create_file(dir + "/image", content);
+    crash_model model(content, BLOCK_SIZE);
+    crash_workload workload;
+    workload.pick_block = [&workload, &model] (unsigned writer) {
+        return interleaved_block(writer, workload.writers, model.blocks());
+    };
+    workload.fill = fill_compressible;
+    run_crash_rounds(argv[1], dir, { "--compress", "--compress-cache-size=262144", dir + "/image" }, model, workload, 4);
+
+    remove_test_dir(dir);
+    printf("OK\n");
+    return 0;
+}
@@ -0,0 +1,106 @@
+/*
+ * Copyright (C) 2016 Raphael S. Carvalho
+ *
+ * This program can be distributed under the terms of the GNU GPL.
+ * See the file COPYING.
+ */
+
+// Measures the LZ4 codec used by compressed exports on data of varying
+// compressibility, and shows the disk bandwidth below which reading
+// compressed chunks and decompressing them beats reading raw data.
+//
+// g++ --std=c++14 -O2 tests/blockv_compression_bench.cc -o blockv_compression_bench
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <chrono>
+#include <vector>
+#include "../blockv_compression.hh"
+
+#define CHUNK_SIZE (64 * 1024)
+#define CHUNKS 512
+
+using bench_clock = std::chrono::steady_clock;
+
+// Fills buf with log-like lines, where about one byte in every random_every
+// is replaced by a random one.
+static void fill(std::vector<char>& buf, unsigned random_every) {
+    static const char* words[] = {
+        "blockv_server: client connected\n", "blockv_server: read 4096 bytes at offset ",
+        "blockv_server: wrote 65536 bytes at offset ", "blockv_server: flush completed\n",
+        "0123456789\n", "blockv_server: client disconnected\n", "error: ", "blockv_server: snapshot taken\n",
+    };
+    size_t i = 0;
+    while (i < buf.size()) {
+        const char* w = words[rand() % 8];
+        for (size_t j = 0; w[j] && i < buf.size(); j++) {
+            buf[i++] = w[j];
+        }
+    }
+    for (i = 0; random_every && i < buf.size(); i++) {
+        if (rand() % random_every == 0) {
+            buf[i] = char(rand());
+        }
+    }
+}
+
+static double seconds_since(bench_clock::time_point start) {
+    return std::chrono::duration<double>(bench_clock::now() - start).count();
+}
+
+int main() {
+    const size_t total = size_t(CHUNK_SIZE) * CHUNKS;
+    const double disk_mbps[] = { 50, 150, 500, 1500, 3000 };
+    const unsigned random_every[] = { 0, 64, 16, 4, 2, 1 };
+    std::vector<char> data(total), compressed(total), out(total);
+    std::vector<size_t> sizes(CHUNKS);
+    srand(1);
+
+    printf("%-10s %8s %12s %12s %14s", "random", "ratio", "comp MB/s", "decomp MB/s", "crossover MB/s");
+    for (double mbps : disk_mbps) {
+        printf(" %9.0f", mbps);
+    }
+    printf("\n");
+
+    for (unsigned every : random_every) {
+        fill(data, every);
+
+        auto start = bench_clock::now();
+        size_t compressed_total = 0;
+        for (size_t c = 0; c < CHUNKS; c++) {
+            sizes[c] = lz4_compress(&data[c * CHUNK_SIZE], CHUNK_SIZE, &compressed[c * CHUNK_SIZE], CHUNK_SIZE);
+            // Chunks that don't compress are stored raw, as the server does.
+            compressed_total += (sizes[c]) ? sizes[c] : CHUNK_SIZE;
+        }
+        double compress_mbps = total / seconds_since(start) / (1024 * 1024);
+
+        start = bench_clock::now();
+        for (size_t c = 0; c < CHUNKS; c++) {
+            if (!sizes[c]) {
+                memcpy(&out[c * CHUNK_SIZE], &data[c * CHUNK_SIZE], CHUNK_SIZE);
+                continue;
+            }
+            int ret = lz4_decompress(&compressed[c * CHUNK_SIZE], sizes[c], &out[c * CHUNK_SIZE], CHUNK_SIZE);
+            assert(ret == 0);
+        }
+        double decompress_mbps = total / seconds_since(start) / (1024 * 1024);
+        assert(out == data);
+
+        // Reading compressed data takes 1 / (ratio * disk) + 1 / decompress
+        // seconds per logical MB, against 1 / disk for raw data.
+        double ratio = double(total) / compressed_total;
+        double crossover = decompress_mbps * (1 - 1 / ratio);
+        char label[16];
+        snprintf(label, sizeof(label), (every) ? "1/%u" : "none", every);
+        printf("%-10s %8.2f %12.0f %12.0f %14.0f", label, ratio, compress_mbps, decompress_mbps, crossover);
+        // Effective read throughput of compressed chunks, in MB/s, for each disk bandwidth.
+        for (double mbps : disk_mbps) {
+            printf(" %9.0f", 1 / (1 / (ratio * mbps) + 1 / decompress_mbps));
+        }
+        printf("\n");
+    }
+    printf("\nDisks slower than the crossover bandwidth read faster with compression.\n");
+    return 0;
+}
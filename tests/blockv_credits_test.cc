@@ -0,0 +1,115 @@
+/*
+ * Copyright (C) 2016 Raphael S. Carvalho
+ *
+ * This program can be distributed under the terms of the GNU GPL.
+ * See the file COPYING.
+ */
+
+#include <map>
+#include <thread>
+#include "blockv_test.hh"
+
+// Checks credit-based flow control: clients that keep as many tagged writes
+// in flight as their credits allow are all served, while a client whose
+// request exceeds its credits for bytes is disconnected.
+//
+// g++ --std=c++14 -O2 tests/blockv_credits_test.cc -o blockv_credits_test -lpthread
+// ./blockv_credits_test ./blockv_server
+
+#define DEVICE_SIZE (8 * 1024 * 1024)
+#define CREDIT_REQUESTS 4
+#define CREDIT_BYTES (1024 * 1024)
+#define WRITERS 4
+#define WRITES 400
+
+// Writes blocks of up to 256K one after the other through the region of the
+// writer, waiting for responses only when out of credits. The region is
+// larger than what's in flight, so writes in flight never overlap.
+static void pipelined_writes(std::vector<char>& model, int writer) {
+    test_connection conn;
+    conn.set_timeout(30);
+    uint32_t error = conn.hello();
+    assert(error == 0);
+    assert(conn.hello_response.credit_requests == CREDIT_REQUESTS && conn.hello_response.credit_bytes == CREDIT_BYTES);
+
+    uint64_t region = DEVICE_SIZE / WRITERS;
+    uint64_t pos = 0;
+    std::map<uint64_t, uint32_t> in_flight;
+    uint64_t bytes_in_flight = 0;
+    std::vector<char> buf(256 * 1024);
+    for (uint64_t handle = 0; handle < WRITES || !in_flight.empty(); ) {
+        uint32_t size = 4096 * (1 + rand() % (buf.size() / 4096));
+        if (handle < WRITES && in_flight.size() < CREDIT_REQUESTS && bytes_in_flight + size <= CREDIT_BYTES) {
+            if (pos + size > region) {
+                pos = 0;
+            }
+            uint64_t offset = writer * region + pos;
+            fill_random(buf.data(), size);
+            conn.send_tagged_write(handle, buf.data(), size, offset);
+            std::copy(buf.begin(), buf.begin() + size, model.begin() + offset);
+            in_flight[handle++] = size;
+            bytes_in_flight += size;
+            pos += size;
+            continue;
+        }
+        blockv_response_tag tag = conn.receive_tag();
+        assert(tag.error == 0 && in_flight.count(tag.handle));
+        blockv_write_response write_response;
+        conn.receive(&write_response, blockv_write_response::serialized_size());
+        blockv_write_response::to_host(write_response);
+        assert(write_response.size == in_flight[tag.handle]);
+        bytes_in_flight -= in_flight[tag.handle];
+        in_flight.erase(tag.handle);
+    }
+}
+
+int main(int argc, char **argv) {
+    if (argc != 2) {
+        printf("Usage: %s <blockv server>\n", argv[0]);
+        return -1;
+    }
+    std::string dir = make_test_dir();
+    std::vector<char> model(DEVICE_SIZE);
+    fill_random(model.data(), model.size());
+    create_file(dir + "/image", model);
+    pid_t pid = start_server(argv[1], dir, { "--client-credit-requests=" + std::to_string(CREDIT_REQUESTS),
+        "--client-credit-bytes=" + std::to_string(CREDIT_BYTES), dir + "/image" });
+
+    std::vector<std::thread> writers;
+    for (int i = 0; i < WRITERS; i++) {
+        writers.emplace_back(pipelined_writes, std::ref(model), i);
+    }
+    for (auto& writer : writers) {
+        writer.join();
+    }
+    {
+        test_connection conn;
+        check_device(conn, model);
+    }
+
+    {
+        test_connection conn;
+        conn.set_timeout(30);
+        uint32_t error = conn.hello();
+        assert(error == 0);
+        // A read of all the credits for bytes is fine...
+        conn.send_tagged_read(1, CREDIT_BYTES, 0);
+        blockv_response_tag tag = conn.receive_tag();
+        assert(tag.handle == 1 && tag.error == 0);
+        uint32_t size;
+        conn.receive(&size, sizeof(size));
+        assert(ntohl(size) == CREDIT_BYTES);
+        std::vector<char> buf(CREDIT_BYTES);
+        conn.receive(buf.data(), buf.size());
+        assert(!memcmp(buf.data(), model.data(), buf.size()));
+        // ...but a larger one gets the client disconnected.
+        conn.send_tagged_read(2, CREDIT_BYTES + 4096, 0);
+        ssize_t ret = ::read(conn.fd, buf.data(), 1);
+        assert(ret == 0);
+    }
+    stop_server(pid, SIGTERM);
+
+    remove_test_dir(dir);
+    printf("OK\n");
+    return 0;
+}
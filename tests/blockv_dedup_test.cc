@@ -0,0 +1,53 @@
+/*
+ * Copyright (C) 2016 Raphael S. Carvalho
+ *
+ * This program can be distributed under the terms of the GNU GPL.
+ * See the file COPYING.
+ */
+
+#include "blockv_test.hh"
+
+// Checks that flushed writes to a deduplicated export survive crashes of the
+// server. Writers mostly write a few contents over and over, so that chunks
+// are shared, released and reused while others flush.
+//
+// g++ --std=c++14 -O2 tests/blockv_dedup_test.cc -o blockv_dedup_test -lpthread
+// ./blockv_dedup_test ./blockv_server
+
+#define DEVICE_SIZE (8 * 1024 * 1024)
+#define CHUNK_SIZE 4096
+#define CONTENTS 16
+
+int main(int argc, char **argv) {
+    if (argc != 2) {
+        printf("Usage: %s <blockv server>\n", argv[0]);
+        return -1;
+    }
+    std::string dir = make_test_dir();
+    std::vector<char> content(DEVICE_SIZE);
+    fill_random(content.data(), content.size());
+    create_file(dir + "/image", content);
+    std::vector<std::vector<char>> contents(CONTENTS, std::vector<char>(CHUNK_SIZE));
+    for (auto& c : contents) {
+        fill_random(c.data(), c.size());
+    }
+    crash_model model(content, CHUNK_SIZE);
+    crash_workload workload;
+    workload.pick_block = [&workload, &model] (unsigned writer) {
+        return interleaved_block(writer, workload.writers, model.blocks());
+    };
+    workload.fill = [&contents] (char* buf, size_t size) {
+        if (rand() % 4) {
+            const std::vector<char>& c = contents[rand() % contents.size()];
+            std::copy(c.begin(), c.end(), buf);
+        } else {
+            fill_random(buf, size);
+        }
+    };
+    run_crash_rounds(argv[1], dir, { "--dedup-store=" + dir + "/store", "--dedup-chunk-size=" + std::to_string(CHUNK_SIZE),
+        dir + "/image" }, model, workload, 4);
+
+    remove_test_dir(dir);
+    printf("OK\n");
+    return 0;
+}
@@ -0,0 +1,41 @@
+/*
+ * Copyright (C) 2016 Raphael S. Carvalho
+ *
+ * This program can be distributed under the terms of the GNU GPL.
+ * See the file COPYING.
+ */
+
+#include "blockv_test.hh"
+
+// Checks that flushed writes to a journaled export survive crashes of the
+// server in the middle of writes and of folds of the journal into the image,
+// and that the journal left by a clean shutdown is replayed.
+//
+// g++ --std=c++14 -O2 tests/blockv_journal_test.cc -o blockv_journal_test -lpthread
+// ./blockv_journal_test ./blockv_server
+
+#define DEVICE_SIZE (8 * 1024 * 1024)
+#define BLOCK_SIZE 4096
+
+int main(int argc, char **argv) {
+    if (argc != 2) {
+        printf("Usage: %s <blockv server>\n", argv[0]);
+        return -1;
+    }
+    std::string dir = make_test_dir();
+    std::vector<char> content(DEVICE_SIZE);
+    fill_random(content.data(), content.size());
+    create_file(dir + "/image", content);
+    crash_model model(content, BLOCK_SIZE);
+    crash_workload workload;
+    workload.pick_block = [&workload, &model] (unsigned writer) {
+        return interleaved_block(writer, workload.writers, model.blocks());
+    };
+    // Folded every 256K, so that folds run during the writes.
+    run_crash_rounds(argv[1], dir, { "--journal=" + dir + "/journal", "--journal-fold-threshold=262144", dir + "/image" },
+        model, workload, 4);
+
+    remove_test_dir(dir);
+    printf("OK\n");
+    return 0;
+}
@@ -0,0 +1,130 @@
+/*
+ * Copyright (C) 2016 Raphael S. Carvalho
+ *
+ * This program can be distributed under the terms of the GNU GPL.
+ * See the file COPYING.
+ */
+
+#include <atomic>
+#include <thread>
+#include "../blockv_utils.hh"
+#include "blockv_test.hh"
+
+// Checks the source side of a live migration: once MIGRATE is answered, the
+// export takes no more writes, tagged ones failing with EROFS and untagged
+// ones being answered with a size of 0, while reads are still served. Writers
+// race with the MIGRATE, and the device must hold exactly the writes that
+// were acknowledged. Writes must still be refused after the server is killed
+// and restarted, and the migrating client must stop them again when it
+// reconnects to a server that forgot about the migration. The target side
+// needs a second server, which can't listen on the same port.
+//
+// g++ --std=c++14 -O2 tests/blockv_migrate_test.cc -o blockv_migrate_test -lpthread
+// ./blockv_migrate_test ./blockv_server
+
+#define DEVICE_SIZE (4 * 1024 * 1024)
+#define BLOCK_SIZE 4096
+#define WRITERS 4
+
+// Checks that the device holds the model, and refuses untagged writes.
+static void check_refuses_writes(const std::vector<char>& model) {
+    test_connection conn;
+    conn.set_timeout(30);
+    assert(conn.info.read_only);
+    check_device(conn, model);
+    std::vector<char> buf(BLOCK_SIZE);
+    uint32_t written = conn.write(buf.data(), buf.size(), 0);
+    assert(written == 0);
+}
+
+static void writes_until_refused(std::vector<char>& model, int writer, const std::atomic<bool>& migrated) {
+    test_connection conn;
+    conn.set_timeout(30);
+    uint64_t region = DEVICE_SIZE / WRITERS;
+    std::vector<char> buf(BLOCK_SIZE);
+    for (;;) {
+        bool after_migrate = migrated.load();
+        uint64_t offset = writer * region + (rand() % (region / BLOCK_SIZE)) * BLOCK_SIZE;
+        fill_random(buf.data(), buf.size());
+        uint32_t written = conn.write(buf.data(), buf.size(), offset);
+        if (!written) {
+            break;
+        }
+        assert(written == BLOCK_SIZE && !after_migrate);
+        std::copy(buf.begin(), buf.end(), model.begin() + offset);
+    }
+}
+
+int main(int argc, char **argv) {
+    if (argc != 2) {
+        printf("Usage: %s <blockv server>\n", argv[0]);
+        return -1;
+    }
+    // The client writes to connections of servers that were killed.
+    signal(SIGPIPE, SIG_IGN);
+    std::string dir = make_test_dir();
+    std::vector<char> model(DEVICE_SIZE);
+    fill_random(model.data(), model.size());
+    create_file(dir + "/image", model);
+    pid_t pid = start_server(argv[1], dir, { dir + "/image" });
+
+    std::atomic<bool> migrated(false);
+    std::vector<std::thread> writers;
+    for (int i = 0; i < WRITERS; i++) {
+        writers.emplace_back(writes_until_refused, std::ref(model), i, std::cref(migrated));
+    }
+    usleep(200 * 1000);
+    blockv_client client("127.0.0.1:" + std::to_string(BLOCKV_TEST_PORT));
+    int ret = client.migrate();
+    assert(ret == 0);
+    migrated = true;
+    for (auto& writer : writers) {
+        writer.join();
+    }
+
+    {
+        test_connection conn;
+        conn.set_timeout(30);
+        check_device(conn, model);
+        uint32_t error = conn.hello();
+        assert(error == 0);
+        std::vector<char> buf(BLOCK_SIZE);
+        conn.send_tagged_write(1, buf.data(), buf.size(), 0);
+        blockv_response_tag tag = conn.receive_tag();
+        assert(tag.handle == 1 && tag.error == EROFS);
+        conn.send_tagged_read(2, BLOCK_SIZE, 0);
+        tag = conn.receive_tag();
+        assert(tag.handle == 2 && tag.error == 0);
+        uint32_t size;
+        conn.receive(&size, sizeof(size));
+        assert(ntohl(size) == BLOCK_SIZE);
+        conn.receive(buf.data(), buf.size());
+        assert(!memcmp(buf.data(), model.data(), buf.size()));
+    }
+    stop_server(pid, SIGKILL);
+
+    pid = start_server(argv[1], dir, { dir + "/image" });
+    check_refuses_writes(model);
+    stop_server(pid, SIGTERM);
+
+    // A source that lost its marker takes writes again, until the client
+    // reconnects.
+    ret = unlink((dir + "/image.migrated").c_str());
+    assert(ret == 0);
+    pid = start_server(argv[1], dir, { dir + "/image" });
+    std::vector<char> buf(BLOCK_SIZE);
+    // The first read finds the connection dropped by the restart.
+    ret = client.read(buf.data(), buf.size(), 0);
+    assert(ret == -1);
+    ret = client.read(buf.data(), buf.size(), 0);
+    assert(ret == 0 && !memcmp(buf.data(), model.data(), buf.size()));
+    check_refuses_writes(model);
+    stop_server(pid, SIGTERM);
+
+    std::vector<char> image = read_file(dir + "/image");
+    assert(image == model);
+
+    remove_test_dir(dir);
+    printf("OK\n");
+    return 0;
+}
@@ -0,0 +1,87 @@
+/*
+ * Copyright (C) 2016 Raphael S. Carvalho
+ *
+ * This program can be distributed under the terms of the GNU GPL.
+ * See the file COPYING.
+ */
+
+#include <sys/mman.h>
+#include <thread>
+#include "blockv_test.hh"
+
+// Checks that a mirror keeps serving writes and reads when writes to one of
+// its members start failing while writers are busy, and that the healthy
+// member holds every write. The failing member is a memfd whose writes fail
+// with EPERM once it's sealed; the server inherits it and opens it through
+// /proc/self/fd. The server is then killed and restarted, and must still know
+// that the failing member missed writes.
+//
+// g++ --std=c++14 -O2 tests/blockv_mirror_test.cc -o blockv_mirror_test -lpthread
+// ./blockv_mirror_test ./blockv_server
+
+#define DEVICE_SIZE (4 * 1024 * 1024)
+#define WRITERS 4
+// Longer than any write should take, even on a slow machine.
+#define RESPONSE_TIMEOUT_S 30
+
+int main(int argc, char **argv) {
+    if (argc != 2) {
+        printf("Usage: %s <blockv server>\n", argv[0]);
+        return -1;
+    }
+    std::string dir = make_test_dir();
+    std::string healthy = dir + "/healthy";
+    std::vector<char> model(DEVICE_SIZE);
+    fill_random(model.data(), model.size());
+    create_file(healthy, model);
+    int failing_fd = memfd_create("blockv_mirror_test", MFD_ALLOW_SEALING);
+    assert(failing_fd != -1);
+    bool written = test_write_exact(failing_fd, model.data(), model.size());
+    assert(written);
+    // Stale blocks are kept next to the first member.
+    std::vector<std::string> args = { "--mirror", healthy, "/proc/self/fd/" + std::to_string(failing_fd) };
+
+    pid_t pid = start_server(argv[1], dir, args);
+    std::vector<std::thread> writers;
+    for (int i = 0; i < WRITERS; i++) {
+        writers.emplace_back([&model, i] {
+            test_connection conn;
+            conn.set_timeout(RESPONSE_TIMEOUT_S);
+            uint64_t region = DEVICE_SIZE / WRITERS;
+            for (int j = 0; j < 20; j++) {
+                random_writes(conn, model, i * region, (i + 1) * region, 20, 4096);
+                uint32_t error = conn.flush();
+                assert(error == 0);
+                usleep(10 * 1000);
+            }
+        });
+    }
+    usleep(100 * 1000);
+    int ret = fcntl(failing_fd, F_ADD_SEALS, F_SEAL_WRITE);
+    assert(ret == 0);
+    for (auto& writer : writers) {
+        writer.join();
+    }
+    {
+        test_connection conn;
+        conn.set_timeout(RESPONSE_TIMEOUT_S);
+        check_device(conn, model);
+    }
+    stop_server(pid, SIGKILL);
+
+    pid = start_server(argv[1], dir, args);
+    {
+        test_connection conn;
+        conn.set_timeout(RESPONSE_TIMEOUT_S);
+        check_device(conn, model);
+    }
+    stop_server(pid, SIGTERM);
+
+    std::vector<char> healthy_content = read_file(healthy);
+    assert(healthy_content == model);
+
+    close(failing_fd);
+    remove_test_dir(dir);
+    printf("OK\n");
+    return 0;
+}
@@ -0,0 +1,44 @@
+/*
+ * Copyright (C) 2016 Raphael S. Carvalho
+ *
+ * This program can be distributed under the terms of the GNU GPL.
+ * See the file COPYING.
+ */
+
+#include "blockv_test.hh"
+
+// Checks that flushed writes to an overlay export survive crashes of the
+// server while writers race to copy up the same overlay blocks from the base
+// image, and that the base image is never written.
+//
+// g++ --std=c++14 -O2 tests/blockv_overlay_test.cc -o blockv_overlay_test -lpthread
+// ./blockv_overlay_test ./blockv_server
+
+#define DEVICE_SIZE (8 * 1024 * 1024)
+#define BLOCK_SIZE 4096
+
+int main(int argc, char **argv) {
+    if (argc != 2) {
+        printf("Usage: %s <blockv server>\n", argv[0]);
+        return -1;
+    }
+    std::string dir = make_test_dir();
+    std::string base = dir + "/base";
+    std::vector<char> content(DEVICE_SIZE);
+    fill_random(content.data(), content.size());
+    create_file(base, content);
+    crash_model model(content, BLOCK_SIZE);
+    crash_workload workload;
+    // Writers share every 64K overlay block.
+    workload.pick_block = [&workload, &model] (unsigned writer) {
+        return interleaved_block(writer, workload.writers, model.blocks());
+    };
+    run_crash_rounds(argv[1], dir, { "--overlay-base=" + base, dir + "/delta" }, model, workload, 4);
+
+    std::vector<char> base_after = read_file(base);
+    assert(base_after == content);
+
+    remove_test_dir(dir);
+    printf("OK\n");
+    return 0;
+}
@@ -0,0 +1,124 @@
+/*
+ * Copyright (C) 2016 Raphael S. Carvalho
+ *
+ * This program can be distributed under the terms of the GNU GPL.
+ * See the file COPYING.
+ */
+
+#include <sys/mman.h>
+#include <set>
+#include "blockv_test.hh"
+
+// Checks the errors of tagged requests: requests whose deadline passed while
+// QoS held them back are dropped with ETIMEDOUT, cancelling a request that
+// isn't queued fails with ENOENT, and writes that fail in the device fail
+// with EIO, while untagged ones are answered with a size of 0. The failing
+// device is a sealed memfd, whose writes fail with EPERM; the server
+// inherits it and opens it through /proc/self/fd.
+//
+// g++ --std=c++14 -O2 tests/blockv_tagged_test.cc -o blockv_tagged_test -lpthread
+// ./blockv_tagged_test ./blockv_server
+
+#define DEVICE_SIZE (1024 * 1024)
+#define BLOCK_SIZE 4096
+#define REQUESTS 20
+
+static void check_deadlines(const char* server, const std::string& dir) {
+    std::vector<char> model(DEVICE_SIZE);
+    fill_random(model.data(), model.size());
+    create_file(dir + "/image", model);
+    pid_t pid = start_server(server, dir, { "--qos-iops=5", dir + "/image" });
+    {
+        test_connection conn;
+        conn.set_timeout(30);
+        uint32_t error = conn.hello();
+        assert(error == 0);
+        for (uint64_t handle = 0; handle < REQUESTS; handle++) {
+            conn.send_tagged_read(handle, BLOCK_SIZE, handle * BLOCK_SIZE, 100);
+        }
+        std::set<uint64_t> answered;
+        unsigned timed_out = 0;
+        for (unsigned i = 0; i < REQUESTS; i++) {
+            blockv_response_tag tag = conn.receive_tag();
+            bool first_answer = answered.insert(tag.handle).second;
+            assert(tag.handle < REQUESTS && first_answer);
+            if (tag.error == ETIMEDOUT) {
+                timed_out++;
+                continue;
+            }
+            assert(tag.error == 0);
+            uint32_t size;
+            conn.receive(&size, sizeof(size));
+            assert(ntohl(size) == BLOCK_SIZE);
+            std::vector<char> buf(BLOCK_SIZE);
+            conn.receive(buf.data(), buf.size());
+            assert(!memcmp(buf.data(), model.data() + tag.handle * BLOCK_SIZE, BLOCK_SIZE));
+        }
+        // Once the burst QoS allows is used up, requests wait 200ms to be
+        // admitted, longer than their deadline.
+        assert(timed_out > 0 && timed_out < REQUESTS);
+
+        conn.send_tag(REQUESTS);
+        blockv_cancel_request cancel_request = blockv_cancel_request::to_network(0);
+        conn.send(&cancel_request, blockv_cancel_request::serialized_size());
+        blockv_response_tag tag = conn.receive_tag();
+        assert(tag.handle == REQUESTS && tag.error == ENOENT);
+    }
+    stop_server(pid, SIGTERM);
+}
+
+static void check_failed_writes(const char* server, const std::string& dir) {
+    std::vector<char> model(DEVICE_SIZE);
+    fill_random(model.data(), model.size());
+    int fd = memfd_create("blockv_tagged_test", MFD_ALLOW_SEALING);
+    assert(fd != -1);
+    bool written = test_write_exact(fd, model.data(), model.size());
+    assert(written);
+    int ret = fcntl(fd, F_ADD_SEALS, F_SEAL_WRITE);
+    assert(ret == 0);
+    // Without coalescing, writes reach the device before they're answered.
+    pid_t pid = start_server(server, dir, { "--write-coalesce-delay=0", "/proc/self/fd/" + std::to_string(fd) });
+    std::vector<char> buf(BLOCK_SIZE);
+    fill_random(buf.data(), buf.size());
+    {
+        test_connection conn;
+        conn.set_timeout(30);
+        uint32_t size = conn.write(buf.data(), buf.size(), 0);
+        assert(size == 0);
+    }
+    {
+        test_connection conn;
+        conn.set_timeout(30);
+        uint32_t error = conn.hello();
+        assert(error == 0);
+        conn.send_tagged_write(1, buf.data(), buf.size(), BLOCK_SIZE);
+        blockv_response_tag tag = conn.receive_tag();
+        assert(tag.handle == 1 && tag.error == EIO);
+
+        // The connection is still usable, and the device unchanged.
+        conn.send_tagged_read(2, BLOCK_SIZE * 2, 0);
+        tag = conn.receive_tag();
+        assert(tag.handle == 2 && tag.error == 0);
+        uint32_t size;
+        conn.receive(&size, sizeof(size));
+        assert(ntohl(size) == BLOCK_SIZE * 2);
+        std::vector<char> read_buf(BLOCK_SIZE * 2);
+        conn.receive(read_buf.data(), read_buf.size());
+        assert(!memcmp(read_buf.data(), model.data(), read_buf.size()));
+    }
+    stop_server(pid, SIGTERM);
+    close(fd);
+}
+
+int main(int argc, char **argv) {
+    if (argc != 2) {
+        printf("Usage: %s <blockv server>\n", argv[0]);
+        return -1;
+    }
+    std::string dir = make_test_dir();
+    check_deadlines(argv[1], dir);
+    check_failed_writes(argv[1], dir);
+    remove_test_dir(dir);
+    printf("OK\n");
+    return 0;
+}
@@ -0,0 +1,471 @@
+/*
+ * Copyright (C) 2016 Raphael S. Carvalho
+ *
+ * This program can be distributed under the terms of the GNU GPL.
+ * See the file COPYING.
+ */
+
+#ifndef BLOCKV_TEST_H
+#define BLOCKV_TEST_H
+
+#include <sys/types.h>
+#include <sys/prctl.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/wait.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <errno.h>
+#include <assert.h>
+#include <algorithm>
+#include <atomic>
+#include <functional>
+#include <string>
+#include <thread>
+#include <vector>
+#include "../blockv_protocol.hh"
+
+// Helpers of the tests that run a blockv server: a test is given the path of
+// the server binary, starts it on files of a directory of its own with the
+// options it tests, talks to it with raw requests, and crashes or stops it to
+// check what the device reads back as after a restart. Tests are built and
+// run from the top of the tree, e.g.:
+//
+// g++ --std=c++14 -O2 tests/blockv_journal_test.cc -o blockv_journal_test -lpthread
+// ./blockv_journal_test ./blockv_server
+//
+// The server listens on a fixed port, so tests can't run in parallel.
+
+#define BLOCKV_TEST_PORT 22000
+// A server can't bind its port while connections it closed first linger in
+// TIME_WAIT, so the next one is retried for a while.
+#define BLOCKV_TEST_START_TIMEOUT_S 90
+
+static inline bool test_read_exact(int fd, void* buf, size_t size) {
+    while (size) {
+        ssize_t ret = ::read(fd, buf, size);
+        if (ret <= 0) {
+            return false;
+        }
+        buf = (char*)buf + ret;
+        size -= ret;
+    }
+    return true;
+}
+
+static inline bool test_write_exact(int fd, const void* buf, size_t size) {
+    while (size) {
+        ssize_t ret = ::write(fd, buf, size);
+        if (ret <= 0) {
+            return false;
+        }
+        buf = (const char*)buf + ret;
+        size -= ret;
+    }
+    return true;
+}
+
+// Connects to the server on the local host, and receives its info. Returns
+// the socket, or -1 if the server doesn't take connections.
+static inline int test_connect(blockv_server_info& info) {
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(BLOCKV_TEST_PORT);
+    inet_pton(AF_INET, "127.0.0.1", &addr.sin_addr);
+    if (connect(fd, (struct sockaddr*) &addr, sizeof(addr)) == -1 ||
+            !test_read_exact(fd, &info, blockv_server_info::serialized_size())) {
+        close(fd);
+        return -1;
+    }
+    blockv_server_info::to_host(info);
+    assert(info.is_valid());
+    return fd;
+}
+
+// Makes a directory for the files of a test.
+static inline std::string make_test_dir() {
+    char dir[] = "/tmp/blockv_test.XXXXXX";
+    if (!mkdtemp(dir)) {
+        perror("mkdtemp");
+        exit(1);
+    }
+    return dir;
+}
+
+static inline void remove_test_dir(const std::string& dir) {
+    std::string command = "rm -rf " + dir;
+    if (system(command.c_str()) != 0) {
+        printf("Unable to remove %s\n", dir.c_str());
+    }
+}
+
+static inline void fill_random(char* buf, size_t size) {
+    for (size_t i = 0; i < size; i++) {
+        buf[i] = rand();
+    }
+}
+
+static inline void create_file(const std::string& path, const std::vector<char>& content) {
+    int fd = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    assert(fd != -1);
+    bool written = test_write_exact(fd, content.data(), content.size());
+    assert(written);
+    close(fd);
+}
+
+static inline std::vector<char> read_file(const std::string& path) {
+    int fd = open(path.c_str(), O_RDONLY);
+    assert(fd != -1);
+    struct stat st;
+    fstat(fd, &st);
+    std::vector<char> content(st.st_size);
+    bool read = test_read_exact(fd, content.data(), content.size());
+    assert(read);
+    close(fd);
+    return content;
+}
+
+// Closes fd with a reset, so that neither end lingers in TIME_WAIT or
+// FIN_WAIT_2 and keeps the next server from binding the port, even if the
+// server closed first because it was killed.
+static inline void close_with_reset(int fd) {
+    struct linger linger = { 1, 0 };
+    setsockopt(fd, SOL_SOCKET, SO_LINGER, &linger, sizeof(linger));
+    close(fd);
+}
+
+// Starts the server with args, its output appended to <dir>/server.log, and
+// waits until it takes connections.
+static inline pid_t start_server(const char* server, const std::string& dir, const std::vector<std::string>& args) {
+    time_t deadline = time(nullptr) + BLOCKV_TEST_START_TIMEOUT_S;
+    for (;;) {
+        pid_t pid = fork();
+        assert(pid != -1);
+        if (pid == 0) {
+            // Not left running by a test that failed.
+            prctl(PR_SET_PDEATHSIG, SIGKILL);
+            int log_fd = open((dir + "/server.log").c_str(), O_WRONLY | O_CREAT | O_APPEND, 0644);
+            dup2(log_fd, 1);
+            dup2(log_fd, 2);
+            std::vector<char*> argv = { (char*) server };
+            for (auto& arg : args) {
+                argv.push_back((char*) arg.c_str());
+            }
+            argv.push_back(nullptr);
+            execv(server, argv.data());
+            perror("execv");
+            _exit(1);
+        }
+        while (waitpid(pid, nullptr, WNOHANG) == 0) {
+            blockv_server_info info;
+            int fd = test_connect(info);
+            if (fd != -1) {
+                close_with_reset(fd);
+                return pid;
+            }
+            usleep(100 * 1000);
+        }
+        // The server exited, e.g. because its port is still in use.
+        if (time(nullptr) > deadline) {
+            printf("Unable to start %s, see %s/server.log\n", server, dir.c_str());
+            exit(1);
+        }
+        sleep(1);
+    }
+}
+
+// Stops the server cleanly with SIGTERM, or crashes it with SIGKILL.
+static inline void stop_server(pid_t pid, int sig) {
+    kill(pid, sig);
+    int status;
+    waitpid(pid, &status, 0);
+    if (sig == SIGTERM) {
+        assert(WIFEXITED(status));
+    }
+}
+
+// Connection sending untagged requests, or tagged ones once it said hello.
+// A failed request fails the test, unless the connection is expected to be
+// dropped, e.g. by a crash of the server, in which case dropped is set and
+// responses read as zeros.
+struct test_connection {
+    int fd;
+    blockv_server_info info;
+    blockv_hello_response hello_response = {};
+    bool may_drop = false;
+    bool dropped = false;
+
+    test_connection() {
+        fd = test_connect(info);
+        assert(fd != -1);
+    }
+    ~test_connection() {
+        close_with_reset(fd);
+    }
+
+    test_connection(const test_connection&) = delete;
+    test_connection& operator=(const test_connection&) = delete;
+
+    // Fails the test instead of waiting forever for a response, e.g. of a
+    // server that deadlocked.
+    void set_timeout(int seconds) {
+        struct timeval timeout = { seconds, 0 };
+        setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    }
+
+    void send(const void* buf, size_t size) {
+        bool sent = !dropped && test_write_exact(fd, buf, size);
+        dropped = !sent;
+        assert(sent || may_drop);
+    }
+
+    void receive(void* buf, size_t size) {
+        bool received = !dropped && test_read_exact(fd, buf, size);
+        if (!received) {
+            memset(buf, 0, size);
+        }
+        dropped = !received;
+        assert(received || may_drop);
+    }
+
+    // Returns the size the server says it wrote.
+    uint32_t write(const char* buf, uint32_t size, uint64_t offset, bool fua = false) {
+        blockv_write_request* write_request = blockv_write_request::to_network(buf, size, offset, fua);
+        send(write_request, write_request->serialized_size());
+        delete[] (char *) write_request;
+        blockv_write_response write_response;
+        receive(&write_response, blockv_write_response::serialized_size());
+        blockv_write_response::to_host(write_response);
+        return write_response.size;
+    }
+
+    // Returns the size the server read.
+    uint32_t read(char* buf, uint32_t size, uint64_t offset) {
+        blockv_read_request read_request = blockv_read_request::to_network(size, offset);
+        send(&read_request, blockv_read_request::serialized_size());
+        uint32_t response_size;
+        receive(&response_size, sizeof(response_size));
+        response_size = ntohl(response_size);
+        assert(response_size <= size);
+        receive(buf, response_size);
+        return response_size;
+    }
+
+    // Returns the error of the flush.
+    uint32_t flush() {
+        blockv_flush_request flush_request;
+        send(&flush_request, blockv_flush_request::serialized_size());
+        blockv_flush_response flush_response;
+        receive(&flush_response, blockv_flush_response::serialized_size());
+        blockv_flush_response::to_host(flush_response);
+        return flush_response.error;
+    }
+
+    // Switches to tagged requests, returning the error of the hello.
+    uint32_t hello() {
+        blockv_hello_request hello_request;
+        send(&hello_request, blockv_hello_request::serialized_size());
+        receive(&hello_response, blockv_hello_response::serialized_size());
+        blockv_hello_response::to_host(hello_response);
+        return hello_response.error;
+    }
+
+    void send_tag(uint64_t handle, uint32_t deadline = 0, uint8_t priority = blockv_priorities::FOREGROUND) {
+        blockv_request_tag tag = blockv_request_tag::to_network(priority, handle, deadline);
+        send(&tag, blockv_request_tag::serialized_size());
+    }
+
+    void send_tagged_write(uint64_t handle, const char* buf, uint32_t size, uint64_t offset, uint32_t deadline = 0) {
+        send_tag(handle, deadline);
+        blockv_write_request* write_request = blockv_write_request::to_network(buf, size, offset);
+        send(write_request, write_request->serialized_size());
+        delete[] (char *) write_request;
+    }
+
+    void send_tagged_read(uint64_t handle, uint32_t size, uint64_t offset, uint32_t deadline = 0) {
+        send_tag(handle, deadline);
+        blockv_read_request read_request = blockv_read_request::to_network(size, offset);
+        send(&read_request, blockv_read_request::serialized_size());
+    }
+
+    // The response itself, if any, is left to be received by the caller.
+    blockv_response_tag receive_tag() {
+        blockv_response_tag tag;
+        receive(&tag, blockv_response_tag::serialized_size());
+        blockv_response_tag::to_host(tag);
+        return tag;
+    }
+};
+
+// Writes count blocks of random data at random offsets between begin and end
+// of a device whose content is modeled by model, which is updated to match.
+// Threads writing to disjoint ranges can share the model.
+static inline void random_writes(test_connection& conn, std::vector<char>& model, uint64_t begin, uint64_t end, unsigned count,
+        uint32_t block_size) {
+    std::vector<char> buf(block_size);
+    for (unsigned i = 0; i < count; i++) {
+        uint64_t offset = begin + (rand() % ((end - begin) / block_size)) * block_size;
+        fill_random(buf.data(), buf.size());
+        uint32_t written = conn.write(buf.data(), buf.size(), offset);
+        assert(written == block_size);
+        std::copy(buf.begin(), buf.end(), model.begin() + offset);
+    }
+}
+
+// Checks that the device reads back as model.
+static inline void check_device(test_connection& conn, const std::vector<char>& model) {
+    const uint32_t read_size = 1024 * 1024;
+    std::vector<char> buf(read_size);
+    for (uint64_t offset = 0; offset < model.size(); offset += read_size) {
+        uint32_t size = std::min(uint64_t(read_size), model.size() - offset);
+        uint32_t read = conn.read(buf.data(), size, offset);
+        assert(read == size);
+        if (memcmp(buf.data(), model.data() + offset, size)) {
+            printf("Mismatch in the %u bytes at offset %lu\n", size, offset);
+            assert(false);
+        }
+    }
+}
+
+// Content of a device written by the writers of a crash test, one block at a
+// time. After a crash, a block may read back as it was at the last flush of
+// its writer, or as any write sent to it since.
+struct crash_model {
+    uint32_t block_size;
+    std::vector<char> flushed;
+    std::vector<std::vector<std::vector<char>>> written;
+
+    crash_model(const std::vector<char>& content, uint32_t block_size)
+        : block_size(block_size)
+        , flushed(content)
+        , written(content.size() / block_size) {}
+
+    uint64_t blocks() const {
+        return written.size();
+    }
+};
+
+// What the writers of a crash test do: every writer writes blocks picked by
+// pick_block, whose content is made by fill, and flushes every
+// writes_per_flush writes. Writers must pick blocks of their own; see
+// interleaved_block().
+struct crash_workload {
+    unsigned writers = 4;
+    unsigned writes_per_flush = 50;
+    // Time writers run before the server is killed.
+    useconds_t run_time = 500 * 1000;
+    std::function<uint64_t(unsigned writer)> pick_block;
+    std::function<void(char*, size_t)> fill = fill_random;
+};
+
+// Picks a random block among the ones of writer, which owns every writers-th
+// block, so that writers share larger units of the backend, e.g. chunks.
+static inline uint64_t interleaved_block(unsigned writer, unsigned writers, uint64_t blocks) {
+    return (rand() % (blocks / writers)) * writers + writer;
+}
+
+static inline void crash_writer(crash_model& model, const crash_workload& workload, unsigned writer, const std::atomic<bool>& stop) {
+    test_connection conn;
+    conn.may_drop = true;
+    std::vector<uint64_t> unflushed;
+    std::vector<char> buf(model.block_size);
+    while (!stop) {
+        for (unsigned i = 0; i < workload.writes_per_flush && !stop; i++) {
+            uint64_t block = workload.pick_block(writer);
+            workload.fill(buf.data(), buf.size());
+            model.written[block].push_back(buf);
+            unflushed.push_back(block);
+            uint32_t size = conn.write(buf.data(), buf.size(), block * model.block_size);
+            if (conn.dropped) {
+                return;
+            }
+            assert(size == model.block_size);
+        }
+        uint32_t error = conn.flush();
+        if (conn.dropped) {
+            return;
+        }
+        assert(error == 0);
+        for (uint64_t block : unflushed) {
+            auto& written = model.written[block];
+            if (!written.empty()) {
+                std::copy(written.back().begin(), written.back().end(), model.flushed.begin() + block * model.block_size);
+                written.clear();
+            }
+        }
+        unflushed.clear();
+    }
+}
+
+// Checks every block against the model, which then holds what was read. If
+// exact is set, e.g. after a clean shutdown, blocks must read back as the
+// last write to them.
+static inline void check_crash_model(test_connection& conn, crash_model& model, bool exact) {
+    std::vector<char> buf(model.block_size);
+    for (uint64_t block = 0; block < model.blocks(); block++) {
+        uint32_t read = conn.read(buf.data(), buf.size(), block * model.block_size);
+        assert(read == model.block_size);
+        auto& written = model.written[block];
+        auto flushed = model.flushed.begin() + block * model.block_size;
+        bool match;
+        if (exact || written.empty()) {
+            match = std::equal(buf.begin(), buf.end(), (written.empty()) ? flushed : written.back().begin());
+        } else {
+            match = std::equal(buf.begin(), buf.end(), flushed) || std::find(written.begin(), written.end(), buf) != written.end();
+        }
+        if (!match) {
+            printf("Block %lu (offset %lu) matches neither its flushed content nor a write sent since\n", block,
+                block * model.block_size);
+            assert(false);
+        }
+        std::copy(buf.begin(), buf.end(), flushed);
+        written.clear();
+    }
+    // What was read must survive the next crash.
+    uint32_t error = conn.flush();
+    assert(error == 0);
+}
+
+// Runs rounds in which the writers of workload are busy when the server is
+// killed, checking the device against the model after every restart, then a
+// last round that ends with a clean shutdown.
+static inline void run_crash_rounds(const char* server, const std::string& dir, const std::vector<std::string>& args,
+        crash_model& model, const crash_workload& workload, unsigned rounds) {
+    // Writers may write to a connection the crash reset.
+    signal(SIGPIPE, SIG_IGN);
+    pid_t pid = start_server(server, dir, args);
+    for (unsigned round = 0; round <= rounds; round++) {
+        bool crash = round < rounds;
+        std::atomic<bool> stop(false);
+        std::vector<std::thread> writers;
+        for (unsigned i = 0; i < workload.writers; i++) {
+            writers.emplace_back(crash_writer, std::ref(model), std::cref(workload), i, std::cref(stop));
+        }
+        usleep(workload.run_time);
+        if (crash) {
+            kill(pid, SIGKILL);
+        }
+        stop = true;
+        for (auto& writer : writers) {
+            writer.join();
+        }
+        stop_server(pid, (crash) ? SIGKILL : SIGTERM);
+
+        pid = start_server(server, dir, args);
+        test_connection conn;
+        check_crash_model(conn, model, !crash);
+    }
+    stop_server(pid, SIGTERM);
+}
+
+#endif
@@ -0,0 +1,51 @@
+/*
+ * Copyright (C) 2016 Raphael S. Carvalho
+ *
+ * This program can be distributed under the terms of the GNU GPL.
+ * See the file COPYING.
+ */
+
+#include <chrono>
+#include "blockv_test.hh"
+
+// Checks that flushed writes to a tiered export survive crashes of the server
+// while extents are promoted and demoted under the writers. The hot set moves
+// every second, and a migration round runs every second too, so extents keep
+// moving between tiers while they're written.
+//
+// g++ --std=c++14 -O2 tests/blockv_tiered_test.cc -o blockv_tiered_test -lpthread
+// ./blockv_tiered_test ./blockv_server
+
+#define DEVICE_SIZE (16 * 1024 * 1024)
+#define FAST_SIZE (2 * 1024 * 1024)
+#define EXTENT_SIZE (256 * 1024)
+#define EXTENTS (DEVICE_SIZE / EXTENT_SIZE)
+#define HOT_EXTENTS 8
+#define BLOCK_SIZE 4096
+
+int main(int argc, char **argv) {
+    if (argc != 2) {
+        printf("Usage: %s <blockv server>\n", argv[0]);
+        return -1;
+    }
+    std::string dir = make_test_dir();
+    std::vector<char> content(DEVICE_SIZE);
+    fill_random(content.data(), content.size());
+    create_file(dir + "/slow", content);
+    create_file(dir + "/fast", std::vector<char>(FAST_SIZE));
+    crash_model model(content, BLOCK_SIZE);
+    crash_workload workload;
+    workload.run_time = 3 * 1000 * 1000;
+    auto start = std::chrono::steady_clock::now();
+    workload.pick_block = [&workload, start] (unsigned writer) {
+        auto elapsed = std::chrono::duration_cast<std::chrono::seconds>(std::chrono::steady_clock::now() - start).count();
+        uint64_t extent = (elapsed * HOT_EXTENTS * 3 + rand() % HOT_EXTENTS) % EXTENTS;
+        return extent * (EXTENT_SIZE / BLOCK_SIZE) + interleaved_block(writer, workload.writers, EXTENT_SIZE / BLOCK_SIZE);
+    };
+    run_crash_rounds(argv[1], dir, { "--tier-fast=" + dir + "/fast", "--tier-extent-size=" + std::to_string(EXTENT_SIZE),
+        "--tier-migration-interval=1", dir + "/slow" }, model, workload, 3);
+
+    remove_test_dir(dir);
+    printf("OK\n");
+    return 0;
+}